@@ -0,0 +1,199 @@
+// Own header
+#include "arena.h"
+
+// Project headers
+#include "thread_pool.h"
+
+// Standard headers
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+// Huge pages are 2 MB on x86-64. Rounding the arena up to a whole number of
+// them lets the kernel back all of it with huge pages.
+static size_t const HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// How much each thread copies aside at a time in FirstTouch().
+static size_t const STAGING_SIZE = 4 * 1024 * 1024;
+static unsigned const NO_OWNER = ~0u;
+
+
+Arena::Arena(size_t size, bool hugePages) {
+    m_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    m_used = 0;
+    m_pageKind = PAGES_NORMAL;
+
+#ifdef _WIN32
+    m_base = (char *)VirtualAlloc(NULL, m_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    // Explicit huge pages are reserved when the mapping is made, so if there
+    // aren't enough this fails straight away rather than when they're touched.
+    void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugePages) {
+        base = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED)
+            m_pageKind = PAGES_HUGE;
+    }
+#endif
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        if (base != MAP_FAILED && hugePages && madvise(base, m_size, MADV_HUGEPAGE) == 0)
+            m_pageKind = PAGES_TRANSPARENT_HUGE;
+#endif
+#ifdef MADV_NOHUGEPAGE
+        // Opt out, in case the kernel uses huge pages for everything, so that
+        // the two can be compared.
+        if (base != MAP_FAILED && !hugePages)
+            madvise(base, m_size, MADV_NOHUGEPAGE);
+#endif
+    }
+    m_base = base == MAP_FAILED ? NULL : (char *)base;
+#endif
+
+    if (!m_base)
+        m_size = 0;
+}
+
+
+Arena::~Arena() {
+    if (!m_base)
+        return;
+#ifdef _WIN32
+    VirtualFree(m_base, 0, MEM_RELEASE);
+#else
+    munmap(m_base, m_size);
+#endif
+}
+
+
+void *Arena::Alloc(size_t size) {
+    size = GetAllocSize(size);
+    if (size > m_size - m_used)
+        return NULL;
+    Allocation allocation = { m_used, size };
+    m_allocations.push_back(allocation);
+    void *rv = m_base + m_used;
+    m_used += size;
+    return rv;
+}
+
+
+char const *Arena::GetPageKindName(PageKind kind) {
+    static char const *names[] = { "normal", "transparent_huge", "huge" };
+    return names[kind];
+}
+
+
+bool Arena::FirstTouch(ThreadPool *pool) {
+#ifdef _WIN32
+    return false;
+#else
+    if (!m_base || m_used == 0)
+        return true;
+
+    // Pages are placed whole. Huge ones have to be given back whole too, or
+    // the kernel splits them into normal pages.
+    size_t pageSize = m_pageKind == PAGES_NORMAL ? (size_t)sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+    size_t numPages = (m_used + pageSize - 1) / pageSize;
+
+    // Pages that have never been touched are left for whoever touches them
+    // first, rather than being made resident here.
+    size_t const systemPageSize = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident((m_used + systemPageSize - 1) / systemPageSize);
+    if (mincore(m_base, m_used, resident.data()) != 0)
+        return false;
+
+    // Each page goes to the thread whose slice of an allocation its first
+    // byte is in.
+    unsigned numThreads = pool->GetNumThreads();
+    std::vector<unsigned> pageOwners(numPages);
+    unsigned allocationIndex = 0;
+    for (size_t page = 0; page < numPages; page++) {
+        size_t offset = page * pageSize;
+        while (offset >= m_allocations[allocationIndex].offset + m_allocations[allocationIndex].size)
+            allocationIndex++;
+        Allocation const &allocation = m_allocations[allocationIndex];
+        pageOwners[page] = ((offset - allocation.offset) * numThreads) / allocation.size;
+
+        size_t firstSystemPage = offset / systemPageSize;
+        size_t endSystemPage = std::min((offset + pageSize) / systemPageSize, resident.size());
+        bool isResident = false;
+        for (size_t i = firstSystemPage; i < endSystemPage; i++)
+            isResident |= resident[i] & 1;
+        if (!isResident)
+            pageOwners[page] = NO_OWNER;
+    }
+
+    // The pages are private and anonymous, so after MADV_DONTNEED the next
+    // touch of each gets a fresh zeroed one. Each thread stages a few of its
+    // pages at a time, rather than the whole arena being copied at once.
+    std::atomic<bool> ok(true);
+    pool->ForEachThread([&](unsigned k) {
+        size_t const stagingPages = std::max(STAGING_SIZE / pageSize, (size_t)1);
+        std::vector<char> staging(stagingPages * pageSize);
+        size_t page = 0;
+        while (page < numPages && ok) {
+            if (pageOwners[page] != k) {
+                page++;
+                continue;
+            }
+            size_t runEnd = page;
+            while (runEnd < numPages && runEnd - page < stagingPages && pageOwners[runEnd] == k)
+                runEnd++;
+
+            char *begin = m_base + page * pageSize;
+            size_t size = std::min(runEnd * pageSize, m_used) - page * pageSize;
+            memcpy(staging.data(), begin, size);
+            if (madvise(begin, (runEnd - page) * pageSize, MADV_DONTNEED) != 0) {
+                ok = false;
+                break;
+            }
+            memcpy(begin, staging.data(), size);
+            page = runEnd;
+        }
+    });
+    return ok;
+#endif
+}
+
+
+bool Arena::CountBytesPerNode(std::vector<size_t> *bytesPerNode) const {
+    bytesPerNode->clear();
+#if defined(__linux__) && defined(__NR_move_pages)
+    // move_pages() with no target nodes only reports where each page is.
+    size_t const pageSize = sysconf(_SC_PAGESIZE);
+    static unsigned const BATCH_SIZE = 1024;
+    void *pages[BATCH_SIZE];
+    int status[BATCH_SIZE];
+    for (size_t offset = 0; offset < m_used; offset += BATCH_SIZE * pageSize) {
+        size_t numPages = (m_used - offset + pageSize - 1) / pageSize;
+        unsigned batchSize = numPages < BATCH_SIZE ? numPages : BATCH_SIZE;
+        for (unsigned i = 0; i < batchSize; i++)
+            pages[i] = m_base + offset + i * pageSize;
+        if (syscall(__NR_move_pages, 0, batchSize, pages, NULL, status, 0) != 0)
+            return false;
+
+        // Pages that have never been touched aren't on any node.
+        for (unsigned i = 0; i < batchSize; i++) {
+            if (status[i] < 0)
+                continue;
+            if (bytesPerNode->size() <= (size_t)status[i])
+                bytesPerNode->resize(status[i] + 1, 0);
+            (*bytesPerNode)[status[i]] += pageSize;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+
+class ThreadPool;
+
+
+// A block of memory that allocations are carved from in order and that is
+// freed all at once. The block is reserved straight from the OS, so its pages
+// are zero and only become resident when they are first touched. On Linux it
+// is backed by 2 MB huge pages if the kernel has any reserved, and is otherwise
+// marked for transparent huge pages. Either cuts the TLB misses when large
+// particle arrays are swept every step.
+class Arena {
+public:
+    enum PageKind {
+        PAGES_NORMAL,
+        PAGES_TRANSPARENT_HUGE,     // Huge where the kernel manages to find them.
+        PAGES_HUGE                  // Explicit huge pages, from /proc/sys/vm/nr_hugepages.
+    };
+
+private:
+    struct Allocation {
+        size_t offset;
+        size_t size;
+    };
+
+    char *m_base;
+    size_t m_size;
+    size_t m_used;
+    PageKind m_pageKind;
+    std::vector<Allocation> m_allocations;
+
+public:
+    static size_t const ALIGNMENT = 64;     // Cache line size.
+
+    // Size is in bytes. Call GetAllocSize() for each array to work it out. If
+    // hugePages is false, normal pages are used.
+    Arena(size_t size, bool hugePages = true);
+    ~Arena();
+
+    // Returns NULL if the arena is full.
+    void *Alloc(size_t size);
+
+    template <typename T>
+    T *AllocArray(size_t count) { return (T *)Alloc(sizeof(T) * count); }
+
+    // How much of the arena an allocation of this size uses.
+    static size_t GetAllocSize(size_t size) { return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+
+    size_t GetSize() const { return m_size; }
+    PageKind GetPageKind() const { return m_pageKind; }
+    static char const *GetPageKindName(PageKind kind);
+
+    // Has thread k of the pool give back to the OS the pages in the k-th of
+    // GetNumThreads() equal slices of every allocation, and write their
+    // contents back. Each page is then on the NUMA node of the thread that
+    // first touches it, which is the one that will mostly work on that slice.
+    // See ThreadPool. Returns false if the pages couldn't be given back, as on
+    // Windows, or with explicit huge pages before Linux 5.18. The contents are
+    // kept either way.
+    bool FirstTouch(ThreadPool *pool);
+
+    // Adds up how many bytes of the arena's resident pages are on each NUMA
+    // node, indexed by node. Returns false if the kernel can't say.
+    bool CountBytesPerNode(std::vector<size_t> *bytesPerNode) const;
+};
@@ -0,0 +1,472 @@
+// Own header
+#include "bench.h"
+
+// Project headers
+#include "arena.h"
+#include "particles.h"
+#include "perf_counters.h"
+#include "thread_pool.h"
+#include "walls.h"
+
+// Deadfrog headers
+#include "df_bmp.h"
+#include "df_time.h"
+
+// Standard headers
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+struct BenchOptions {
+    unsigned numSteps;
+    unsigned numThreads;
+    bool deterministic;         // See Particles::SetDeterministic().
+    char const *kernelName;     // NULL means the best one the CPU supports.
+    char const *layoutName;     // "rowmajor", "morton" or "both".
+    char const *formatName;     // "float", "fixed" or "both".
+    char const *hugePagesName;  // "on", "off" or "both". See Arena.
+    int tileSize;               // Negative means leave it at the default.
+    bool autoTileSize;          // Use GetAutoTileSize() instead of tileSize.
+    char const *outFilename;
+    char const *wallsFilename;  // NULL for no walls.
+    bool wallSdf;               // Collide with the walls' signed distance field instead of their spheres.
+    unsigned reductionInterval; // See Particles::SetReductionInterval().
+    bool occupancyKernels;      // See Particles::SetOccupancyKernels().
+    float verletSkin;           // See Particles::SetVerletSkin().
+    ParticlesConfig particlesConfig;
+};
+
+
+// One simulation setup to measure.
+struct BenchConfig {
+    std::string name;
+    Particles::CellLayout layout;
+    ParticlesConfig::Format format;
+    bool hugePages;
+};
+
+
+struct BenchResult {
+    char const *name;
+    double minMs;
+    double medianMs;
+    double p99Ms;
+    double stepsPerSec;
+    unsigned numParticles;      // Counted after the run. Should equal the number requested.
+    double kineticEnergy;       // After the run. Collisions are elastic, so this should barely drift.
+    unsigned long long checksum;    // Of the state after the run. See Particles::CalcChecksum().
+    unsigned tileSize;
+    unsigned bytesPerParticle;
+    double speedupVsFloat;      // Steps/sec relative to the float format with the same layout. Zero if not measured.
+    double speedupVsSmallPages; // Steps/sec relative to the same config without huge pages. Zero if not measured.
+    double dtlbMissesVsSmallPages;          // Ditto, for DTLB read misses.
+    Arena::PageKind pageKind;
+    bool memoryPlaced;          // See Particles::GetMemoryPlaced().
+    bool numaAvailable;
+    std::vector<size_t> bytesPerNode;       // See Arena::CountBytesPerNode(). After the run.
+    Particles::OccupancyStats occupancy;    // Summed over all the steps.
+    unsigned long long numVerletBuilds;
+    double verletPairsPerParticle;          // At the last build.
+
+    bool countersAvailable[PerfCounters::NUM_COUNTERS];
+    double countsPerStep[PerfCounters::NUM_COUNTERS];
+};
+
+
+static void PrintUsage() {
+    fprintf(stderr,
+        "Usage: ideal_gas_sim --bench [--steps N] [--seed N] [--threads N] [--deterministic]\n"
+        "                            [--particles N] [--world WxH] [--grid-res N]\n"
+        "                            [--species RADIUS:MASS[,RADIUS:MASS...]]\n"
+        "                            [--kernel scalar|sse41|avx2|avx512]\n"
+        "                            [--layout rowmajor|morton|both] [--tile-size N|auto]\n"
+        "                            [--format float|fixed|both] [--huge-pages on|off|both]\n"
+        "                            [--walls FILE.bmp]\n"
+        "                            [--wall-sdf] [--reduce-every N] [--occupancy-kernels on|off]\n"
+        "                            [--verlet-skin S] [--out FILE]\n");
+}
+
+
+static bool ParseOptions(int argc, char *argv[], BenchOptions *opts) {
+    opts->numSteps = 1000;
+    opts->numThreads = ThreadPool::GetNumHardwareThreads();
+    opts->deterministic = false;
+    opts->kernelName = NULL;
+    opts->layoutName = "rowmajor";
+    opts->formatName = "float";
+    opts->hugePagesName = "on";
+    opts->tileSize = -1;
+    opts->autoTileSize = false;
+    opts->outFilename = NULL;
+    opts->wallsFilename = NULL;
+    opts->wallSdf = false;
+    opts->reductionInterval = 0;
+    opts->occupancyKernels = true;
+    opts->verletSkin = 0.0f;
+
+    for (int i = 1; i < argc; i++) {
+        char const *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "--format") == 0 && hasValue)
+            opts->formatName = argv[++i];
+        else if (strcmp(arg, "--huge-pages") == 0 && hasValue)
+            opts->hugePagesName = argv[++i];
+        else if (strcmp(arg, "--bench") == 0 || opts->particlesConfig.ParseOption(argc, argv, &i))
+            continue;
+        else if (strcmp(arg, "--steps") == 0 && hasValue)
+            opts->numSteps = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--threads") == 0 && hasValue)
+            opts->numThreads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--deterministic") == 0)
+            opts->deterministic = true;
+        else if (strcmp(arg, "--kernel") == 0 && hasValue)
+            opts->kernelName = argv[++i];
+        else if (strcmp(arg, "--layout") == 0 && hasValue)
+            opts->layoutName = argv[++i];
+        else if (strcmp(arg, "--tile-size") == 0 && hasValue) {
+            i++;
+            opts->autoTileSize = strcmp(argv[i], "auto") == 0;
+            opts->tileSize = atoi(argv[i]);
+        }
+        else if (strcmp(arg, "--out") == 0 && hasValue)
+            opts->outFilename = argv[++i];
+        else if (strcmp(arg, "--walls") == 0 && hasValue)
+            opts->wallsFilename = argv[++i];
+        else if (strcmp(arg, "--wall-sdf") == 0)
+            opts->wallSdf = true;
+        else if (strcmp(arg, "--reduce-every") == 0 && hasValue)
+            opts->reductionInterval = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--occupancy-kernels") == 0 && hasValue)
+            opts->occupancyKernels = strcmp(argv[++i], "off") != 0;
+        else if (strcmp(arg, "--verlet-skin") == 0 && hasValue)
+            opts->verletSkin = atof(argv[++i]);
+        else
+            return false;
+    }
+
+    ParticlesConfig const &config = opts->particlesConfig;
+    bool floatOnly = strcmp(opts->formatName, "float") == 0;
+    bool fixedOk = floatOnly || (config.numSpecies == 0 && config.HasSquareCells());
+    return opts->numSteps > 0 && opts->numThreads > 0 && config.IsValid() && fixedOk;
+}
+
+
+static bool GetConfigs(BenchOptions const &opts, std::vector<BenchConfig> *configs) {
+    bool bothLayouts = strcmp(opts.layoutName, "both") == 0;
+    bool bothFormats = strcmp(opts.formatName, "both") == 0;
+    bool doFloat = bothFormats || strcmp(opts.formatName, "float") == 0;
+    bool doFixed = bothFormats || strcmp(opts.formatName, "fixed") == 0;
+    if (bothLayouts || strcmp(opts.layoutName, "rowmajor") == 0) {
+        BenchConfig config = { "rowmajor", Particles::LAYOUT_ROW_MAJOR, ParticlesConfig::FORMAT_FLOAT, true };
+        if (doFloat)
+            configs->push_back(config);
+        config.name = "rowmajor_fixed";
+        config.format = ParticlesConfig::FORMAT_FIXED;
+        if (doFixed)
+            configs->push_back(config);
+    }
+
+    // The fixed point format only supports the row-major layout.
+    if ((bothLayouts && doFloat) || (strcmp(opts.layoutName, "morton") == 0 && !doFixed)) {
+        BenchConfig config = { "morton", Particles::LAYOUT_MORTON, ParticlesConfig::FORMAT_FLOAT, true };
+        configs->push_back(config);
+    }
+
+    // Each config is run again with small pages, to compare with.
+    bool bothPages = strcmp(opts.hugePagesName, "both") == 0;
+    if (strcmp(opts.hugePagesName, "off") == 0) {
+        for (unsigned i = 0; i < configs->size(); i++)
+            (*configs)[i].hugePages = false;
+    }
+    else if (bothPages) {
+        unsigned numConfigs = configs->size();
+        for (unsigned i = 0; i < numConfigs; i++) {
+            BenchConfig config = (*configs)[i];
+            config.name += "_small_pages";
+            config.hugePages = false;
+            configs->push_back(config);
+        }
+    }
+    else if (strcmp(opts.hugePagesName, "on") != 0)
+        return false;
+
+    return !configs->empty();
+}
+
+
+// Advances the particles numSteps times, timing each step individually. The
+// counters only count the steps.
+static void MeasureSteps(Particles *particles, unsigned numSteps, PerfCounters *counters, BenchResult *result) {
+    std::vector<double> stepTimes(numSteps);
+    double totalTime = 0.0;
+    memset(&result->occupancy, 0, sizeof(result->occupancy));
+    counters->Start();
+    for (unsigned i = 0; i < numSteps; i++) {
+        double startTime = GetRealTime();
+        particles->Advance();
+        stepTimes[i] = GetRealTime() - startTime;
+        totalTime += stepTimes[i];
+        result->occupancy.Add(particles->GetOccupancyStats());
+    }
+    counters->Pause();
+
+    std::sort(stepTimes.begin(), stepTimes.end());
+    unsigned p99Index = (numSteps * 99) / 100;
+    if (p99Index >= numSteps)
+        p99Index = numSteps - 1;
+
+    result->minMs = stepTimes[0] * 1000.0;
+    result->medianMs = stepTimes[numSteps / 2] * 1000.0;
+    result->p99Ms = stepTimes[p99Index] * 1000.0;
+    result->stepsPerSec = totalTime > 0.0 ? numSteps / totalTime : 0.0;
+    result->numParticles = particles->Count();
+    result->numVerletBuilds = particles->GetNumVerletBuilds();
+    result->verletPairsPerParticle = (double)particles->GetNumVerletPairs() / result->numParticles;
+    result->kineticEnergy = particles->CalcKineticEnergy();
+    result->checksum = particles->CalcChecksum();
+}
+
+
+// Returns false if the options asked for something this machine can't do.
+static bool RunConfig(BenchOptions const &opts, BenchConfig const &config, Walls *walls, BenchResult *result) {
+    ParticlesConfig particlesConfig = opts.particlesConfig;
+    particlesConfig.format = config.format;
+    particlesConfig.hugePages = config.hugePages;
+    Particles *particles = new Particles(particlesConfig);
+    if (opts.kernelName && !particles->SetCollisionKernel(opts.kernelName)) {
+        fprintf(stderr, "Collision kernel '%s' isn't supported on this machine\n", opts.kernelName);
+        delete particles;
+        return false;
+    }
+    if (!particles->SetCellLayout(config.layout)) {
+        fprintf(stderr, "The grid is too big for the '%s' layout\n", config.name.c_str());
+        delete particles;
+        return false;
+    }
+    particles->SetWalls(walls);
+    particles->SetReductionInterval(opts.reductionInterval);
+    particles->SetDeterministic(opts.deterministic);
+    particles->SetOccupancyKernels(opts.occupancyKernels);
+    if (!particles->SetVerletSkin(opts.verletSkin)) {
+        fprintf(stderr, "Verlet lists need the float format, the row-major layout and cells wider than the contact distance plus the skin\n");
+        delete particles;
+        return false;
+    }
+    if (opts.autoTileSize)
+        particles->SetTileSize(particles->GetAutoTileSize());
+    else if (opts.tileSize >= 0)
+        particles->SetTileSize(opts.tileSize);
+
+    // The worker threads are created after the counters, so that their events
+    // are counted too. Their counts are added in when they exit. Creating
+    // them also places the memory, which isn't counted.
+    PerfCounters counters;
+    particles->SetNumThreads(opts.numThreads);
+    result->memoryPlaced = particles->GetMemoryPlaced();
+
+    result->name = config.name.c_str();
+    result->tileSize = particles->GetTileSize();
+    result->bytesPerParticle = particles->GetBytesPerParticle();
+    result->speedupVsFloat = 0.0;
+    result->speedupVsSmallPages = 0.0;
+    result->dtlbMissesVsSmallPages = 0.0;
+    MeasureSteps(particles, opts.numSteps, &counters, result);
+
+    // Where the threads' first touches put the pages. See Particles::SetNumThreads().
+    result->pageKind = particles->GetArena()->GetPageKind();
+    result->numaAvailable = particles->GetArena()->CountBytesPerNode(&result->bytesPerNode);
+
+    particles->SetNumThreads(1);
+    counters.Stop();
+    for (unsigned i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+        result->countersAvailable[i] = counters.IsAvailable(i);
+        result->countsPerStep[i] = (double)counters.GetCount(i) / opts.numSteps;
+    }
+
+    delete particles;
+    return true;
+}
+
+
+// Writes what share of the cell pairs each occupancy kernel handled, and how
+// often it found a touching pair and had to fall back to the general path.
+static void WriteOccupancy(FILE *out, Particles::OccupancyStats const &stats) {
+    unsigned long long total = stats.numGeneral;
+    for (unsigned a = 0; a < Particles::MAX_KERNEL_OCCUPANCY; a++) {
+        for (unsigned b = 0; b < Particles::MAX_KERNEL_OCCUPANCY; b++)
+            total += stats.pairCalls[a][b];
+        total += stats.selfCalls[a];
+    }
+    if (total == 0)
+        total = 1;
+
+    fprintf(out, ", \"occupancy_kernels\": {");
+    for (unsigned a = 0; a < Particles::MAX_KERNEL_OCCUPANCY; a++) {
+        for (unsigned b = 0; b < Particles::MAX_KERNEL_OCCUPANCY; b++) {
+            unsigned long long calls = stats.pairCalls[a][b];
+            fprintf(out, "\"%ux%u\": {\"share\": %.4f, \"touch_rate\": %.4f}, ", a + 1, b + 1,
+                    (double)calls / total, calls ? (double)stats.pairTouches[a][b] / calls : 0.0);
+        }
+    }
+    for (unsigned n = 2; n <= Particles::MAX_KERNEL_OCCUPANCY; n++) {
+        unsigned long long calls = stats.selfCalls[n - 1];
+        fprintf(out, "\"self%u\": {\"share\": %.4f, \"touch_rate\": %.4f}, ", n,
+                (double)calls / total, calls ? (double)stats.selfTouches[n - 1] / calls : 0.0);
+    }
+    fprintf(out, "\"general_share\": %.4f}", (double)stats.numGeneral / total);
+}
+
+
+static void WriteReport(FILE *out, BenchOptions const &opts, char const *kernelName,
+                        std::vector<BenchResult> const &results) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"seed\": %u,\n", opts.particlesConfig.seed);
+    fprintf(out, "  \"steps\": %u,\n", opts.numSteps);
+    fprintf(out, "  \"threads\": %u,\n", opts.numThreads);
+    fprintf(out, "  \"deterministic\": %s,\n", opts.deterministic ? "true" : "false");
+    fprintf(out, "  \"kernel\": \"%s\",\n", kernelName);
+    fprintf(out, "  \"walls\": %s%s%s,\n", opts.wallsFilename ? "\"" : "",
+            opts.wallsFilename ? opts.wallsFilename : "null", opts.wallsFilename ? "\"" : "");
+    fprintf(out, "  \"wall_sdf\": %s,\n", opts.wallSdf ? "true" : "false");
+    fprintf(out, "  \"reduce_every\": %u,\n", opts.reductionInterval);
+    fprintf(out, "  \"occupancy_kernels\": %s,\n", opts.occupancyKernels ? "true" : "false");
+    fprintf(out, "  \"verlet_skin\": %g,\n", opts.verletSkin);
+    fprintf(out, "  \"huge_pages\": \"%s\",\n", opts.hugePagesName);
+
+    ParticlesConfig const &config = opts.particlesConfig;
+    fprintf(out, "  \"particles\": %u,\n", config.numParticles);
+    fprintf(out, "  \"world\": [%u, %u],\n", config.worldSizeX, config.worldSizeY);
+    fprintf(out, "  \"grid\": [%u, %u],\n", config.GetGridResX(), config.GetGridResY());
+    fprintf(out, "  \"species\": [");
+    for (unsigned s = 0; s < config.numSpecies; s++)
+        fprintf(out, "%s{\"radius\": %g, \"mass\": %g}", s ? ", " : "", config.speciesRadius[s], config.speciesMass[s]);
+    fprintf(out, "],\n");
+    fprintf(out, "  \"results\": [\n");
+    for (unsigned i = 0; i < results.size(); i++) {
+        BenchResult const &r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"min_ms\": %.4f, \"median_ms\": %.4f, "
+            "\"p99_ms\": %.4f, \"steps_per_sec\": %.2f, \"particles_after\": %u, "
+            "\"kinetic_energy_after\": %.1f, \"checksum\": \"%016llx\", \"tile_size\": %u, "
+            "\"bytes_per_particle\": %u",
+            r.name, r.minMs, r.medianMs, r.p99Ms, r.stepsPerSec, r.numParticles, r.kineticEnergy,
+            r.checksum, r.tileSize, r.bytesPerParticle);
+        if (r.speedupVsFloat > 0.0)
+            fprintf(out, ", \"speedup_vs_float\": %.3f", r.speedupVsFloat);
+        fprintf(out, ", \"pages\": \"%s\", \"memory_placed\": %s", Arena::GetPageKindName(r.pageKind),
+                r.memoryPlaced ? "true" : "false");
+        if (r.speedupVsSmallPages > 0.0)
+            fprintf(out, ", \"speedup_vs_small_pages\": %.3f", r.speedupVsSmallPages);
+        if (r.dtlbMissesVsSmallPages > 0.0)
+            fprintf(out, ", \"dtlb_misses_vs_small_pages\": %.3f", r.dtlbMissesVsSmallPages);
+
+        // In MB, indexed by node. Null if the kernel can't say.
+        fprintf(out, ", \"numa_mb_per_node\": ");
+        if (r.numaAvailable) {
+            fprintf(out, "[");
+            for (unsigned n = 0; n < r.bytesPerNode.size(); n++)
+                fprintf(out, "%s%.1f", n ? ", " : "", r.bytesPerNode[n] / (1024.0 * 1024.0));
+            fprintf(out, "]");
+        }
+        else
+            fprintf(out, "null");
+        if (opts.verletSkin > 0.0f)
+            fprintf(out, ", \"verlet_builds\": %llu, \"verlet_pairs_per_particle\": %.2f",
+                    r.numVerletBuilds, r.verletPairsPerParticle);
+        else if (opts.occupancyKernels)
+            WriteOccupancy(out, r.occupancy);
+
+        // Unavailable counters are reported as null.
+        for (unsigned j = 0; j < PerfCounters::NUM_COUNTERS; j++) {
+            fprintf(out, ", \"%s_per_step\": ", PerfCounters::GetName(j));
+            if (r.countersAvailable[j])
+                fprintf(out, "%.0f", r.countsPerStep[j]);
+            else
+                fprintf(out, "null");
+        }
+
+        fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+
+int RunBenchmark(int argc, char *argv[]) {
+    BenchOptions opts;
+    std::vector<BenchConfig> configs;
+    if (!ParseOptions(argc, argv, &opts) || !GetConfigs(opts, &configs)) {
+        PrintUsage();
+        return 1;
+    }
+
+    char const *kernelName = opts.kernelName ? opts.kernelName : GetBestCollisionKernel().name;
+
+    Walls *walls = NULL;
+    if (opts.wallsFilename) {
+        DfBitmap *bmp = LoadBmp(opts.wallsFilename);
+        if (!bmp) {
+            fprintf(stderr, "Couldn't load walls from '%s'\n", opts.wallsFilename);
+            return 1;
+        }
+        walls = new Walls;
+        walls->Load(bmp);
+        BitmapDelete(bmp);
+        if (opts.wallSdf)
+            walls->BakeSdf();
+    }
+
+    std::vector<BenchResult> results;
+    for (unsigned i = 0; i < configs.size(); i++) {
+        BenchResult result;
+        if (!RunConfig(opts, configs[i], walls, &result))
+            return 1;
+        results.push_back(result);
+    }
+    delete walls;
+
+    // Compare each fixed point result with the float one for the same layout.
+    for (unsigned i = 0; i < configs.size(); i++) {
+        if (configs[i].format != ParticlesConfig::FORMAT_FIXED)
+            continue;
+        for (unsigned j = 0; j < configs.size(); j++) {
+            if (configs[j].format == ParticlesConfig::FORMAT_FLOAT && configs[j].layout == configs[i].layout &&
+                configs[j].hugePages == configs[i].hugePages)
+                results[i].speedupVsFloat = results[i].stepsPerSec / results[j].stepsPerSec;
+        }
+    }
+
+    // And each huge page result with the small page one for the same config.
+    unsigned const dtlb = PerfCounters::DTLB_READ_MISSES;
+    for (unsigned i = 0; i < configs.size(); i++) {
+        if (!configs[i].hugePages)
+            continue;
+        for (unsigned j = 0; j < configs.size(); j++) {
+            if (configs[j].hugePages || configs[j].format != configs[i].format || configs[j].layout != configs[i].layout)
+                continue;
+            results[i].speedupVsSmallPages = results[i].stepsPerSec / results[j].stepsPerSec;
+            if (results[i].countersAvailable[dtlb] && results[j].countersAvailable[dtlb] &&
+                results[j].countsPerStep[dtlb] > 0.0)
+                results[i].dtlbMissesVsSmallPages = results[i].countsPerStep[dtlb] / results[j].countsPerStep[dtlb];
+        }
+    }
+
+    FILE *out = stdout;
+    if (opts.outFilename) {
+        out = fopen(opts.outFilename, "w");
+        if (!out) {
+            fprintf(stderr, "Couldn't open '%s' for writing\n", opts.outFilename);
+            return 1;
+        }
+    }
+
+    WriteReport(out, opts, kernelName, results);
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
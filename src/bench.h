@@ -0,0 +1,7 @@
+#pragma once
+
+
+// Runs the simulation without a window for a fixed number of steps and writes
+// a JSON timing report. Invoked with "ideal_gas_sim --bench [options]". Returns
+// the process exit code.
+int RunBenchmark(int argc, char *argv[]);
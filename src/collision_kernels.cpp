@@ -0,0 +1,94 @@
+// Own header
+#include "collision_kernels.h"
+
+// Standard headers
+#include <string.h>
+
+
+unsigned FindHitsScalar(float x, float y, float const *xs, float const *ys,
+                        unsigned begin, unsigned end, float maxDistSqrd, unsigned *hits) {
+    unsigned numHits = 0;
+    for (unsigned j = begin; j < end; j++) {
+        float dx = x - xs[j];
+        float dy = y - ys[j];
+        if (dx * dx + dy * dy < maxDistSqrd)
+            hits[numHits++] = j;
+    }
+
+    return numHits;
+}
+
+
+enum {
+    CPU_SSE41 = 1,
+    CPU_AVX2 = 2,
+    CPU_AVX512 = 4
+};
+
+
+static unsigned GetCpuFeatures() {
+    unsigned features = 0;
+
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 0);
+    int maxLeaf = regs[0];
+
+    __cpuid(regs, 1);
+    bool osXsave = (regs[2] & (1 << 27)) != 0;
+    if (regs[2] & (1 << 19))
+        features |= CPU_SSE41;
+
+    if (maxLeaf >= 7 && osXsave) {
+        // Check the OS saves the YMM and ZMM registers on context switches.
+        unsigned long long xcr0 = _xgetbv(0);
+        bool ymmEnabled = (xcr0 & 0x6) == 0x6;
+        bool zmmEnabled = (xcr0 & 0xe6) == 0xe6;
+
+        __cpuidex(regs, 7, 0);
+        if (ymmEnabled && (regs[1] & (1 << 5)))
+            features |= CPU_AVX2;
+        if (zmmEnabled && (regs[1] & (1 << 16)))
+            features |= CPU_AVX512;
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        features |= CPU_SSE41;
+    if (__builtin_cpu_supports("avx2"))
+        features |= CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+        features |= CPU_AVX512;
+#endif
+
+    return features;
+}
+
+
+CollisionKernel GetCollisionKernel(char const *name) {
+    unsigned features = GetCpuFeatures();
+    CollisionKernel kernel = { name, NULL };
+
+    if (strcmp(name, "scalar") == 0)
+        kernel.findHits = FindHitsScalar;
+    else if (strcmp(name, "sse41") == 0 && (features & CPU_SSE41))
+        kernel.findHits = GetFindHitsSse41();
+    else if (strcmp(name, "avx2") == 0 && (features & CPU_AVX2))
+        kernel.findHits = GetFindHitsAvx2();
+    else if (strcmp(name, "avx512") == 0 && (features & CPU_AVX512))
+        kernel.findHits = GetFindHitsAvx512();
+
+    return kernel;
+}
+
+
+CollisionKernel GetBestCollisionKernel() {
+    static char const *names[] = { "avx512", "avx2", "sse41" };
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        CollisionKernel kernel = GetCollisionKernel(names[i]);
+        if (kernel.findHits)
+            return kernel;
+    }
+
+    return GetCollisionKernel("scalar");
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+// Narrow-phase collision kernels. Each one tests a single particle against a
+// contiguous range of candidate particles and writes out the indices of the
+// candidates it overlaps. There is one kernel per instruction set; each lives
+// in its own translation unit so that it can be compiled with the flags for
+// its instruction set, and the best one the CPU supports is picked at runtime.
+
+
+// Writes the index of every particle j in [begin, end) whose distance squared
+// from (x, y) is less than maxDistSqrd to hits, and returns how many there
+// were. hits must have room for end - begin entries. The kernels may read up
+// to COLLISION_KERNEL_PADDING floats past the end of xs and ys.
+typedef unsigned (*FindHitsFunc)(float x, float y, float const *xs, float const *ys,
+                                 unsigned begin, unsigned end, float maxDistSqrd,
+                                 unsigned *hits);
+
+static unsigned const COLLISION_KERNEL_PADDING = 16;
+
+
+struct CollisionKernel {
+    char const *name;
+    FindHitsFunc findHits;
+};
+
+
+// Returns the fastest kernel this CPU supports.
+CollisionKernel GetBestCollisionKernel();
+
+// Returns the kernel with the specified name ("scalar", "sse41", "avx2" or
+// "avx512"), or one with a NULL findHits if it isn't supported by this CPU or
+// wasn't compiled in.
+CollisionKernel GetCollisionKernel(char const *name);
+
+
+// The individual kernels. The SIMD ones return NULL if the compiler wasn't
+// able to build them.
+unsigned FindHitsScalar(float x, float y, float const *xs, float const *ys,
+                        unsigned begin, unsigned end, float maxDistSqrd, unsigned *hits);
+FindHitsFunc GetFindHitsSse41();
+FindHitsFunc GetFindHitsAvx2();
+FindHitsFunc GetFindHitsAvx512();
+
+
+static inline unsigned CountTrailingZeros(unsigned a) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, a);
+    return index;
+#else
+    return __builtin_ctz(a);
+#endif
+}
+
+
+static inline unsigned CountBits(unsigned a) {
+#ifdef _MSC_VER
+    return __popcnt(a);
+#else
+    return __builtin_popcount(a);
+#endif
+}
@@ -0,0 +1,49 @@
+// Compiled with -mavx2.
+
+// Own header
+#include "collision_kernels.h"
+
+// Standard headers
+#include <immintrin.h>
+
+
+#if defined(__AVX2__) || defined(_MSC_VER)
+
+static unsigned FindHitsAvx2(float x, float y, float const *xs, float const *ys,
+                             unsigned begin, unsigned end, float maxDistSqrd, unsigned *hits) {
+    __m256 px = _mm256_set1_ps(x);
+    __m256 py = _mm256_set1_ps(y);
+    __m256 maxD2 = _mm256_set1_ps(maxDistSqrd);
+
+    unsigned numHits = 0;
+    for (unsigned j = begin; j < end; j += 8) {
+        __m256 dx = _mm256_sub_ps(px, _mm256_loadu_ps(xs + j));
+        __m256 dy = _mm256_sub_ps(py, _mm256_loadu_ps(ys + j));
+        __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        unsigned mask = _mm256_movemask_ps(_mm256_cmp_ps(d2, maxD2, _CMP_LT_OQ));
+
+        // Ignore the lanes past the end of the range.
+        if (end - j < 8)
+            mask &= (1 << (end - j)) - 1;
+
+        while (mask) {
+            hits[numHits++] = j + CountTrailingZeros(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    return numHits;
+}
+
+
+FindHitsFunc GetFindHitsAvx2() {
+    return FindHitsAvx2;
+}
+
+#else
+
+FindHitsFunc GetFindHitsAvx2() {
+    return NULL;
+}
+
+#endif
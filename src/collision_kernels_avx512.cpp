@@ -0,0 +1,50 @@
+// Compiled with -mavx512f.
+
+// Own header
+#include "collision_kernels.h"
+
+// Standard headers
+#include <immintrin.h>
+
+
+// Visual Studio only has the AVX-512 intrinsics from 2017 onwards.
+#if defined(__AVX512F__) || (defined(_MSC_VER) && _MSC_VER >= 1911)
+
+static unsigned FindHitsAvx512(float x, float y, float const *xs, float const *ys,
+                               unsigned begin, unsigned end, float maxDistSqrd, unsigned *hits) {
+    __m512 px = _mm512_set1_ps(x);
+    __m512 py = _mm512_set1_ps(y);
+    __m512 maxD2 = _mm512_set1_ps(maxDistSqrd);
+    __m512i laneOffsets = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    unsigned numHits = 0;
+    for (unsigned j = begin; j < end; j += 16) {
+        // Ignore the lanes past the end of the range.
+        __mmask16 valid = end - j < 16 ? (__mmask16)((1 << (end - j)) - 1) : (__mmask16)0xffff;
+
+        __m512 dx = _mm512_sub_ps(px, _mm512_loadu_ps(xs + j));
+        __m512 dy = _mm512_sub_ps(py, _mm512_loadu_ps(ys + j));
+        __m512 d2 = _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx));
+        __mmask16 mask = _mm512_mask_cmp_ps_mask(valid, d2, maxD2, _CMP_LT_OQ);
+
+        // Pack the indices of the hits together.
+        __m512i indices = _mm512_add_epi32(_mm512_set1_epi32(j), laneOffsets);
+        _mm512_mask_compressstoreu_epi32(hits + numHits, mask, indices);
+        numHits += CountBits(mask);
+    }
+
+    return numHits;
+}
+
+
+FindHitsFunc GetFindHitsAvx512() {
+    return FindHitsAvx512;
+}
+
+#else
+
+FindHitsFunc GetFindHitsAvx512() {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,39 @@
+// Compiled with -msse4.1.
+
+// Own header
+#include "collision_kernels.h"
+
+// Standard headers
+#include <smmintrin.h>
+
+
+static unsigned FindHitsSse41(float x, float y, float const *xs, float const *ys,
+                              unsigned begin, unsigned end, float maxDistSqrd, unsigned *hits) {
+    __m128 px = _mm_set1_ps(x);
+    __m128 py = _mm_set1_ps(y);
+    __m128 maxD2 = _mm_set1_ps(maxDistSqrd);
+
+    unsigned numHits = 0;
+    for (unsigned j = begin; j < end; j += 4) {
+        __m128 dx = _mm_sub_ps(px, _mm_loadu_ps(xs + j));
+        __m128 dy = _mm_sub_ps(py, _mm_loadu_ps(ys + j));
+        __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        unsigned mask = _mm_movemask_ps(_mm_cmplt_ps(d2, maxD2));
+
+        // Ignore the lanes past the end of the range.
+        if (end - j < 4)
+            mask &= (1 << (end - j)) - 1;
+
+        while (mask) {
+            hits[numHits++] = j + CountTrailingZeros(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    return numHits;
+}
+
+
+FindHitsFunc GetFindHitsSse41() {
+    return FindHitsSse41;
+}
@@ -0,0 +1,316 @@
+// Own header
+#include "domain.h"
+
+// Project headers
+#include "transport.h"
+
+// Deadfrog headers
+#include "df_common.h"
+#include "df_time.h"
+
+// Standard headers
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+Domain::Domain(ParticlesConfig const &config, Transport *transport) {
+    m_transport = transport;
+    m_rank = transport->GetRank();
+    m_numRanks = transport->GetNumRanks();
+    m_numMigrated = 0;
+    m_numGhosts = 0;
+    m_numSubSteps = 0;
+
+    unsigned gridResY = config.GetGridResY();
+    m_stripBegin = (gridResY * (unsigned long long)m_rank) / m_numRanks;
+    m_stripEnd = (gridResY * (unsigned long long)(m_rank + 1)) / m_numRanks;
+    m_firstRow = m_stripBegin - (HasAbove() ? 1 : 0);
+    unsigned endRow = m_stripEnd + (HasBelow() ? 1 : 0);
+    float cellSizeY = (float)config.worldSizeY / gridResY;
+    m_originY = m_firstRow * cellSizeY;
+
+    // Room for twice this strip's share of the particles, to allow for them
+    // bunching up, plus the ghosts.
+    unsigned long long expected = (config.numParticles * (unsigned long long)(endRow - m_firstRow)) / gridResY;
+    ParticlesConfig localConfig = config;
+    localConfig.numParticles = 0;
+    localConfig.capacity = std::min(expected * 2 + 1024, (unsigned long long)config.numParticles + 1024);
+    localConfig.numRows = endRow - m_firstRow;
+    m_particles = new Particles(localConfig, false);
+
+    // Every rank goes through all the particles, so that each gets the same
+    // starting state as it would in a single Particles.
+    unsigned localBegin = m_stripBegin - m_firstRow;
+    unsigned localEnd = m_stripEnd - m_firstRow;
+    std::vector<ParticleState> ours;
+    for (unsigned i = 0; i < config.numParticles; i++) {
+        ParticleState state = Particles::GetStartingState(i, config.seed, config.worldSizeX, config.worldSizeY);
+        unsigned row = std::min((unsigned)(state.y / cellSizeY), gridResY - 1);
+        if (row >= m_stripBegin && row < m_stripEnd) {
+            state.y -= m_originY;
+            ours.push_back(state);
+        }
+    }
+    ReleaseAssert(m_particles->AddParticles(ours.data(), ours.size(), localBegin, localEnd - 1),
+                  "Domain %u has no room for its %u particles", m_rank, (unsigned)ours.size());
+}
+
+
+Domain::~Domain() {
+    delete m_particles;
+}
+
+
+unsigned Domain::Swap(unsigned peer, std::vector<ParticleState> *particles, unsigned minRow, unsigned maxRow) {
+    for (unsigned i = 0; i < particles->size(); i++)
+        (*particles)[i].y += m_originY;
+    bool ok = m_transport->Exchange(peer, particles->data(), particles->size() * sizeof(ParticleState), &m_received);
+    ReleaseAssert(ok, "Domain %u lost its connection to domain %u", m_rank, peer);
+
+    unsigned count = m_received.size() / sizeof(ParticleState);
+    ParticleState *received = (ParticleState *)m_received.data();
+    for (unsigned i = 0; i < count; i++)
+        received[i].y -= m_originY;
+    ReleaseAssert(m_particles->AddParticles(received, count, minRow, maxRow),
+                  "Domain %u has run out of room for particles", m_rank);
+    return count;
+}
+
+
+void Domain::SubStep(float advanceTime) {
+    Particles *particles = m_particles;
+    unsigned localBegin = m_stripBegin - m_firstRow;
+    unsigned localEnd = m_stripEnd - m_firstRow;
+    unsigned lastRow = particles->m_gridResY - 1;
+
+    particles->SetAdvanceTime(advanceTime);
+    particles->IntegrateStep();
+
+    // Migrate.
+    m_toAbove.clear();
+    m_toBelow.clear();
+    particles->RemoveParticlesOutsideRows(localBegin, localEnd - 1, &m_toAbove, &m_toBelow);
+    m_numMigrated += m_toAbove.size() + m_toBelow.size();
+    if (HasAbove())
+        Swap(m_rank - 1, &m_toAbove, localBegin, localEnd - 1);
+    if (HasBelow())
+        Swap(m_rank + 1, &m_toBelow, localBegin, localEnd - 1);
+
+    // Exchange the halo rows.
+    m_toAbove.clear();
+    m_toBelow.clear();
+    if (HasAbove())
+        particles->CopyParticlesInRows(localBegin, localBegin, &m_toAbove);
+    if (HasBelow())
+        particles->CopyParticlesInRows(localEnd - 1, localEnd - 1, &m_toBelow);
+    if (HasAbove())
+        m_numGhosts += Swap(m_rank - 1, &m_toAbove, 0, 0);
+    if (HasBelow())
+        m_numGhosts += Swap(m_rank + 1, &m_toBelow, lastRow, lastRow);
+
+    particles->CollideStep();
+
+    // The ghosts were sorted into the halo rows, at the ends of the arrays.
+    // Drop the bottom ones first, so that the top ones' indices still hold.
+    unsigned *cellStart = particles->m_cellStart;
+    if (HasBelow())
+        particles->RemoveParticles(cellStart[lastRow * particles->m_gridResX], particles->m_numParticles);
+    if (HasAbove())
+        particles->RemoveParticles(0, cellStart[particles->m_gridResX]);
+
+    m_numSubSteps++;
+}
+
+
+void Domain::Step(float advanceTime) {
+    double remaining = advanceTime;
+    while (remaining > 0.0) {
+        double maxStableTime = m_particles->GetMaxStableTime();
+        ReleaseAssert(m_transport->AllReduceMin(&maxStableTime), "Domain %u lost its connections", m_rank);
+        unsigned numSteps = maxStableTime >= remaining ? 1 : (unsigned)ceil(remaining / maxStableTime);
+        float subStepTime = remaining / numSteps;
+        SubStep(subStepTime);
+        remaining = numSteps == 1 ? 0.0 : remaining - subStepTime;
+    }
+}
+
+
+unsigned Domain::CountParticles() {
+    double count = m_particles->m_numParticles;
+    ReleaseAssert(m_transport->AllReduceSum(&count), "Domain %u lost its connections", m_rank);
+    return (unsigned)count;
+}
+
+
+double Domain::CalcKineticEnergy() {
+    double energy = m_particles->CalcKineticEnergy();
+    ReleaseAssert(m_transport->AllReduceSum(&energy), "Domain %u lost its connections", m_rank);
+    return energy;
+}
+
+
+//
+// The --domains mode
+
+struct DomainsOptions {
+    unsigned numDomains;
+    unsigned numSteps;
+    unsigned numThreads;        // Per domain.
+    float advanceTime;          // Per step. Sub-stepped as needed.
+    char const *outFilename;
+    ParticlesConfig particlesConfig;
+};
+
+
+// What each rank sends rank 0 for the report.
+struct DomainReport {
+    unsigned stripBegin;
+    unsigned stripEnd;
+    unsigned numParticles;
+    unsigned long long numMigrated;
+    unsigned long long numGhosts;
+};
+
+
+static void PrintUsage() {
+    fprintf(stderr,
+        "Usage: ideal_gas_sim --domains N [--steps N] [--threads N] [--advance-time SECONDS]\n"
+        "                                 [--particles N] [--world WxH] [--grid-res N] [--seed N]\n"
+        "                                 [--out FILE]\n");
+}
+
+
+static bool ParseOptions(int argc, char *argv[], DomainsOptions *opts) {
+    opts->numDomains = 0;
+    opts->numSteps = 1000;
+    opts->numThreads = 1;
+    opts->advanceTime = 0.001f;
+    opts->outFilename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        char const *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (opts->particlesConfig.ParseOption(argc, argv, &i))
+            continue;
+        else if (strcmp(arg, "--domains") == 0 && hasValue)
+            opts->numDomains = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--steps") == 0 && hasValue)
+            opts->numSteps = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--threads") == 0 && hasValue)
+            opts->numThreads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--advance-time") == 0 && hasValue)
+            opts->advanceTime = atof(argv[++i]);
+        else if (strcmp(arg, "--out") == 0 && hasValue)
+            opts->outFilename = argv[++i];
+        else
+            return false;
+    }
+
+    // Each strip needs two rows, so that its first and last rows, whose
+    // particles are sent as ghosts, are different. ParticleState has no
+    // species, so only the default one can migrate.
+    ParticlesConfig const &config = opts->particlesConfig;
+    return opts->numDomains > 0 && opts->numSteps > 0 && opts->numThreads > 0 && opts->advanceTime > 0.0f &&
+           config.IsValid() && config.format == ParticlesConfig::FORMAT_FLOAT && config.numSpecies == 0 &&
+           config.GetGridResY() >= opts->numDomains * 2;
+}
+
+
+static void WriteReport(FILE *out, DomainsOptions const &opts, unsigned numBefore, unsigned numAfter,
+                        double energyBefore, double energyAfter, unsigned long long numSubSteps,
+                        double seconds, std::vector<DomainReport> const &reports) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"domains\": %u,\n", opts.numDomains);
+    fprintf(out, "  \"transport\": \"unix_socket\",\n");
+    fprintf(out, "  \"threads_per_domain\": %u,\n", opts.numThreads);
+    fprintf(out, "  \"steps\": %u,\n", opts.numSteps);
+    fprintf(out, "  \"sub_steps\": %llu,\n", numSubSteps);
+    fprintf(out, "  \"seed\": %u,\n", opts.particlesConfig.seed);
+    fprintf(out, "  \"particles_before\": %u,\n", numBefore);
+    fprintf(out, "  \"particles_after\": %u,\n", numAfter);
+    fprintf(out, "  \"kinetic_energy_before\": %.6g,\n", energyBefore);
+    fprintf(out, "  \"kinetic_energy_after\": %.6g,\n", energyAfter);
+    fprintf(out, "  \"steps_per_sec\": %.2f,\n", opts.numSteps / seconds);
+    fprintf(out, "  \"ranks\": [\n");
+    for (unsigned r = 0; r < reports.size(); r++) {
+        DomainReport const &report = reports[r];
+        fprintf(out, "    { \"rank\": %u, \"rows\": [%u, %u], \"particles\": %u, "
+                     "\"migrated_per_sub_step\": %.1f, \"ghosts_per_sub_step\": %.1f }%s\n",
+                r, report.stripBegin, report.stripEnd, report.numParticles,
+                (double)report.numMigrated / numSubSteps, (double)report.numGhosts / numSubSteps,
+                r + 1 < reports.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+
+// Every rank runs this, from the fork in CreateSocketTransport() on.
+static bool RunRank(DomainsOptions const &opts, Transport *transport) {
+    Domain domain(opts.particlesConfig, transport);
+    domain.GetParticles()->SetNumThreads(opts.numThreads);
+
+    unsigned numBefore = domain.CountParticles();
+    double energyBefore = domain.CalcKineticEnergy();
+    double startTime = GetRealTime();
+    for (unsigned i = 0; i < opts.numSteps; i++)
+        domain.Step(opts.advanceTime);
+    double seconds = GetRealTime() - startTime;
+    unsigned numAfter = domain.CountParticles();
+    double energyAfter = domain.CalcKineticEnergy();
+
+    DomainReport report;
+    report.stripBegin = domain.GetStripBegin();
+    report.stripEnd = domain.GetStripEnd();
+    report.numParticles = domain.GetParticles()->m_numParticles;
+    report.numMigrated = domain.GetNumMigrated();
+    report.numGhosts = domain.GetNumGhosts();
+    if (transport->GetRank() != 0)
+        return transport->Send(0, &report, sizeof(report));
+
+    std::vector<DomainReport> reports(1, report);
+    std::vector<char> message;
+    for (unsigned r = 1; r < transport->GetNumRanks(); r++) {
+        if (!transport->Receive(r, &message) || message.size() != sizeof(DomainReport))
+            return false;
+        memcpy(&report, message.data(), sizeof(report));
+        reports.push_back(report);
+    }
+
+    FILE *out = stdout;
+    if (opts.outFilename) {
+        out = fopen(opts.outFilename, "w");
+        if (!out) {
+            fprintf(stderr, "Couldn't open '%s' for writing\n", opts.outFilename);
+            return false;
+        }
+    }
+
+    WriteReport(out, opts, numBefore, numAfter, energyBefore, energyAfter,
+                domain.GetNumSubSteps(), seconds, reports);
+
+    if (out != stdout)
+        fclose(out);
+
+    return numAfter == numBefore;
+}
+
+
+int RunDomains(int argc, char *argv[]) {
+    DomainsOptions opts;
+    if (!ParseOptions(argc, argv, &opts)) {
+        PrintUsage();
+        return 1;
+    }
+
+    Transport *transport = CreateSocketTransport(opts.numDomains);
+    if (!transport)
+        return 1;
+
+    bool ok = RunRank(opts, transport);
+    delete transport;
+    return ok ? 0 : 1;
+}
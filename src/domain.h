@@ -0,0 +1,87 @@
+#pragma once
+
+#include "particles.h"
+#include <vector>
+
+
+class Transport;
+
+
+// Splits the world between processes, for worlds too big for one machine's
+// memory bandwidth. The grid is cut into horizontal strips of whole rows, one
+// per rank. Each rank's Domain owns the particles in its strip, in a Particles
+// whose grid is the strip plus a halo row on each side that has a neighbour.
+// Each sub-step:
+// 1. Every rank integrates its own particles.
+// 2. The particles that left the strip migrate to the neighbour whose strip
+//    they moved into. A particle moves less than a cell per sub-step, so never
+//    further than that.
+// 3. Copies of the particles in the strip's first and last rows are sent to the
+//    neighbours, which bin them into their halo rows as ghosts.
+// 4. Every rank collides its particles and ghosts, then drops the ghosts.
+//
+// A colliding pair that straddles two strips is handled on both sides, and
+// each side keeps its own particle's half of the result. The two sides can
+// reach the pair at different points in their sweeps, so momentum is only
+// conserved approximately across the boundaries.
+//
+// Only FORMAT_FLOAT and the row-major layout are supported, and there are no walls.
+class Domain {
+    Transport *m_transport;
+    Particles *m_particles;
+    unsigned m_rank;
+    unsigned m_numRanks;
+
+    // Rows of the whole grid. The strip is m_stripBegin to m_stripEnd - 1, and
+    // m_particles' row 0 is m_firstRow.
+    unsigned m_firstRow;
+    unsigned m_stripBegin;
+    unsigned m_stripEnd;
+    float m_originY;            // The world y of the top of m_particles' grid.
+
+    // Scratch space for the messages.
+    std::vector<ParticleState> m_toAbove;
+    std::vector<ParticleState> m_toBelow;
+    std::vector<char> m_received;
+
+    unsigned long long m_numMigrated;   // Sent to the neighbours, in total.
+    unsigned long long m_numGhosts;     // Received from the neighbours, in total.
+    unsigned long long m_numSubSteps;
+
+    bool HasAbove() { return m_rank > 0; }
+    bool HasBelow() { return m_rank + 1 < m_numRanks; }
+
+    // Sends particles to a neighbour, and adds the ones it sends back, binned
+    // into local rows minRow to maxRow. Returns how many were received.
+    unsigned Swap(unsigned peer, std::vector<ParticleState> *particles, unsigned minRow, unsigned maxRow);
+    void SubStep(float advanceTime);
+
+public:
+    // Every rank must construct its Domain with the same config. Each places
+    // its share of the particles that a single Particles with that config would.
+    Domain(ParticlesConfig const &config, Transport *transport);
+    ~Domain();
+
+    Particles *GetParticles() { return m_particles; }
+    unsigned GetStripBegin() { return m_stripBegin; }
+    unsigned GetStripEnd() { return m_stripEnd; }
+    unsigned long long GetNumMigrated() { return m_numMigrated; }
+    unsigned long long GetNumGhosts() { return m_numGhosts; }
+    unsigned long long GetNumSubSteps() { return m_numSubSteps; }
+
+    // Covers advanceTime in as few equal sub-steps as keep every rank's fastest
+    // particle from tunnelling, like World::Step(). Every rank must call this
+    // and the functions below together.
+    void Step(float advanceTime);
+
+    // Over all the ranks.
+    unsigned CountParticles();
+    double CalcKineticEnergy();
+};
+
+
+// Runs the simulation split between N processes on this machine, connected by
+// Unix domain sockets, and writes a JSON report of whether the particles and
+// their energy were conserved. Invoked with "ideal_gas_sim --domains N
+// [options]". Returns the process exit code.
+int RunDomains(int argc, char *argv[]);
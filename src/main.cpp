@@ -1,4 +1,11 @@
 // Project headers
+#include "bench.h"
+#include "domain.h"
+#include "particles.h"
+#include "recorder.h"
+#include "renderer.h"
+#include "sim_thread.h"
+#include "thread_pool.h"
 #include "world.h"
 
 // Deadfrog headers
@@ -13,37 +20,198 @@
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 
 int main(int argc, char *argv[]) {
-    g_window = CreateWin(WORLD_SIZE_X * 1.5, WORLD_SIZE_Y * 1.5, WT_WINDOWED_FIXED, "Ideal Gas Simulator");
-    g_world.m_viewScale = (float)g_window->bmp->width / WORLD_SIZE_X;
+    ParticlesConfig config;
+    unsigned numThreads = ThreadPool::GetNumHardwareThreads();
+    unsigned numRenderThreads = numThreads;
+    bool deterministic = false;
+    char const *kernelName = NULL;
+    bool morton = false;
+    int tileSize = -1;      // Negative means leave it at the default.
+    bool autoTileSize = false;
+    float verletSkin = 0.0f;
+    bool occupancyKernels = true;
+    char const *wallsFilename = NULL;
+    bool wallSdf = false;
+    char const *restoreFilename = NULL;
+    char const *checkpointFilename = NULL;
+    unsigned checkpointInterval = 1000;     // In world steps.
+    char const *recordFilename = NULL;
+    unsigned recordPositionInterval = 100;  // In steps.
+    unsigned recordDecimation = 1;
+    int reductionInterval = -1;             // Negative means every step if recording, otherwise never.
+
+    // The other modes have options of their own, which may come first.
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0)
+            return RunBenchmark(argc, argv);
+        if (strcmp(argv[i], "--domains") == 0)
+            return RunDomains(argc, argv);
+    }
+
+    bool optionsOk = true;
+    for (int i = 1; i < argc && optionsOk; i++) {
+        char const *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (config.ParseOption(argc, argv, &i))
+            continue;
+        else if (strcmp(arg, "--threads") == 0 && hasValue)
+            numThreads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--render-threads") == 0 && hasValue)
+            numRenderThreads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--deterministic") == 0)
+            deterministic = true;
+        else if (strcmp(arg, "--walls") == 0 && hasValue)
+            wallsFilename = argv[++i];
+        else if (strcmp(arg, "--wall-sdf") == 0)
+            wallSdf = true;
+        else if (strcmp(arg, "--restore") == 0 && hasValue)
+            restoreFilename = argv[++i];
+        else if (strcmp(arg, "--checkpoint") == 0 && hasValue)
+            checkpointFilename = argv[++i];
+        else if (strcmp(arg, "--checkpoint-every") == 0 && hasValue)
+            checkpointInterval = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--record") == 0 && hasValue)
+            recordFilename = argv[++i];
+        else if (strcmp(arg, "--record-positions") == 0 && hasValue)
+            recordPositionInterval = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--record-decimate") == 0 && hasValue)
+            recordDecimation = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--reduce-every") == 0 && hasValue)
+            reductionInterval = atoi(argv[++i]);
+        else if (strcmp(arg, "--kernel") == 0 && hasValue)
+            kernelName = argv[++i];
+        else if (strcmp(arg, "--layout") == 0 && hasValue) {
+            i++;
+            morton = strcmp(argv[i], "morton") == 0;
+            optionsOk = morton || strcmp(argv[i], "rowmajor") == 0;
+        }
+        else if (strcmp(arg, "--tile-size") == 0 && hasValue) {
+            i++;
+            autoTileSize = strcmp(argv[i], "auto") == 0;
+            tileSize = atoi(argv[i]);
+        }
+        else if (strcmp(arg, "--verlet-skin") == 0 && hasValue)
+            verletSkin = atof(argv[++i]);
+        else if (strcmp(arg, "--occupancy-kernels") == 0 && hasValue)
+            occupancyKernels = strcmp(argv[++i], "off") != 0;
+        else
+            optionsOk = false;
+    }
+
+    if (!optionsOk || !config.IsValid() || checkpointInterval == 0) {
+        fprintf(stderr, "Usage: ideal_gas_sim [--particles N] [--world WxH] [--grid-res N] [--format float|fixed] [--seed N] [--deterministic]\n"
+                        "                     [--species RADIUS:MASS[,RADIUS:MASS...]] [--huge-pages on|off]\n"
+                        "                     [--walls FILE.bmp] [--wall-sdf] [--threads N] [--render-threads N] [--kernel NAME] [--layout rowmajor|morton] [--tile-size N|auto]\n"
+                        "                     [--verlet-skin S] [--occupancy-kernels on|off]\n"
+                        "                     [--restore FILE] [--checkpoint FILE] [--checkpoint-every STEPS]\n"
+                        "                     [--record FILE] [--record-positions STEPS] [--record-decimate N] [--reduce-every STEPS]\n");
+        return 1;
+    }
+
+    // A snapshot replaces the particle options, and the walls unless --walls is given too.
+    if (restoreFilename) {
+        if (!g_world.LoadSnapshot(restoreFilename)) {
+            fprintf(stderr, "Couldn't restore snapshot '%s'\n", restoreFilename);
+            return 1;
+        }
+    }
+    else {
+        g_world.Init(config);
+    }
+    if (wallsFilename && !g_world.LoadWalls(wallsFilename, wallSdf)) {
+        fprintf(stderr, "Couldn't load walls from '%s'\n", wallsFilename);
+        return 1;
+    }
+    Particles *particles = g_world.m_particles;
+    if (kernelName && !particles->SetCollisionKernel(kernelName)) {
+        fprintf(stderr, "Collision kernel '%s' isn't supported on this machine\n", kernelName);
+        return 1;
+    }
+    if (morton && !particles->SetCellLayout(Particles::LAYOUT_MORTON))
+        fprintf(stderr, "The Morton layout doesn't support this grid size or particle format\n");
+    if (autoTileSize)
+        particles->SetTileSize(particles->GetAutoTileSize());
+    else if (tileSize >= 0)
+        particles->SetTileSize(tileSize);
+    if (verletSkin > 0.0f && !particles->SetVerletSkin(verletSkin))
+        fprintf(stderr, "Verlet lists need the float format, the row-major layout and cells wider than the contact distance plus the skin\n");
+    particles->SetNumThreads(numThreads > 0 ? numThreads : 1);
+    particles->SetDeterministic(deterministic);
+    particles->SetOccupancyKernels(occupancyKernels);
+
+    if (recordFilename) {
+        Recorder *recorder = new Recorder;
+        if (!recorder->Open(recordFilename, recordPositionInterval, recordDecimation)) {
+            fprintf(stderr, "Couldn't create recording '%s'\n", recordFilename);
+            return 1;
+        }
+        g_world.m_recorder = recorder;
+    }
+    if (reductionInterval >= 0)
+        particles->SetReductionInterval(reductionInterval);
+    else if (recordFilename)
+        particles->SetReductionInterval(1);
+
+    // The window is the same size whatever the size of the world.
+    g_window = CreateWin(ParticlesConfig::DEFAULT_WORLD_SIZE_X * 1.5, ParticlesConfig::DEFAULT_WORLD_SIZE_Y * 1.5,
+                         WT_WINDOWED_FIXED, "Ideal Gas Simulator");
+    g_world.m_viewScale = (float)g_window->bmp->width / g_world.m_sizeX;
+    g_world.m_renderer = new Renderer(numRenderThreads > 0 ? numRenderThreads : 1);
     DfFont *font = LoadFontFromMemory(df_mono_8x15, sizeof(df_mono_8x15));
 
-    int frameNum = 0;
-    double totalAdvanceTime = 0.0;
+    // The simulation runs on its own thread, and this one just draws the
+    // newest frame it has published.
+    SimThread simThread(&g_world);
+    if (checkpointFilename)
+        simThread.SetCheckpoint(checkpointFilename, checkpointInterval);
+    simThread.Start();
+
+    double rateStartTime = GetRealTime();
+    unsigned long long rateStartSteps = 0;
+    double rateStartSimTime = 0.0;
+    unsigned stepsPerSecond = 0;
+    double simSpeed = 0.0;      // Simulated seconds per real second.
     while (!g_window->windowClosed && !g_window->input.keys[KEY_ESC]) {
         BitmapClear(g_window->bmp, g_colourBlack);
         InputPoll(g_window);
+        g_world.HandleInput();
 
-        double startTime = GetRealTime();
-        g_world.Advance();
-        double duration = GetRealTime() - startTime;
-        if (frameNum < 500)
-            totalAdvanceTime += duration;
+        SimFrame const *frame = simThread.GetFrame();
+        g_world.Render(g_window->bmp, *frame);
 
-        g_world.Render(g_window->bmp);
+        double now = GetRealTime();
+        if (now - rateStartTime >= 1.0) {
+            stepsPerSecond = (frame->numSteps - rateStartSteps) / (now - rateStartTime);
+            simSpeed = (frame->simTime - rateStartSimTime) / (now - rateStartTime);
+            rateStartSteps = frame->numSteps;
+            rateStartSimTime = frame->simTime;
+            rateStartTime = now;
+        }
 
         RectFill(g_window->bmp, g_window->bmp->width - 54, 0, 54, 13, g_colourBlack);
         DrawTextRight(font, g_colourWhite, g_window->bmp, g_window->bmp->width - 2, 0, "FPS:%i", g_window->fps);
 
-        RectFill(g_window->bmp, 0, 0, 130, 13, g_colourBlack);
-        DrawTextLeft(font, g_colourWhite, g_window->bmp, 2, 0, "Bench Time: %.2f", totalAdvanceTime);
+        RectFill(g_window->bmp, 0, 0, 480, 13, g_colourBlack);
+        DrawTextLeft(font, g_colourWhite, g_window->bmp, 2, 0, "Bench Time: %.2f  Steps/s: %u  Sub-steps: %u  Sim speed: %.3f",
+                     frame->benchTime, stepsPerSecond, frame->numSubSteps, simSpeed);
 
         UpdateWin(g_window);
-
-        frameNum++;
     }
 
+    simThread.Stop();
+    if (checkpointFilename && !g_world.SaveSnapshot(checkpointFilename))
+        fprintf(stderr, "Couldn't write checkpoint '%s'\n", checkpointFilename);
+
+    if (g_world.m_recorder) {
+        unsigned numDropped = g_world.m_recorder->GetNumDropped();
+        if (numDropped > 0)
+            fprintf(stderr, "%u recording chunks were dropped because the writer fell behind\n", numDropped);
+        delete g_world.m_recorder;
+        g_world.m_recorder = NULL;
+    }
     return 0;
 }
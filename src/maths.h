@@ -1,10 +1,46 @@
 #pragma once
 
-#include <stdlib.h>
+#include <stdint.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 
-static inline float frand(float range) {
-    return ((float)rand() / (float)RAND_MAX) * range;
+// Philox4x32-10, a counter-based random number generator, from "Parallel
+// Random Numbers: As Easy as 1, 2, 3" by Salmon et al. Scrambles the counter
+// with the key into four random words. Each output is a pure function of the
+// counter and key, so numbers can be generated in any order, on any thread,
+// and come out the same on every platform.
+static inline void Philox4x32(uint32_t counter[4], uint32_t key0, uint32_t key1) {
+    for (int round = 0; round < 10; round++) {
+        uint64_t prod0 = (uint64_t)0xD2511F53 * counter[0];
+        uint64_t prod1 = (uint64_t)0xCD9E8D57 * counter[2];
+        uint32_t c1 = counter[1];
+        uint32_t c3 = counter[3];
+        counter[0] = (uint32_t)(prod1 >> 32) ^ c1 ^ key0;
+        counter[1] = (uint32_t)prod1;
+        counter[2] = (uint32_t)(prod0 >> 32) ^ c3 ^ key1;
+        counter[3] = (uint32_t)prod0;
+        key0 += 0x9E3779B9;
+        key1 += 0xBB67AE85;
+    }
+}
+
+
+// Maps a random word to a float in [0, range).
+static inline float RandomFloat(uint32_t bits, float range) {
+    return (bits >> 8) * (1.0f / 16777216.0f) * range;
+}
+
+
+static inline unsigned CountTrailingZeros64(uint64_t a) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, a);
+    return index;
+#else
+    return __builtin_ctzll(a);
+#endif
 }
 
 
@@ -0,0 +1,473 @@
+// A standalone benchmark of the simulation's kernels, one at a time, on
+// synthetic distributions of particles, so that a change in speed can be
+// pinned on a particular kernel. Built as ideal_gas_bench. Every kernel runs
+// on one thread. Writes a JSON report.
+
+// Project headers
+#include "maths.h"
+#include "particles.h"
+#include "perf_counters.h"
+#include "renderer.h"
+#include "sim_thread.h"
+#include "walls.h"
+
+// Deadfrog headers
+#include "df_bitmap.h"
+#include "df_time.h"
+
+// Standard headers
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+
+static float const MAX_INITIAL_SPEED = 120.0f;
+static unsigned const NUM_CLUSTERS = 16;
+static unsigned const SPARSE_FRACTION = 100;    // The sparse distribution has this many times fewer particles.
+static unsigned const RENDER_WIDTH = 1200;
+static unsigned const RENDER_HEIGHT = 900;
+
+
+enum Distribution {
+    DIST_UNIFORM,
+    DIST_CLUSTERED,     // Gaussian blobs.
+    DIST_DENSE,         // Uniform over the middle quarter of the world, so four times the density.
+    DIST_SPARSE,        // Uniform, with 1/SPARSE_FRACTION of the particles.
+    NUM_DISTRIBUTIONS
+};
+
+static char const *const DISTRIBUTION_NAMES[NUM_DISTRIBUTIONS] = {
+    "uniform", "clustered", "dense", "sparse"
+};
+
+
+struct MicroBenchOptions {
+    unsigned numReps;
+    char const *only;           // Only run the benchmarks whose names contain this. NULL for all.
+    char const *kernelName;     // NULL means the best one the CPU supports.
+    char const *outFilename;
+    ParticlesConfig particlesConfig;
+};
+
+
+struct MicroBenchResult {
+    char const *name;
+    Distribution distribution;
+    char const *item;           // What the per item figures are per.
+    unsigned numItems;
+    double medianNsPerItem;
+    double tscPerItem;          // Time stamp counter ticks, from the median rep.
+
+    // Totals over all the reps, per item.
+    bool countersAvailable[PerfCounters::NUM_COUNTERS];
+    double countsPerItem[PerfCounters::NUM_COUNTERS];
+};
+
+
+// Calls the private kernels of Particles. Each function does one pass of a
+// kernel over the whole grid, in the same way that Advance() does.
+class MicroBench {
+public:
+    struct Pair {
+        unsigned i;
+        unsigned j;
+    };
+
+    // Places the particles with the counter-based RNG, like
+    // Particles::PlaceParticles(), then sorts them.
+    static void Place(Particles *p, Distribution distribution, unsigned seed) {
+        float sizeX = p->m_worldSizeX * 0.999f;
+        float sizeY = p->m_worldSizeY * 0.999f;
+        float sigma = std::min(sizeX, sizeY) / 40.0f;
+        for (unsigned i = 0; i < p->m_numParticles; i++) {
+            uint32_t random[4] = { i, 0, 0, 0 };
+            Philox4x32(random, seed, 0);
+            float x = RandomFloat(random[0], sizeX);
+            float y = RandomFloat(random[1], sizeY);
+            if (distribution == DIST_DENSE) {
+                x = sizeX * 0.25f + x * 0.5f;
+                y = sizeY * 0.25f + y * 0.5f;
+            }
+            else if (distribution == DIST_CLUSTERED) {
+                // A Box-Muller offset from the centre of a random cluster.
+                uint32_t centre[4] = { random[0] % NUM_CLUSTERS, 1, 0, 0 };
+                uint32_t offset[4] = { i, 2, 0, 0 };
+                Philox4x32(centre, seed, 0);
+                Philox4x32(offset, seed, 0);
+                float radius = sigma * sqrtf(-2.0f * logf(1.0f - RandomFloat(offset[0], 1.0f)));
+                float angle = RandomFloat(offset[1], 6.2831853f);
+                x = RandomFloat(centre[0], sizeX) + radius * cosf(angle);
+                y = RandomFloat(centre[1], sizeY) + radius * sinf(angle);
+                x = std::min(std::max(x, 0.0f), sizeX);
+                y = std::min(std::max(y, 0.0f), sizeY);
+            }
+
+            p->m_x[i] = x;
+            p->m_y[i] = y;
+            p->m_vx[i] = RandomFloat(random[2], MAX_INITIAL_SPEED * 2.0f) - MAX_INITIAL_SPEED;
+            p->m_vy[i] = RandomFloat(random[3], MAX_INITIAL_SPEED * 2.0f) - MAX_INITIAL_SPEED;
+            p->m_cellIdx[i] = p->GetCellIndexFromCoords(x, y);
+        }
+        p->SortByCell();
+    }
+
+    // Finds the overlapping pairs within each cell.
+    static void FindPairs(Particles *p, std::vector<Pair> *pairs) {
+        float const radius2Sqrd = (PARTICLE_RADIUS * 2.0f) * (PARTICLE_RADIUS * 2.0f);
+        pairs->clear();
+        for (unsigned cell = 0; cell < p->m_numCells; cell++) {
+            for (unsigned i = p->m_cellStart[cell]; i < p->m_cellStart[cell + 1]; i++) {
+                for (unsigned j = i + 1; j < p->m_cellStart[cell + 1]; j++) {
+                    float dx = p->m_x[j] - p->m_x[i];
+                    float dy = p->m_y[j] - p->m_y[i];
+                    float distSqrd = dx * dx + dy * dy;
+                    if (distSqrd < radius2Sqrd && distSqrd > 0.0f) {
+                        Pair pair = { i, j };
+                        pairs->push_back(pair);
+                    }
+                }
+            }
+        }
+    }
+
+    static void CollidePairs(Particles *p, std::vector<Pair> const &pairs) {
+        for (unsigned k = 0; k < pairs.size(); k++) {
+            unsigned i = pairs[k].i;
+            unsigned j = pairs[k].j;
+            float dx = p->m_x[j] - p->m_x[i];
+            float dy = p->m_y[j] - p->m_y[i];
+            p->HandleCollision(i, j, dx * dx + dy * dy);
+        }
+    }
+
+    static void CollideCellsSelf(Particles *p) {
+        for (unsigned cell = 0; cell < p->m_numCells; cell++) {
+            if (p->m_cellStart[cell] != p->m_cellStart[cell + 1])
+                p->HandleAnyCollisionsSelf(cell);
+        }
+    }
+
+    // The neighbour half of CollideCell(), in the row-major layout.
+    static void CollideCellsNeighbours(Particles *p) {
+        unsigned gridResX = p->m_gridResX;
+        unsigned const *cellStart = p->m_cellStart;
+        for (unsigned y = 0; y < p->m_gridResY; y++) {
+            for (unsigned x = 0; x < gridResX; x++) {
+                unsigned cell = y * gridResX + x;
+                if (cellStart[cell] == cellStart[cell + 1])
+                    continue;
+                if (y > 0) {
+                    unsigned firstCell = cell - gridResX - (x > 0 ? 1 : 0);
+                    unsigned lastCell = cell - gridResX + (x + 1 < gridResX ? 1 : 0);
+                    p->HandleAnyCollisions(cell, cellStart[firstCell], cellStart[lastCell + 1]);
+                }
+                if (x > 0)
+                    p->HandleAnyCollisions(cell, cellStart[cell - 1], cellStart[cell]);
+            }
+        }
+    }
+
+    static void CollideWalls(Particles *p) {
+        for (unsigned y = 0; y < p->m_gridResY; y++) {
+            for (unsigned x = 0; x < p->m_gridResX; x++) {
+                unsigned cell = y * p->m_gridResX + x;
+                if (p->m_cellStart[cell] != p->m_cellStart[cell + 1] && p->m_walls->CellHasWalls(x, y))
+                    p->HandleWallCollisions(x, y, cell);
+            }
+        }
+    }
+
+    // The integrate and rebin half of Advance().
+    static void Rebin(Particles *p) {
+        Particles::IntegrateTask task;
+        task.begin = 0;
+        task.end = p->m_numParticles;
+        task.wallImpulse = 0.0;
+        task.reduce = false;
+        p->Integrate(&task);
+        p->SortByCell();
+    }
+};
+
+
+// A copy of the particles' state, so that each rep starts from the same place.
+class SavedState {
+    std::vector<std::vector<char> > m_arrays;
+
+public:
+    void Save(Particles *p) {
+        Particles::StateArray arrays[Particles::MAX_STATE_ARRAYS];
+        unsigned num = p->GetStateArrays(arrays);
+        m_arrays.resize(num);
+        for (unsigned i = 0; i < num; i++)
+            m_arrays[i].assign((char *)arrays[i].data, (char *)arrays[i].data + arrays[i].size);
+    }
+
+    void Restore(Particles *p) {
+        Particles::StateArray arrays[Particles::MAX_STATE_ARRAYS];
+        unsigned num = p->GetStateArrays(arrays);
+        for (unsigned i = 0; i < num; i++)
+            memcpy(arrays[i].data, m_arrays[i].data(), arrays[i].size);
+        p->InvalidateVerletLists();
+    }
+};
+
+
+// Runs setup() then func() once to warm up, then numReps more times, timing
+// only func().
+template <typename SETUP, typename FUNC>
+static void Measure(unsigned numReps, unsigned numItems, SETUP const &setup, FUNC const &func,
+                    MicroBenchResult *result) {
+    std::vector<double> times(numReps);
+    std::vector<double> ticks(numReps);
+    unsigned long long counts[PerfCounters::NUM_COUNTERS] = { 0 };
+    PerfCounters counters;
+
+    setup();
+    func();
+    for (unsigned rep = 0; rep < numReps; rep++) {
+        setup();
+        counters.Start();
+        double startTime = GetRealTime();
+        unsigned long long startTicks = __rdtsc();
+        func();
+        ticks[rep] = (double)(__rdtsc() - startTicks);
+        times[rep] = GetRealTime() - startTime;
+        counters.Stop();
+        for (unsigned i = 0; i < PerfCounters::NUM_COUNTERS; i++)
+            counts[i] += counters.GetCount(i);
+    }
+
+    std::sort(times.begin(), times.end());
+    std::sort(ticks.begin(), ticks.end());
+    result->numItems = numItems;
+    result->medianNsPerItem = times[numReps / 2] * 1e9 / numItems;
+    result->tscPerItem = ticks[numReps / 2] / numItems;
+    for (unsigned i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+        result->countersAvailable[i] = counters.IsAvailable(i);
+        result->countsPerItem[i] = (double)counts[i] / numReps / numItems;
+    }
+}
+
+
+// A border round the world and a grid of discs.
+static Walls *CreateWalls(unsigned sizeX, unsigned sizeY) {
+    DfBitmap *bmp = BitmapCreate(sizeX, sizeY);
+    BitmapClear(bmp, g_colourBlack);
+    DfColour green = Colour(0, 255, 0);
+    for (unsigned y = 0; y < sizeY; y++) {
+        for (unsigned x = 0; x < sizeX; x++) {
+            int dx = (int)(x % 100) - 50;
+            int dy = (int)(y % 100) - 50;
+            bool border = x < 2 || y < 2 || x + 2 >= sizeX || y + 2 >= sizeY;
+            if (border || dx * dx + dy * dy < 15 * 15)
+                bmp->pixels[y * sizeX + x] = green;
+        }
+    }
+
+    Walls *walls = new Walls;
+    walls->Load(bmp);
+    BitmapDelete(bmp);
+    return walls;
+}
+
+
+static void FillFrame(Particles *particles, SimFrame *frame) {
+    frame->x.resize(particles->m_numParticles);
+    frame->y.resize(particles->m_numParticles);
+    frame->speed.clear();
+    particles->GetPositions(frame->x.data(), frame->y.data());
+    frame->rowStart.resize(particles->m_gridResY + 1);
+    if (!particles->GetRowStarts(frame->rowStart.data()))
+        frame->rowStart.clear();
+    frame->cellSizeX = particles->m_worldSizeX / particles->m_gridResX;
+    frame->cellSizeY = particles->m_worldSizeY / particles->m_gridResY;
+    frame->worldSizeX = particles->m_worldSizeX;
+    frame->worldSizeY = particles->m_worldSizeY;
+}
+
+
+static void RunDistribution(MicroBenchOptions const &opts, Distribution distribution,
+                            std::vector<MicroBenchResult> *results) {
+    ParticlesConfig config = opts.particlesConfig;
+    if (distribution == DIST_SPARSE)
+        config.numParticles = std::max(config.numParticles / SPARSE_FRACTION, 1u);
+    Particles *particles = new Particles(config, false);
+    if (opts.kernelName)
+        particles->SetCollisionKernel(opts.kernelName);
+    MicroBench::Place(particles, distribution, config.seed);
+
+    SavedState state;
+    state.Save(particles);
+    auto restore = [&]() { state.Restore(particles); };
+    unsigned numParticles = particles->m_numParticles;
+
+    auto run = [&](char const *name, char const *item, unsigned numItems, auto const &setup,
+                   auto const &func) {
+        if ((opts.only && !strstr(name, opts.only)) || numItems == 0)
+            return;
+        MicroBenchResult result;
+        result.name = name;
+        result.distribution = distribution;
+        result.item = item;
+        Measure(opts.numReps, numItems, setup, func, &result);
+        results->push_back(result);
+    };
+
+    std::vector<MicroBench::Pair> pairs;
+    MicroBench::FindPairs(particles, &pairs);
+    run("handle_collision", "collision", pairs.size(), restore,
+        [&]() { MicroBench::CollidePairs(particles, pairs); });
+    run("collide_self", "particle", numParticles, restore,
+        [&]() { MicroBench::CollideCellsSelf(particles); });
+    run("collide_neighbours", "particle", numParticles, restore,
+        [&]() { MicroBench::CollideCellsNeighbours(particles); });
+    run("rebin", "particle", numParticles, restore,
+        [&]() { MicroBench::Rebin(particles); });
+    run("step", "particle", numParticles, restore,
+        [&]() { particles->Advance(); });
+
+    // Both ways of drawing, on one thread, into a window sized bitmap.
+    {
+        Renderer renderer(1);
+        SimFrame frame;
+        FillFrame(particles, &frame);
+        DfBitmap *bmp = BitmapCreate(RENDER_WIDTH, RENDER_HEIGHT);
+        auto clear = [&]() { BitmapClear(bmp, g_colourBlack); };
+
+        float fitScale = std::min(RENDER_WIDTH / frame.worldSizeX, RENDER_HEIGHT / frame.worldSizeY);
+        float splatScale = std::min(fitScale, Renderer::SPLAT_MAX_SCALE * 0.5f);
+        run("render_splat", "particle", numParticles, clear,
+            [&]() { renderer.Render(bmp, frame, 0.0f, 0.0f, splatScale, false); });
+
+        // Zoomed in on the middle of the world.
+        float circleScale = Renderer::SPLAT_MAX_SCALE * 2.0f;
+        float offsetX = RENDER_WIDTH * 0.5f - frame.worldSizeX * 0.5f * circleScale;
+        float offsetY = RENDER_HEIGHT * 0.5f - frame.worldSizeY * 0.5f * circleScale;
+        run("render_circles", "particle", numParticles, clear,
+            [&]() { renderer.Render(bmp, frame, offsetX, offsetY, circleScale, false); });
+        BitmapDelete(bmp);
+    }
+
+    // Last, because the walls stay attached.
+    if (!opts.only || strstr("walls", opts.only)) {
+        Walls *walls = CreateWalls(config.worldSizeX, config.worldSizeY);
+        particles->SetWalls(walls);
+        run("walls", "particle", numParticles, restore,
+            [&]() { MicroBench::CollideWalls(particles); });
+        particles->SetWalls(NULL);
+        delete walls;
+    }
+
+    delete particles;
+}
+
+
+static void WriteReport(FILE *out, MicroBenchOptions const &opts, char const *kernelName,
+                        std::vector<MicroBenchResult> const &results) {
+    ParticlesConfig const &config = opts.particlesConfig;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"seed\": %u,\n", config.seed);
+    fprintf(out, "  \"reps\": %u,\n", opts.numReps);
+    fprintf(out, "  \"kernel\": \"%s\",\n", kernelName);
+    fprintf(out, "  \"particles\": %u,\n", config.numParticles);
+    fprintf(out, "  \"world\": [%u, %u],\n", config.worldSizeX, config.worldSizeY);
+    fprintf(out, "  \"grid\": [%u, %u],\n", config.GetGridResX(), config.GetGridResY());
+    fprintf(out, "  \"results\": [\n");
+    for (unsigned i = 0; i < results.size(); i++) {
+        MicroBenchResult const &r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"distribution\": \"%s\", \"item\": \"%s\", \"items\": %u, "
+            "\"median_ns_per_item\": %.3f, \"tsc_per_item\": %.2f",
+            r.name, DISTRIBUTION_NAMES[r.distribution], r.item, r.numItems, r.medianNsPerItem, r.tscPerItem);
+
+        // Unavailable counters are reported as null.
+        for (unsigned j = 0; j < PerfCounters::NUM_COUNTERS; j++) {
+            fprintf(out, ", \"%s_per_item\": ", PerfCounters::GetName(j));
+            if (r.countersAvailable[j])
+                fprintf(out, "%.3f", r.countsPerItem[j]);
+            else
+                fprintf(out, "null");
+        }
+
+        fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+
+static void PrintUsage() {
+    fprintf(stderr,
+        "Usage: ideal_gas_bench [--reps N] [--only NAME] [--kernel scalar|sse41|avx2|avx512]\n"
+        "                       [--particles N] [--world WxH] [--grid-res N] [--seed N] [--out FILE]\n"
+        "                       [--species RADIUS:MASS[,RADIUS:MASS...]]\n");
+}
+
+
+static bool ParseOptions(int argc, char *argv[], MicroBenchOptions *opts) {
+    opts->numReps = 20;
+    opts->only = NULL;
+    opts->kernelName = NULL;
+    opts->outFilename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        char const *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (opts->particlesConfig.ParseOption(argc, argv, &i))
+            continue;
+        else if (strcmp(arg, "--reps") == 0 && hasValue)
+            opts->numReps = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--only") == 0 && hasValue)
+            opts->only = argv[++i];
+        else if (strcmp(arg, "--kernel") == 0 && hasValue)
+            opts->kernelName = argv[++i];
+        else if (strcmp(arg, "--out") == 0 && hasValue)
+            opts->outFilename = argv[++i];
+        else
+            return false;
+    }
+
+    // The kernels are the FORMAT_FLOAT ones.
+    ParticlesConfig const &config = opts->particlesConfig;
+    return opts->numReps > 0 && config.IsValid() && config.format == ParticlesConfig::FORMAT_FLOAT;
+}
+
+
+int main(int argc, char *argv[]) {
+    MicroBenchOptions opts;
+    if (!ParseOptions(argc, argv, &opts)) {
+        PrintUsage();
+        return 1;
+    }
+
+    char const *kernelName = opts.kernelName ? opts.kernelName : GetBestCollisionKernel().name;
+    if (!GetCollisionKernel(kernelName).findHits) {
+        fprintf(stderr, "Collision kernel '%s' isn't supported on this machine\n", kernelName);
+        return 1;
+    }
+
+    std::vector<MicroBenchResult> results;
+    for (unsigned i = 0; i < NUM_DISTRIBUTIONS; i++)
+        RunDistribution(opts, (Distribution)i, &results);
+
+    FILE *out = stdout;
+    if (opts.outFilename) {
+        out = fopen(opts.outFilename, "w");
+        if (!out) {
+            fprintf(stderr, "Couldn't open '%s' for writing\n", opts.outFilename);
+            return 1;
+        }
+    }
+    WriteReport(out, opts, kernelName, results);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -6,70 +6,583 @@
 #include "particles.h"
 
 // Project headers
+#include "arena.h"
 #include "maths.h"
+#include "thread_pool.h"
 #include "walls.h"
-#include "world.h"
 
 // Deadfrog headers
-#include "df_bitmap.h"
 #include "df_common.h"
-#include "df_window.h"
 
 // Standard headers
+#include <algorithm>
+#include <float.h>
 #include <math.h>
 #include <memory.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 static float const MAX_INITIAL_SPEED = 120.0f;
+
+float const Particles::MAX_STEP_MOVE = PARTICLE_RADIUS;
 static float const RADIUS2 = PARTICLE_RADIUS * 2.0f;
 
+// Keeps the collision bands big enough that each one is worth a task. Must be
+// a multiple of MORTON_BLOCK_SIZE. See CollideBands().
+static unsigned const MIN_BAND_HEIGHT = 8;
+
+static unsigned const MAX_NUM_TASKS = 256;
+
+// The number of tasks, and of collision bands, in deterministic mode. Enough to
+// keep 16 threads busy.
+static unsigned const DETERMINISTIC_NUM_TASKS = 32;
+
+// The parallel sort falls back to the serial one if the tasks' windows of
+// cells add up to more than this many times the number of cells.
+static unsigned const MAX_SORT_WINDOWS_PER_CELL = 2;
+
+// In the Morton layout the collisions are handled in square blocks of cells, in
+// Z-order within each block, so that consecutive cells are close in memory.
+static unsigned const MORTON_BLOCK_BITS = 3;
+static unsigned const MORTON_BLOCK_SIZE = 1 << MORTON_BLOCK_BITS;
+
+// The default tile size aims for this many particles per tile. At 16 bytes
+// each, they fill a typical 48 KB L1 data cache.
+static unsigned const TARGET_PARTICLES_PER_TILE = 3000;
+
+// How many candidates are passed to the collision kernel at a time.
+static unsigned const HITS_BATCH_SIZE = 64;
+
+
+// Inserts a zero bit above each of the bottom 16 bits of a.
+static unsigned SpreadBits(unsigned a) {
+    a = (a | (a << 8)) & 0x00ff00ff;
+    a = (a | (a << 4)) & 0x0f0f0f0f;
+    a = (a | (a << 2)) & 0x33333333;
+    a = (a | (a << 1)) & 0x55555555;
+    return a;
+}
+
+
+// The inverse of SpreadBits().
+static unsigned CompactBits(unsigned a) {
+    a &= 0x55555555;
+    a = (a | (a >> 1)) & 0x33333333;
+    a = (a | (a >> 2)) & 0x0f0f0f0f;
+    a = (a | (a >> 4)) & 0x00ff00ff;
+    a = (a | (a >> 8)) & 0x0000ffff;
+    return a;
+}
+
+
+static unsigned MortonEncode(unsigned x, unsigned y) {
+    return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+
+// Rounds to the nearest FORMAT_FIXED value, saturating rather than wrapping.
+// -32768 is left out, so that any value can be negated.
+static int16_t ToFixed16(float a) {
+    if (a > 32767.0f) return 32767;
+    if (a < -32767.0f) return -32767;
+    return lrintf(a);
+}
+
+
+// Pushes a particle at (x, y) out of any wall it overlaps and, if it is moving
+// into the wall, reflects its velocity about the wall's normal. Returns false,
+// having changed nothing, if it doesn't touch a wall. The texel's distance is
+// extrapolated along its normal to the particle, which makes flat walls exact
+// despite only looking up the nearest texel.
+static inline bool CollideWithSdf(Walls const *walls, float radius, float *x, float *y, float *vx, float *vy,
+                                  double *impulse) {
+    float centreX, centreY;
+    SdfTexel texel = walls->LookupSdf(*x, *y, &centreX, &centreY);
+
+    // The particle is at most sqrt(0.5) from the texel's centre.
+    if (texel.dist >= (radius + 0.75f) * SDF_DIST_SCALE)
+        return false;
+
+    float normalX = texel.normalX * (1.0f / 127.0f);
+    float normalY = texel.normalY * (1.0f / 127.0f);
+    float dist = texel.dist * (1.0f / SDF_DIST_SCALE) +
+                 DotProduct(*x - centreX, *y - centreY, normalX, normalY);
+    float depth = radius - dist;
+    if (depth <= 0.0f)
+        return false;
+
+    *x += normalX * depth;
+    *y += normalY * depth;
+    float dp = DotProduct(*vx, *vy, normalX, normalY);
+    if (dp < 0.0f) {
+        *vx -= 2.0f * (dp * normalX);
+        *vy -= 2.0f * (dp * normalY);
+        *impulse -= 2.0f * dp;
+    }
+    return true;
+}
+
+
+// The stats for the collision sweep task that this thread is running.
+static thread_local Particles::SweepStats t_sweepStats;
+
+
+ParticlesConfig::ParticlesConfig() {
+    numParticles = DEFAULT_NUM_PARTICLES;
+    worldSizeX = DEFAULT_WORLD_SIZE_X;
+    worldSizeY = DEFAULT_WORLD_SIZE_Y;
+    gridResX = 0;
+    format = FORMAT_FLOAT;
+    seed = 1;
+    capacity = 0;
+    numRows = 0;
+    numSpecies = 0;
+    hugePages = true;
+    badValue = false;
+}
+
+
+bool ParticlesConfig::ParseOption(int argc, char *argv[], int *argIndex) {
+    int i = *argIndex;
+    if (i + 1 >= argc)
+        return false;
+
+    if (strcmp(argv[i], "--particles") == 0)
+        numParticles = strtoul(argv[i + 1], NULL, 10);
+    else if (strcmp(argv[i], "--grid-res") == 0)
+        gridResX = strtoul(argv[i + 1], NULL, 10);
+    else if (strcmp(argv[i], "--format") == 0) {
+        if (strcmp(argv[i + 1], "float") == 0)
+            format = FORMAT_FLOAT;
+        else if (strcmp(argv[i + 1], "fixed") == 0)
+            format = FORMAT_FIXED;
+        else
+            badValue = true;
+    }
+    else if (strcmp(argv[i], "--seed") == 0)
+        seed = strtoul(argv[i + 1], NULL, 10);
+    else if (strcmp(argv[i], "--huge-pages") == 0) {
+        if (strcmp(argv[i + 1], "on") == 0)
+            hugePages = true;
+        else if (strcmp(argv[i + 1], "off") == 0)
+            hugePages = false;
+        else
+            badValue = true;
+    }
+    else if (strcmp(argv[i], "--world") == 0) {
+        char *end;
+        worldSizeX = strtoul(argv[i + 1], &end, 10);
+        worldSizeY = *end == 'x' ? strtoul(end + 1, NULL, 10) : 0;
+    }
+    else if (strcmp(argv[i], "--species") == 0) {
+        // A malformed list leaves numSpecies too big, which IsValid() rejects.
+        char const *c = argv[i + 1];
+        numSpecies = 0;
+        while (1) {
+            char *end;
+            float radius = strtof(c, &end);
+            if (*end != ':' || numSpecies == MAX_SPECIES) {
+                numSpecies = MAX_SPECIES + 1;
+                break;
+            }
+            speciesRadius[numSpecies] = radius;
+            speciesMass[numSpecies] = strtof(end + 1, &end);
+            numSpecies++;
+            if (*end == '\0')
+                break;
+            if (*end != ',') {
+                numSpecies = MAX_SPECIES + 1;
+                break;
+            }
+            c = end + 1;
+        }
+    }
+    else
+        return false;
+
+    *argIndex = i + 1;
+    return true;
+}
+
+
+bool ParticlesConfig::IsValid() const {
+    if (badValue || numParticles == 0 || worldSizeX == 0 || worldSizeY == 0 || numSpecies > MAX_SPECIES)
+        return false;
+    if (numSpecies > 0 && format != FORMAT_FLOAT)
+        return false;
+    if (format == FORMAT_FIXED && !HasSquareCells())
+        return false;
+    for (unsigned s = 0; s < numSpecies; s++) {
+        if (!(speciesRadius[s] > 0.0f && speciesMass[s] > 0.0f))
+            return false;
+    }
+    return (float)worldSizeX / GetGridResX() >= GetMaxRadius() * 2.0f;
+}
+
+
+unsigned ParticlesConfig::GetGridResX() const {
+    if (gridResX > 0)
+        return gridResX;
+    unsigned res = ((unsigned long long)DEFAULT_GRID_RES_X * worldSizeX) / DEFAULT_WORLD_SIZE_X;
+    float maxRadius = GetMaxRadius();
+    if (maxRadius > PARTICLE_RADIUS)
+        res = std::min(res, (unsigned)(worldSizeX / (maxRadius * 2.0f)));
+    return res > 0 ? res : 1;
+}
+
+
+// GetGridResY() rounds down, so unless the world's height is a whole number of
+// cells, the last row is taller than the others.
+bool ParticlesConfig::HasSquareCells() const {
+    return (unsigned long long)GetGridResY() * worldSizeX == (unsigned long long)GetGridResX() * worldSizeY;
+}
+
+
+unsigned ParticlesConfig::GetGridResY() const {
+    unsigned res = ((unsigned long long)GetGridResX() * worldSizeY) / worldSizeX;
+    return res > 0 ? res : 1;
+}
+
 
-Particles::Particles() {
+float ParticlesConfig::GetMaxRadius() const {
+    if (numSpecies == 0 || numSpecies > MAX_SPECIES)
+        return PARTICLE_RADIUS;
+    float maxRadius = 0.0f;
+    for (unsigned s = 0; s < numSpecies; s++)
+        maxRadius = std::max(maxRadius, speciesRadius[s]);
+    return maxRadius;
+}
+
+
+Particles::Particles(ParticlesConfig const &config, bool placeParticles)
+:   m_numParticles(config.numParticles),
+    m_capacity(std::max(config.capacity, config.numParticles)),
+    m_worldSizeX(config.worldSizeX),
+    m_worldSizeY(config.numRows ? config.numRows * (float)config.worldSizeY / config.GetGridResY() : config.worldSizeY),
+    m_gridResX(config.GetGridResX()),
+    m_gridResY(config.numRows ? config.numRows : config.GetGridResY()),
+    m_numCells(m_gridResX * m_gridResY),
+    m_format(config.format),
+    m_numSpecies(config.numSpecies)
+{
     m_showHistogram = false;
+    m_reductionInterval = 0;
+    m_numSteps = 0;
+    m_deterministic = false;
+    m_reduceThisStep = false;
+    memset(&m_reductions, 0, sizeof(m_reductions));
+    float binWidth = 3.0f * MAX_INITIAL_SPEED / SPEED_HISTOGRAM_NUM_BINS;
+    m_speedSqrdToLut = 1.0f / (binWidth * binWidth);
+    for (unsigned bin = 0; bin < SPEED_HISTOGRAM_NUM_BINS; bin++) {
+        for (unsigned i = bin * bin; i < (bin + 1) * (bin + 1); i++)
+            m_speedBinLut[i] = bin;
+    }
+    m_advanceTime = 0.001f;
+    m_simTime = 0.0;
+    m_maxSpeed = -1.0f;
+    m_numCollisions = 0;
+    m_wallImpulse = 0.0;
+    memset(&m_occupancyStats, 0, sizeof(m_occupancyStats));
+    m_occupancyKernels = true;
+    m_verletSkin = 0.0f;
+    m_verletValid = false;
+    m_verletMaxMoveSqrd = 0.0f;
+    m_numVerletBuilds = 0;
+    m_threadPool = NULL;
+    m_memoryPlaced = false;
+    m_walls = NULL;
+    m_sdfWalls = NULL;
+    m_collisionKernel = GetBestCollisionKernel();
+    m_layout = LAYOUT_ROW_MAJOR;
+    m_numCellIndices = m_numCells;
+    m_tileSize = 0;
+    m_worldToCellX = m_gridResX / m_worldSizeX;
+    m_worldToCellY = m_gridResY / m_worldSizeY;
+    ReleaseAssert(m_format != ParticlesConfig::FORMAT_FIXED || config.HasSquareCells(),
+                  "The fixed point format needs square cells");
+    m_fixedUnitsPerWorld = FIXED_CELL_UNITS * m_worldToCellX;
+    m_fixedRadius2 = lrintf(RADIUS2 * m_fixedUnitsPerWorld);
+    InitSpecies(config);
+
+    // Room for the Morton layout too, if the grid fits in it. The pages past the
+    // end of the layout in use are never touched, so cost only address space.
+    m_maxNumCellIndices = m_numCells;
+    if (m_gridResX <= (1u << MORTON_BITS) && m_gridResY <= (1u << MORTON_BITS))
+        m_maxNumCellIndices = std::max(m_numCells, MortonEncode(m_gridResX - 1, m_gridResY - 1) + 1);
+
+    // The collision kernels read whole SIMD vectors, so may read past the last particle.
+    size_t paddedSize = m_capacity + COLLISION_KERNEL_PADDING;
+    size_t stateSize = m_format == ParticlesConfig::FORMAT_FIXED ? sizeof(int16_t) : sizeof(float);
+    size_t arenaSize = Arena::GetAllocSize(stateSize * paddedSize) * 8 +
+                       Arena::GetAllocSize(sizeof(unsigned) * m_capacity) * 2 +
+                       Arena::GetAllocSize(sizeof(unsigned) * (m_maxNumCellIndices + 1));
+    if (m_numSpecies > 0)
+        arenaSize += Arena::GetAllocSize(sizeof(uint8_t) * m_capacity) * 2;
+    m_arena = new Arena(arenaSize, config.hugePages);
+    ReleaseAssert(m_arena->GetSize() > 0, "Couldn't allocate %u MB for the particles", (unsigned)(arenaSize >> 20));
+
+    // The arena's memory starts zeroed.
+    m_x = m_y = m_vx = m_vy = NULL;
+    m_sortedX = m_sortedY = m_sortedVx = m_sortedVy = NULL;
+    m_fx = m_fy = m_fvx = m_fvy = NULL;
+    m_sortedFx = m_sortedFy = m_sortedFvx = m_sortedFvy = NULL;
+    m_sortedCellIdx = NULL;
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        m_fx = m_arena->AllocArray<int16_t>(paddedSize);
+        m_fy = m_arena->AllocArray<int16_t>(paddedSize);
+        m_fvx = m_arena->AllocArray<int16_t>(paddedSize);
+        m_fvy = m_arena->AllocArray<int16_t>(paddedSize);
+        m_sortedFx = m_arena->AllocArray<int16_t>(paddedSize);
+        m_sortedFy = m_arena->AllocArray<int16_t>(paddedSize);
+        m_sortedFvx = m_arena->AllocArray<int16_t>(paddedSize);
+        m_sortedFvy = m_arena->AllocArray<int16_t>(paddedSize);
+        m_sortedCellIdx = m_arena->AllocArray<unsigned>(m_capacity);
+    }
+    else {
+        m_x = m_arena->AllocArray<float>(paddedSize);
+        m_y = m_arena->AllocArray<float>(paddedSize);
+        m_vx = m_arena->AllocArray<float>(paddedSize);
+        m_vy = m_arena->AllocArray<float>(paddedSize);
+        m_sortedX = m_arena->AllocArray<float>(paddedSize);
+        m_sortedY = m_arena->AllocArray<float>(paddedSize);
+        m_sortedVx = m_arena->AllocArray<float>(paddedSize);
+        m_sortedVy = m_arena->AllocArray<float>(paddedSize);
+    }
+    m_cellIdx = m_arena->AllocArray<unsigned>(m_capacity);
+    m_cellStart = m_arena->AllocArray<unsigned>(m_maxNumCellIndices + 1);
+    m_species = m_sortedSpecies = NULL;
+    if (m_numSpecies > 0) {
+        m_species = m_arena->AllocArray<uint8_t>(m_capacity);
+        m_sortedSpecies = m_arena->AllocArray<uint8_t>(m_capacity);
+    }
+    if (!placeParticles)
+        return;
+
+    // Place the particles. Each one's starting state depends only on the seed
+    // and its index, so they can be placed on every core at once.
+    unsigned numThreads = ThreadPool::GetNumHardwareThreads();
+    if (numThreads > 1) {
+        ThreadPool pool(numThreads);
+        unsigned numTasks = std::min(numThreads * 4, MAX_NUM_TASKS);
+        pool.ParallelFor(numTasks, [&](unsigned t) {
+            unsigned begin = (m_numParticles * (unsigned long long)t) / numTasks;
+            unsigned end = (m_numParticles * (unsigned long long)(t + 1)) / numTasks;
+            PlaceParticles(begin, end, config.seed);
+        });
+    }
+    else {
+        PlaceParticles(0, m_numParticles, config.seed);
+    }
+
+    SortByCell();
+}
+
+
+Particles::~Particles() {
+    delete m_threadPool;
+    delete m_arena;
+}
+
+
+void Particles::InitSpecies(ParticlesConfig const &config) {
+    ReleaseAssert(m_numSpecies <= ParticlesConfig::MAX_SPECIES, "Too many particle species");
+    ReleaseAssert(m_numSpecies == 0 || m_format == ParticlesConfig::FORMAT_FLOAT,
+                  "Particle species need the float format");
+
+    // The default species is one of PARTICLE_RADIUS and unit mass.
+    unsigned numSpecies = std::max(m_numSpecies, 1u);
+    for (unsigned s = 0; s < numSpecies; s++) {
+        m_speciesRadius[s] = m_numSpecies ? config.speciesRadius[s] : PARTICLE_RADIUS;
+        m_speciesMass[s] = m_numSpecies ? config.speciesMass[s] : 1.0f;
+    }
+
+    m_maxContactDistSqrd = 0.0f;
+    m_maxRadius = 0.0f;
+    m_maxStepMove = MAX_STEP_MOVE;
+    m_maxSpeedUp = 1.0f;
+    for (unsigned a = 0; a < numSpecies; a++) {
+        m_maxStepMove = std::min(m_maxStepMove, m_speciesRadius[a]);
+        m_maxRadius = std::max(m_maxRadius, m_speciesRadius[a]);
+        for (unsigned b = 0; b < numSpecies; b++) {
+            float massA = m_speciesMass[a];
+            float massB = m_speciesMass[b];
+            SpeciesPair &pair = m_speciesPairs[a * ParticlesConfig::MAX_SPECIES + b];
+            pair.contactDist = m_speciesRadius[a] + m_speciesRadius[b];
+            pair.contactDistSqrd = pair.contactDist * pair.contactDist;
+            pair.velFactorA = 2.0f * massB / (massA + massB);
+            pair.velFactorB = 2.0f * massA / (massA + massB);
+            pair.pushA = massB / (massA + massB);
+            pair.pushB = massA / (massA + massB);
+            pair.equalMass = massA == massB;
+            m_maxContactDistSqrd = std::max(m_maxContactDistSqrd, pair.contactDistSqrd);
+
+            // In one dimension, the most a collision can speed particle a up
+            // by is when b comes head on at the same speed.
+            m_maxSpeedUp = std::max(m_maxSpeedUp, (3.0f * massB - massA) / (massA + massB));
+        }
+    }
+}
+
+
+// The random numbers for particle i come from the counter (i, 0, 0, 0).
+ParticleState Particles::GetStartingState(unsigned i, unsigned seed, float worldSizeX, float worldSizeY) {
+    uint32_t random[4] = { i, 0, 0, 0 };
+    Philox4x32(random, seed, 0);
+    ParticleState state;
+    state.x = RandomFloat(random[0], worldSizeX * 0.999f);
+    state.y = RandomFloat(random[1], worldSizeY * 0.999f);
+
+    state.vx = RandomFloat(random[2], MAX_INITIAL_SPEED * 2.0f) - MAX_INITIAL_SPEED;
+    state.vy = RandomFloat(random[3], MAX_INITIAL_SPEED * 2.0f) - MAX_INITIAL_SPEED;
+    state.vx += MAX_INITIAL_SPEED * 0.2f;
+    state.vy += MAX_INITIAL_SPEED * 0.1f;
+    return state;
+}
 
-    // Initialize the grid as empty.
-    for (unsigned y = 0; y < GRID_RES_Y; y++) {
-        for (unsigned x = 0; x < GRID_RES_X; x++) {
-            PList &plist = m_grid[y * GRID_RES_X + x];
-            plist.p.x = INVALID_PARTICLE_X;
-            plist.nextIdx = -1;
+
+// Both formats start from the same state. With species, the particles take
+// turns to be each one, and the heavier ones start slower, so that every
+// species starts at the same temperature.
+void Particles::PlaceParticles(unsigned begin, unsigned end, unsigned seed) {
+    for (unsigned i = begin; i < end; i++) {
+        ParticleState state = GetStartingState(i, seed, m_worldSizeX, m_worldSizeY);
+        float x = state.x;
+        float y = state.y;
+        float vx = state.vx;
+        float vy = state.vy;
+        if (m_species) {
+            unsigned species = i % m_numSpecies;
+            m_species[i] = species;
+            float speedScale = 1.0f / sqrtf(m_speciesMass[species]);
+            vx *= speedScale;
+            vy *= speedScale;
+        }
+
+        m_cellIdx[i] = GetCellIndexFromCoords(x, y);
+
+        if (m_format == ParticlesConfig::FORMAT_FIXED) {
+            unsigned cellX = m_cellIdx[i] % m_gridResX;
+            unsigned cellY = m_cellIdx[i] / m_gridResX;
+            m_fx[i] = lrintf(x * m_fixedUnitsPerWorld) - (int)cellX * FIXED_CELL_UNITS;
+            m_fy[i] = lrintf(y * m_fixedUnitsPerWorld) - (int)cellY * FIXED_CELL_UNITS;
+            m_fvx[i] = ToFixed16(vx * FIXED_VEL_SCALE);
+            m_fvy[i] = ToFixed16(vy * FIXED_VEL_SCALE);
         }
+        else {
+            m_x[i] = x;
+            m_y[i] = y;
+            m_vx[i] = vx;
+            m_vy[i] = vy;
+        }
+    }
+}
+
+
+void Particles::SetNumThreads(unsigned numThreads) {
+    delete m_threadPool;
+    m_threadPool = NULL;
+    if (numThreads > 1)
+        m_threadPool = new ThreadPool(numThreads);
+    PlaceMemory();
+}
+
+
+void Particles::PlaceMemory() {
+    m_memoryPlaced = false;
+    if (!m_threadPool)
+        return;
+    m_memoryPlaced = m_arena->FirstTouch(m_threadPool);
+    if (m_walls)
+        m_memoryPlaced &= m_walls->FirstTouch(m_threadPool);
+    if (m_sdfWalls)
+        m_memoryPlaced &= m_sdfWalls->FirstTouch(m_threadPool);
+}
+
+
+unsigned Particles::GetNumThreads() {
+    return m_threadPool ? m_threadPool->GetNumThreads() : 1;
+}
+
+
+// How many ranges of particles to integrate in. In deterministic mode it
+// doesn't depend on the number of threads.
+unsigned Particles::GetNumTasks() {
+    if (m_deterministic)
+        return DETERMINISTIC_NUM_TASKS;
+    unsigned numThreads = GetNumThreads();
+    return numThreads == 1 ? 1 : std::min(numThreads * 4, MAX_NUM_TASKS);
+}
+
+
+void Particles::SetTileSize(unsigned tileSize) {
+    m_tileSize = (tileSize + MORTON_BLOCK_SIZE - 1) / MORTON_BLOCK_SIZE * MORTON_BLOCK_SIZE;
+}
+
+
+unsigned Particles::GetAutoTileSize() {
+    float particlesPerCell = (float)m_numParticles / (float)m_numCells;
+    unsigned tileSize = sqrtf(TARGET_PARTICLES_PER_TILE / particlesPerCell);
+    return (tileSize + MORTON_BLOCK_SIZE - 1) / MORTON_BLOCK_SIZE * MORTON_BLOCK_SIZE;
+}
+
+
+bool Particles::SetCellLayout(CellLayout layout) {
+    // The fixed point positions are relative to the cells, which are always
+    // in row-major order, so there is nothing to re-sort.
+    if (m_format == ParticlesConfig::FORMAT_FIXED)
+        return layout == LAYOUT_ROW_MAJOR;
+
+    unsigned numCellIndices = m_numCells;
+    if (layout == LAYOUT_MORTON) {
+        if (m_gridResX > (1u << MORTON_BITS) || m_gridResY > (1u << MORTON_BITS) || m_verletSkin > 0.0f)
+            return false;
+        numCellIndices = MortonEncode(m_gridResX - 1, m_gridResY - 1) + 1;
     }
 
-    // Initialize the particle array as empty (it uses a free list)
-    for (unsigned i = 0; i < NUM_PARTICLES - 1; i++)
-        m_particles[i].nextIdx = i + 1;
-    m_particles[NUM_PARTICLES - 1].nextIdx = -1;
-    m_firstFreeIdx = 0;
+    m_layout = layout;
+    m_numCellIndices = numCellIndices;
+    for (unsigned i = 0; i < m_numParticles; i++)
+        m_cellIdx[i] = GetCellIndexFromCoords(m_x[i], m_y[i]);
+    SortByCell();
+    m_verletValid = false;
+    return true;
+}
 
-    // Place the particles
-    for (unsigned i = 0; i < NUM_PARTICLES; i++) {
-        Particle p;
-        do {
-            p.x = frand(WORLD_SIZE_X * 0.999f);
-            p.y = frand(WORLD_SIZE_Y * 0.999f);
-        } while (0);// g_world.m_walls->IsWallPixel(p.x, p.y));
 
-        p.vx = MAX_INITIAL_SPEED;
-        p.vy = MAX_INITIAL_SPEED;
-        p.vx = frand(MAX_INITIAL_SPEED * 2.0f) - MAX_INITIAL_SPEED;
-        p.vy = frand(MAX_INITIAL_SPEED * 2.0f) - MAX_INITIAL_SPEED;
-        p.vx += MAX_INITIAL_SPEED * 0.2f;
-        p.vy += MAX_INITIAL_SPEED * 0.1f;
-        PList *plist = GetPListFromCoords(p.x, p.y);
-        AddParticle(&p, plist);
+void Particles::SetWalls(Walls *walls) {
+    m_walls = NULL;
+    m_sdfWalls = NULL;
+    if (walls && walls->HasSdf()) {
+        m_sdfWalls = walls;
+    } else if (walls) {
+        m_walls = walls;
+        walls->BuildCellIndex(m_gridResX, m_gridResY, m_worldToCellX, m_worldToCellY, m_maxRadius);
     }
+    if (walls && m_threadPool)
+        m_memoryPlaced &= walls->FirstTouch(m_threadPool);
+}
+
+
+bool Particles::SetCollisionKernel(char const *name) {
+    CollisionKernel kernel = GetCollisionKernel(name);
+    if (!kernel.findHits)
+        return false;
+    m_collisionKernel = kernel;
+    return true;
 }
 
 
-void Particles::HandleCollision(Particle *p1, Particle *p2, float distSqrd) {
+void Particles::HandleCollision(unsigned i, unsigned j, float distSqrd) {
     // Collision normal is the vector between the two particle centers.
     // The only change in velocity of either particle is in the 
     // direction of the collision normal.
 
+    t_sweepStats.numCollisions++;
+
     // Calculate collision unit normal and tangent.
-    float deltaX = p2->x - p1->x;
-    float deltaY = p2->y - p1->y;
+    float deltaX = m_x[j] - m_x[i];
+    float deltaY = m_y[j] - m_y[i];
     float dist = sqrtf(distSqrd);
     float invDist = 1.0f / dist;
     float normX = deltaX * invDist;
@@ -78,12 +591,12 @@ void Particles::HandleCollision(Particle *p1, Particle *p2, float distSqrd) {
     float tangY = -normX;
 
     // Project p1 and p2 velocities onto collision unit normal
-    float p1VelNorm = DotProduct(p1->vx, p1->vy, normX, normY);
-    float p2VelNorm = DotProduct(p2->vx, p2->vy, normX, normY);
+    float p1VelNorm = DotProduct(m_vx[i], m_vy[i], normX, normY);
+    float p2VelNorm = DotProduct(m_vx[j], m_vy[j], normX, normY);
 
     // Project p1 and p2 velocities onto collision tangent
-    float p1VelTang = DotProduct(p1->vx, p1->vy, tangX, tangY);
-    float p2VelTang = DotProduct(p2->vx, p2->vy, tangX, tangY);
+    float p1VelTang = DotProduct(m_vx[i], m_vy[i], tangX, tangY);
+    float p2VelTang = DotProduct(m_vx[j], m_vy[j], tangX, tangY);
 
     // Since all particles have the same mass, the collision
     // simply swaps the particles velocities along the normal.
@@ -104,10 +617,10 @@ void Particles::HandleCollision(Particle *p1, Particle *p2, float distSqrd) {
 
     // The final velocities of the particles are now just the
     // sums of the normal and tangential velocity vectors
-    p1->vx = p1VelNormX + p1VelTangX;
-    p1->vy = p1VelNormY + p1VelTangY;
-    p2->vx = p2VelNormX + p2VelTangX;
-    p2->vy = p2VelNormY + p2VelTangY;
+    m_vx[i] = p1VelNormX + p1VelTangX;
+    m_vy[i] = p1VelNormY + p1VelTangY;
+    m_vx[j] = p2VelNormX + p2VelTangX;
+    m_vy[j] = p2VelNormY + p2VelTangY;
 
     // Now move the two particles apart by a few percent of their 
     // embeddedness to prevent the pathological interactions that
@@ -115,267 +628,1700 @@ void Particles::HandleCollision(Particle *p1, Particle *p2, float distSqrd) {
     // frame.
     float embeddedness = RADIUS2 - dist;
     float pushAmount = embeddedness * 0.5f;
-    p1->x -= normX * pushAmount;
-    p1->y -= normY * pushAmount;
-    p2->x += normX * pushAmount;
-    p2->y += normY * pushAmount;
+    m_x[i] -= normX * pushAmount;
+    m_y[i] -= normY * pushAmount;
+    m_x[j] += normX * pushAmount;
+    m_y[j] += normY * pushAmount;
 }
 
 
-static float getDistSqrd(Particle const *a, Particle const *b) {
-#if 1
-    float dx = a->x - b->x;
-    float dy = a->y - b->y;
-    return dx * dx + dy * dy;
-#else
-    __m128 subResult = _mm_sub_ps(a->sse, b->sse);
-    __m128 dotProdResult = _mm_dp_ps(subResult, subResult, 0x33);
-    return _mm_cvtss_f32(dotProdResult);
-#endif
-}
-
+// Handles collisions between particle i and the particles in [otherBegin, otherEnd).
+void Particles::HandleParticleCollisions(unsigned i, unsigned otherBegin, unsigned otherEnd) {
+    if (m_species) {
+        HandleParticleCollisionsSpecies(i, otherBegin, otherEnd);
+        return;
+    }
 
-void Particles::HandleAnyCollisions(PList *plist, PList *otherPlist) {
-    PList *otherPlistOrig = otherPlist;
+    unsigned hits[HITS_BATCH_SIZE];
 
-    while (1) {
-        Particle *p1 = &plist->p;
-        otherPlist = otherPlistOrig;
+    for (unsigned batchBegin = otherBegin; batchBegin < otherEnd; batchBegin += HITS_BATCH_SIZE) {
+        unsigned batchEnd = std::min(otherEnd, batchBegin + HITS_BATCH_SIZE);
+        unsigned numHits = m_collisionKernel.findHits(m_x[i], m_y[i], m_x, m_y,
+            batchBegin, batchEnd, RADIUS2 * RADIUS2, hits);
 
-        while (1) {
-            Particle *p2 = &otherPlist->p;
-            float distSqrd = getDistSqrd(p1, p2);
+        for (unsigned k = 0; k < numHits; k++) {
+            // Handling an earlier hit moves particle i, so the distance has to
+            // be checked again.
+            unsigned j = hits[k];
+            float dx = m_x[i] - m_x[j];
+            float dy = m_y[i] - m_y[j];
+            float distSqrd = dx * dx + dy * dy;
             if (distSqrd < RADIUS2 * RADIUS2) {
                 // There has been a collision.
-                HandleCollision(p1, p2, distSqrd);
+                HandleCollision(i, j, distSqrd);
             }
+        }
+    }
+}
 
-            if (otherPlist->nextIdx == -1)
-                break;
-            otherPlist = &m_particles[otherPlist->nextIdx];
+
+// HandleCollision() for particles of any species. The velocities change along
+// the normal by the pair's factors times the closing speed, which is the same
+// as swapping the normal components when the masses are equal. The heavier
+// particle is pushed out less.
+template <bool EQUAL_MASS>
+void Particles::HandleCollisionSpecies(unsigned i, unsigned j, float distSqrd, SpeciesPair const &pair) {
+    t_sweepStats.numCollisions++;
+
+    float dist = sqrtf(distSqrd);
+    float invDist = 1.0f / dist;
+    float normX = (m_x[j] - m_x[i]) * invDist;
+    float normY = (m_y[j] - m_y[i]) * invDist;
+    float closingSpeed = DotProduct(m_vx[i] - m_vx[j], m_vy[i] - m_vy[j], normX, normY);
+
+    float deltaVelI = EQUAL_MASS ? closingSpeed : closingSpeed * pair.velFactorA;
+    float deltaVelJ = EQUAL_MASS ? closingSpeed : closingSpeed * pair.velFactorB;
+    m_vx[i] -= deltaVelI * normX;
+    m_vy[i] -= deltaVelI * normY;
+    m_vx[j] += deltaVelJ * normX;
+    m_vy[j] += deltaVelJ * normY;
+
+    float embeddedness = pair.contactDist - dist;
+    float pushI = embeddedness * (EQUAL_MASS ? 0.5f : pair.pushA);
+    float pushJ = embeddedness * (EQUAL_MASS ? 0.5f : pair.pushB);
+    m_x[i] -= normX * pushI;
+    m_y[i] -= normY * pushI;
+    m_x[j] += normX * pushJ;
+    m_y[j] += normY * pushJ;
+}
+
+
+// HandleParticleCollisions() for particles of any species. The collision
+// kernel finds the particles within the biggest contact distance of any pair,
+// then each hit is checked against its own pair's.
+void Particles::HandleParticleCollisionsSpecies(unsigned i, unsigned otherBegin, unsigned otherEnd) {
+    unsigned hits[HITS_BATCH_SIZE];
+    SpeciesPair const *pairs = m_speciesPairs + m_species[i] * ParticlesConfig::MAX_SPECIES;
+
+    for (unsigned batchBegin = otherBegin; batchBegin < otherEnd; batchBegin += HITS_BATCH_SIZE) {
+        unsigned batchEnd = std::min(otherEnd, batchBegin + HITS_BATCH_SIZE);
+        unsigned numHits = m_collisionKernel.findHits(m_x[i], m_y[i], m_x, m_y,
+            batchBegin, batchEnd, m_maxContactDistSqrd, hits);
+
+        for (unsigned k = 0; k < numHits; k++) {
+            unsigned j = hits[k];
+            SpeciesPair const &pair = pairs[m_species[j]];
+            float dx = m_x[i] - m_x[j];
+            float dy = m_y[i] - m_y[j];
+            float distSqrd = dx * dx + dy * dy;
+            if (distSqrd < pair.contactDistSqrd) {
+                if (pair.equalMass)
+                    HandleCollisionSpecies<true>(i, j, distSqrd, pair);
+                else
+                    HandleCollisionSpecies<false>(i, j, distSqrd, pair);
+            }
         }
+    }
+}
 
-        if (plist->nextIdx == -1)
-            break;
-        plist = &m_particles[plist->nextIdx];
+
+// Returns true if any of particles a to a + NA - 1 is touching any of b to
+// b + NB - 1. Every pair is tested, with no branches, and the loops unroll
+// completely. If SELF, a and b are the same cell, and only pairs i < j are tested.
+template <unsigned NA, unsigned NB, bool SELF>
+static inline bool AnyTouching(float const *xs, float const *ys, unsigned a, unsigned b, float maxDistSqrd) {
+    float ax[NA], ay[NA], bx[NB], by[NB];
+    for (unsigned i = 0; i < NA; i++) {
+        ax[i] = xs[a + i];
+        ay[i] = ys[a + i];
+    }
+    for (unsigned j = 0; j < NB; j++) {
+        bx[j] = xs[b + j];
+        by[j] = ys[b + j];
     }
+
+    bool touching = false;
+    for (unsigned i = 0; i < NA; i++) {
+        for (unsigned j = SELF ? i + 1 : 0; j < NB; j++) {
+            float dx = ax[i] - bx[j];
+            float dy = ay[i] - by[j];
+            touching |= dx * dx + dy * dy < maxDistSqrd;
+        }
+    }
+    return touching;
+}
+
+
+// The occupancy kernels. Nearly always nothing is touching, and the test is all
+// there is to do. Otherwise the general path handles the cells, exactly as if
+// the kernel hadn't run, because nothing has changed.
+template <unsigned NA, unsigned NB>
+void Particles::HandleCellPair(unsigned begin, unsigned otherBegin) {
+    t_sweepStats.occupancy.pairCalls[NA - 1][NB - 1]++;
+    if (!AnyTouching<NA, NB, false>(m_x, m_y, begin, otherBegin, m_maxContactDistSqrd))
+        return;
+
+    t_sweepStats.occupancy.pairTouches[NA - 1][NB - 1]++;
+    for (unsigned i = begin; i < begin + NA; i++)
+        HandleParticleCollisions(i, otherBegin, otherBegin + NB);
 }
 
 
-void Particles::HandleAnyCollisionsSelf(PList *plist) {
-    if (plist->nextIdx == -1) return;
+template <unsigned N>
+void Particles::HandleCellSelf(unsigned begin) {
+    t_sweepStats.occupancy.selfCalls[N - 1]++;
+    if (!AnyTouching<N, N, true>(m_x, m_y, begin, begin, m_maxContactDistSqrd))
+        return;
+
+    t_sweepStats.occupancy.selfTouches[N - 1]++;
+    for (unsigned i = begin; i + 1 < begin + N; i++)
+        HandleParticleCollisions(i, i + 1, begin + N);
+}
+
 
-    Particle *p1 = &plist->p;
-    plist = &m_particles[plist->nextIdx];
+Particles::CellPairKernel const Particles::s_cellPairKernels[MAX_KERNEL_OCCUPANCY][MAX_KERNEL_OCCUPANCY] = {
+    { &Particles::HandleCellPair<1, 1>, &Particles::HandleCellPair<1, 2>, &Particles::HandleCellPair<1, 3>, &Particles::HandleCellPair<1, 4> },
+    { &Particles::HandleCellPair<2, 1>, &Particles::HandleCellPair<2, 2>, &Particles::HandleCellPair<2, 3>, &Particles::HandleCellPair<2, 4> },
+    { &Particles::HandleCellPair<3, 1>, &Particles::HandleCellPair<3, 2>, &Particles::HandleCellPair<3, 3>, &Particles::HandleCellPair<3, 4> },
+    { &Particles::HandleCellPair<4, 1>, &Particles::HandleCellPair<4, 2>, &Particles::HandleCellPair<4, 3>, &Particles::HandleCellPair<4, 4> }
+};
 
-    while (1) {
-        Particle *p2 = &plist->p;
-        float distSqrd = getDistSqrd(p1, p2);
-        if (distSqrd < RADIUS2 * RADIUS2) {
-            // There has been a collision.
-            HandleCollision(p1, p2, distSqrd);
+// A single particle can't collide with itself, so there is no kernel for one.
+Particles::CellSelfKernel const Particles::s_cellSelfKernels[MAX_KERNEL_OCCUPANCY] = {
+    NULL, &Particles::HandleCellSelf<2>, &Particles::HandleCellSelf<3>, &Particles::HandleCellSelf<4>
+};
+
+
+void Particles::OccupancyStats::Add(OccupancyStats const &other) {
+    for (unsigned a = 0; a < MAX_KERNEL_OCCUPANCY; a++) {
+        for (unsigned b = 0; b < MAX_KERNEL_OCCUPANCY; b++) {
+            pairCalls[a][b] += other.pairCalls[a][b];
+            pairTouches[a][b] += other.pairTouches[a][b];
         }
+        selfCalls[a] += other.selfCalls[a];
+        selfTouches[a] += other.selfTouches[a];
+    }
+    numGeneral += other.numGeneral;
+}
+
+
+void Particles::HandleAnyCollisions(unsigned cell, unsigned otherBegin, unsigned otherEnd) {
+    if (otherBegin == otherEnd)
+        return;
 
-        if (plist->nextIdx == -1)
-            break;
-        plist = &m_particles[plist->nextIdx];
+    unsigned begin = m_cellStart[cell];
+    unsigned end = m_cellStart[cell + 1];
+    unsigned numA = end - begin;
+    unsigned numB = otherEnd - otherBegin;
+    if (m_occupancyKernels && numA <= MAX_KERNEL_OCCUPANCY && numB <= MAX_KERNEL_OCCUPANCY) {
+        (this->*s_cellPairKernels[numA - 1][numB - 1])(begin, otherBegin);
+        return;
     }
+
+    t_sweepStats.occupancy.numGeneral++;
+    for (unsigned i = begin; i < end; i++)
+        HandleParticleCollisions(i, otherBegin, otherEnd);
 }
 
 
-void Particles::Advance() {
-    float advanceTime = 0.001f;// g_world.m_advanceTime;
+void Particles::HandleAnyCollisionsSelf(unsigned cell) {
+    unsigned begin = m_cellStart[cell];
+    unsigned end = m_cellStart[cell + 1];
+    unsigned num = end - begin;
+    if (num < 2)
+        return;
+    if (m_occupancyKernels && num <= MAX_KERNEL_OCCUPANCY) {
+        (this->*s_cellSelfKernels[num - 1])(begin);
+        return;
+    }
 
-    if (g_window->input.keyDowns[KEY_H])
-        m_showHistogram = true;
+    t_sweepStats.occupancy.numGeneral++;
+    for (unsigned i = begin; i + 1 < end; i++)
+        HandleParticleCollisions(i, i + 1, end);
+}
 
-    if (m_showHistogram)
-        memset(m_speedHistogram, 0, sizeof(unsigned) * SPEED_HISTOGRAM_NUM_BINS);
 
-    for (unsigned y = 0; y < GRID_RES_Y; y++) {
-        for (unsigned x = 0; x < GRID_RES_X; x++) {
-            PList *plistGrid = m_grid + y * GRID_RES_X + x;
-            if (plistGrid->IsEmpty())
+// The FORMAT_FIXED version of HandleCollision(). (dx, dy) is the position of
+// particle j relative to particle i, in fixed point units. The same maths as
+// the float version, done in float but in fixed point units throughout.
+void Particles::HandleCollisionFixed(unsigned i, unsigned j, int dx, int dy, unsigned distSqrd) {
+    t_sweepStats.numCollisions++;
+
+    float dist = sqrtf(distSqrd);
+    float invDist = 1.0f / dist;
+    float normX = dx * invDist;
+    float normY = dy * invDist;
+    float tangX = normY;
+    float tangY = -normX;
+
+    float p1VelNorm = DotProduct(m_fvx[i], m_fvy[i], normX, normY);
+    float p2VelNorm = DotProduct(m_fvx[j], m_fvy[j], normX, normY);
+    float p1VelTang = DotProduct(m_fvx[i], m_fvy[i], tangX, tangY);
+    float p2VelTang = DotProduct(m_fvx[j], m_fvy[j], tangX, tangY);
+
+    // Equal masses, so the normal velocities are swapped.
+    m_fvx[i] = ToFixed16(p2VelNorm * normX + p1VelTang * tangX);
+    m_fvy[i] = ToFixed16(p2VelNorm * normY + p1VelTang * tangY);
+    m_fvx[j] = ToFixed16(p1VelNorm * normX + p2VelTang * tangX);
+    m_fvy[j] = ToFixed16(p1VelNorm * normY + p2VelTang * tangY);
+
+    float pushAmount = (m_fixedRadius2 - dist) * 0.5f;
+    int pushX = lrintf(normX * pushAmount);
+    int pushY = lrintf(normY * pushAmount);
+    m_fx[i] -= pushX;
+    m_fy[i] -= pushY;
+    m_fx[j] += pushX;
+    m_fy[j] += pushY;
+}
+
+
+// Handles collisions between particle i and the particles in [otherBegin,
+// otherEnd), which are in a cell (offsetX, offsetY) fixed point units from
+// particle i's cell.
+void Particles::HandleParticleCollisionsFixed(unsigned i, unsigned otherBegin, unsigned otherEnd,
+                                              int offsetX, int offsetY) {
+    int const radius2 = m_fixedRadius2;
+    unsigned const radius2Sqrd = radius2 * radius2;
+
+    // Particle i in the other cell's coordinates.
+    int x = m_fx[i] - offsetX;
+    int y = m_fy[i] - offsetY;
+    for (unsigned j = otherBegin; j < otherEnd; j++) {
+        int dx = m_fx[j] - x;
+        int dy = m_fy[j] - y;
+
+        // Reject on each axis first, so the squares can't overflow. The casts
+        // fold each two sided test into one.
+        if ((unsigned)(dx + radius2 - 1) >= (unsigned)(radius2 * 2 - 1) ||
+            (unsigned)(dy + radius2 - 1) >= (unsigned)(radius2 * 2 - 1))
+            continue;
+        unsigned distSqrd = dx * dx + dy * dy;
+        if (distSqrd < radius2Sqrd && distSqrd > 0) {
+            // There has been a collision. It moves particle i.
+            HandleCollisionFixed(i, j, dx, dy, distSqrd);
+            x = m_fx[i] - offsetX;
+            y = m_fy[i] - offsetY;
+        }
+    }
+}
+
+
+// Bounces the particles in the cell at (x, y) off any wall spheres they touch.
+// Only the velocity changes, and only if the particle is moving into the wall.
+void Particles::HandleWallCollisions(unsigned x, unsigned y, unsigned cell) {
+    unsigned numSpheres;
+    WallSphere const *spheres = m_walls->GetCellSpheres(x, y, &numSpheres);
+    unsigned end = m_cellStart[cell + 1];
+    for (unsigned i = m_cellStart[cell]; i < end; i++)
+        HandleParticleWallCollisions(i, spheres, numSpheres);
+}
+
+
+inline void Particles::HandleParticleWallCollisions(unsigned i, WallSphere const *spheres, unsigned numSpheres) {
+    float const reach = WALL_SPHERE_RADIUS + m_speciesRadius[GetSpecies(i)];
+    for (unsigned k = 0; k < numSpheres; k++) {
+        WallSphere const &ws = spheres[k];
+        float deltaX = ws.x - m_x[i];
+        float deltaY = ws.y - m_y[i];
+        if (deltaX * deltaX + deltaY * deltaY >= reach * reach)
+            continue;
+
+        // Ignore collisions where particle is already moving away
+        // from wall (ie within 90 degrees of the wall's normal).
+        float dp = DotProduct(m_vx[i], m_vy[i], ws.normalX, ws.normalY);
+        if (dp < 0.0f) {
+            // Reflect particle velocity about the surface normal.
+            m_vx[i] -= 2.0f * (dp * ws.normalX);
+            m_vy[i] -= 2.0f * (dp * ws.normalY);
+            t_sweepStats.wallImpulse -= 2.0f * dp;
+        }
+    }
+}
+
+
+// The FORMAT_FIXED version of HandleWallCollisions().
+void Particles::HandleWallCollisionsFixed(unsigned x, unsigned y, unsigned cell) {
+    float const reach = (WALL_SPHERE_RADIUS + PARTICLE_RADIUS) * m_fixedUnitsPerWorld;
+    float const cellLeft = (float)x * FIXED_CELL_UNITS;
+    float const cellTop = (float)y * FIXED_CELL_UNITS;
+    unsigned numSpheres;
+    WallSphere const *spheres = m_walls->GetCellSpheres(x, y, &numSpheres);
+    unsigned end = m_cellStart[cell + 1];
+    for (unsigned i = m_cellStart[cell]; i < end; i++) {
+        for (unsigned k = 0; k < numSpheres; k++) {
+            WallSphere const &ws = spheres[k];
+            float deltaX = ws.x * m_fixedUnitsPerWorld - cellLeft - m_fx[i];
+            float deltaY = ws.y * m_fixedUnitsPerWorld - cellTop - m_fy[i];
+            if (deltaX * deltaX + deltaY * deltaY >= reach * reach)
                 continue;
 
-            PList *plist = plistGrid;
-            PList *prevPlist = NULL;
-            while (1) {
-                Particle *p = &plist->p;
-
-                // Increment position and keep particle inside the bounds of the world.
-                p->x += p->vx * advanceTime;
-                if ((p->x < 0.0f && p->vx < 0.0f) || (p->x > WORLD_SIZE_X && p->vx > 0.0f))
-                    p->vx = -p->vx;
-                p->y += p->vy * advanceTime;
-                if ((p->y < 0.0f && p->vy < 0.0f) || (p->y > WORLD_SIZE_Y && p->vy > 0.0f))
-                    p->vy = -p->vy;
-
-                // Update speed histogram
-                if (m_showHistogram) {
-                    float speed = sqrtf(p->vx * p->vx + p->vy * p->vy);
-                    unsigned bin_index = SPEED_HISTOGRAM_NUM_BINS * speed / (3.0f * MAX_INITIAL_SPEED);
-                    if (bin_index >= SPEED_HISTOGRAM_NUM_BINS)
-                        bin_index = SPEED_HISTOGRAM_NUM_BINS - 1;
-                    m_speedHistogram[bin_index]++;
-                }
+            float dp = DotProduct(m_fvx[i], m_fvy[i], ws.normalX, ws.normalY);
+            if (dp < 0.0f) {
+                m_fvx[i] = ToFixed16(m_fvx[i] - 2.0f * (dp * ws.normalX));
+                m_fvy[i] = ToFixed16(m_fvy[i] - 2.0f * (dp * ws.normalY));
+                t_sweepStats.wallImpulse -= 2.0f * dp / FIXED_VEL_SCALE;
+            }
+        }
+    }
+}
 
-                // Move this particle into another cell, if needed.
-                PList *newPlist = GetPListFromCoords(p->x, p->y);
-                if (newPlist && plistGrid != newPlist) {
-                    AddParticle(p, newPlist);
 
-                    if (plist == plistGrid) {
-                        if (plist->nextIdx == -1) {
-                            plist->p.x = INVALID_PARTICLE_X;
-                            break;
-                        }
-                        else {
-                            unsigned nextIdx = plist->nextIdx;
-                            PList *toFree = &m_particles[plist->nextIdx];
-                            *plist = m_particles[plist->nextIdx];
-                            toFree->nextIdx = m_firstFreeIdx;
-                            m_firstFreeIdx = nextIdx;
-                        }
-                    }
-                    else {
-                        unsigned toFreeIdx = prevPlist->nextIdx;
-                        unsigned nextIdx = plist->nextIdx;
-                        prevPlist->nextIdx = plist->nextIdx;
-                        plist->nextIdx = m_firstFreeIdx;
-                        m_firstFreeIdx = toFreeIdx;
-                        if (nextIdx == -1)
-                            break;
-                        plist = &m_particles[nextIdx];
-                    }
-                }
-                else {
-                    prevPlist = plist;
-                    if (plist->nextIdx == -1)
-                        break;
-                    plist = &m_particles[plist->nextIdx];
-                }
-            } // end while
+// Moves the particles, bounces them off the edges of the world and works out
+// which cell each one is now in, ready for SortByCell(). Each particle is only
+// read and written at its own index, and the bounces are selects rather than
+// branches, so without walls or reductions the loop vectorizes.
+template <bool SDF, bool REDUCE>
+void Particles::IntegrateImpl(IntegrateTask *task) {
+    float advanceTime = m_advanceTime;
+
+    // Local copies of the sizes. Otherwise the compiler has to assume that the
+    // stores to m_x etc might change them, and reloads them every iteration.
+    float * const xs = m_x;
+    float * const ys = m_y;
+    float * const vxs = m_vx;
+    float * const vys = m_vy;
+    unsigned * const cellIdx = m_cellIdx;
+    float const worldSizeX = m_worldSizeX;
+    float const worldSizeY = m_worldSizeY;
+    float const worldToCellX = m_worldToCellX;
+    float const worldToCellY = m_worldToCellY;
+    float const maxGridX = m_gridResX - 1;
+    float const maxGridY = m_gridResY - 1;
+    unsigned const gridResX = m_gridResX;
+    bool const morton = m_layout == LAYOUT_MORTON;
+    Walls const * const sdfWalls = m_sdfWalls;
+    uint8_t const * const species = m_species;
+    double wallImpulse = 0.0;
+
+    // Accumulated locally and copied to the task at the end, so that threads
+    // never write to shared cache lines in the loop.
+    unsigned char const * const speedBinLut = m_speedBinLut;
+    float const speedSqrdToLut = m_speedSqrdToLut;
+    unsigned speedHistogram[SPEED_HISTOGRAM_NUM_BINS] = { 0 };
+    double energySum = 0.0;         // Twice the kinetic energy.
+    double momentumX = 0.0;
+    double momentumY = 0.0;
+    double massSum = 0.0;
+    float maxSpeedSqrd = 0.0f;
+
+    for (unsigned i = task->begin; i < task->end; i++) {
+        float x = xs[i];
+        float y = ys[i];
+        float vx = vxs[i];
+        float vy = vys[i];
+        float startSpeedSqrd = vx * vx + vy * vy;
+        maxSpeedSqrd = startSpeedSqrd > maxSpeedSqrd ? startSpeedSqrd : maxSpeedSqrd;
+
+        // Increment position and keep particle inside the bounds of the world.
+        x += vx * advanceTime;
+        bool bounceX = (x < 0.0f & vx < 0.0f) | (x > worldSizeX & vx > 0.0f);
+        wallImpulse += bounceX ? 2.0f * fabsf(vx) : 0.0f;
+        vx = bounceX ? -vx : vx;
+        y += vy * advanceTime;
+        bool bounceY = (y < 0.0f & vy < 0.0f) | (y > worldSizeY & vy > 0.0f);
+        wallImpulse += bounceY ? 2.0f * fabsf(vy) : 0.0f;
+        vy = bounceY ? -vy : vy;
+
+        if (SDF)
+            CollideWithSdf(sdfWalls, m_speciesRadius[species ? species[i] : 0], &x, &y, &vx, &vy, &wallImpulse);
+
+        if (REDUCE) {
+            float mass = m_speciesMass[species ? species[i] : 0];
+            float speedSqrd = vx * vx + vy * vy;
+            unsigned lutIndex = std::min((unsigned)(speedSqrd * speedSqrdToLut), SPEED_BIN_LUT_SIZE - 1);
+            speedHistogram[speedBinLut[lutIndex]]++;
+            energySum += mass * speedSqrd;
+            momentumX += mass * vx;
+            momentumY += mass * vy;
+            massSum += mass;
+        }
+
+        xs[i] = x;
+        ys[i] = y;
+        vxs[i] = vx;
+        vys[i] = vy;
+
+        // The same as GetCellIndexFromCoords().
+        float gridX = x * worldToCellX;
+        float gridY = y * worldToCellY;
+        gridX = gridX < 0.0f ? 0.0f : (gridX > maxGridX ? maxGridX : gridX);
+        gridY = gridY < 0.0f ? 0.0f : (gridY > maxGridY ? maxGridY : gridY);
+        unsigned rowMajor = (unsigned)gridY * gridResX + (unsigned)gridX;
+        cellIdx[i] = morton ? MortonEncode(gridX, gridY) : rowMajor;
+    }
+
+    task->wallImpulse = wallImpulse;
+    task->maxSpeedSqrd = maxSpeedSqrd;
+    if (REDUCE) {
+        memcpy(task->speedHistogram, speedHistogram, sizeof(speedHistogram));
+        task->kineticEnergy = 0.5 * energySum;
+        task->momentumX = momentumX;
+        task->momentumY = momentumY;
+        task->mass = massSum;
+    }
+}
+
+
+void Particles::Integrate(IntegrateTask *task) {
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        if (m_sdfWalls)
+            task->reduce ? IntegrateFixedImpl<true, true>(task) : IntegrateFixedImpl<true, false>(task);
+        else
+            task->reduce ? IntegrateFixedImpl<false, true>(task) : IntegrateFixedImpl<false, false>(task);
+    }
+    else {
+        if (m_sdfWalls)
+            task->reduce ? IntegrateImpl<true, true>(task) : IntegrateImpl<true, false>(task);
+        else
+            task->reduce ? IntegrateImpl<false, true>(task) : IntegrateImpl<false, false>(task);
+    }
+
+    // While the task's particles are still in cache.
+    if (m_verletSkin > 0.0f && m_verletValid) {
+        float const *xs = m_x;
+        float const *ys = m_y;
+        float const *verletXs = m_verletX.data();
+        float const *verletYs = m_verletY.data();
+        float maxMoveSqrd = 0.0f;
+        for (unsigned i = task->begin; i < task->end; i++) {
+            float dx = xs[i] - verletXs[i];
+            float dy = ys[i] - verletYs[i];
+            float moveSqrd = dx * dx + dy * dy;
+            maxMoveSqrd = moveSqrd > maxMoveSqrd ? moveSqrd : maxMoveSqrd;
+        }
+        task->maxVerletMoveSqrd = maxMoveSqrd;
+    }
+}
+
+
+// The FORMAT_FIXED version of Integrate(). The positions are relative to the
+// particles' cells, so this also moves each particle into its new cell's
+// coordinates.
+template <bool SDF, bool REDUCE>
+void Particles::IntegrateFixedImpl(IntegrateTask *task) {
+    float advanceTime = m_advanceTime;
+
+    // Local copies of everything, for the same reason as in Integrate().
+    int16_t * const fx = m_fx;
+    int16_t * const fy = m_fy;
+    int16_t * const fvx = m_fvx;
+    int16_t * const fvy = m_fvy;
+    unsigned * const cellIdx = m_cellIdx;
+    double wallImpulse = 0.0;     // In fixed point velocity units until the end.
+
+    // The sums are exact in fixed point.
+    unsigned char const * const speedBinLut = m_speedBinLut;
+    float const speedSqrdToLut = m_speedSqrdToLut / (FIXED_VEL_SCALE * FIXED_VEL_SCALE);
+    float const velScaleSqrd = 1.0f / (FIXED_VEL_SCALE * FIXED_VEL_SCALE);
+    unsigned speedHistogram[SPEED_HISTOGRAM_NUM_BINS] = { 0 };
+    long long speedSqrdSum = 0;
+    long long momentumX = 0;
+    long long momentumY = 0;
+    int maxSpeedSqrd = 0;
+
+    // Fixed point velocity times this is the distance moved in fixed point position units.
+    float const velToMove = advanceTime * m_fixedUnitsPerWorld / FIXED_VEL_SCALE;
+    int const maxX = lrintf(m_worldSizeX * m_fixedUnitsPerWorld);
+    int const maxY = lrintf(m_worldSizeY * m_fixedUnitsPerWorld);
+    int const maxCellX = m_gridResX - 1;
+    int const maxCellY = m_gridResY - 1;
+    unsigned const gridResX = m_gridResX;
+    Walls const * const sdfWalls = m_sdfWalls;
+    float const unitsPerWorld = m_fixedUnitsPerWorld;
+    float const worldPerUnit = 1.0f / m_fixedUnitsPerWorld;
+
+    // A double has enough precision to get the row right for any grid. It is
+    // much cheaper than an integer divide.
+    double const invGridResX = 1.0 / gridResX;
+
+    for (unsigned i = task->begin; i < task->end; i++) {
+        int cellY = cellIdx[i] * invGridResX;
+        int cellX = cellIdx[i] - cellY * gridResX;
+
+        // Increment position and keep particle inside the bounds of the world.
+        int vx = fvx[i];
+        int vy = fvy[i];
+        int startSpeedSqrd = vx * vx + vy * vy;
+        maxSpeedSqrd = startSpeedSqrd > maxSpeedSqrd ? startSpeedSqrd : maxSpeedSqrd;
+        // In the same order as IntegrateImpl(): the world's edges, then the
+        // walls. Negating -32768 doesn't fit in 16 bits, so it saturates.
+        int x = cellX * FIXED_CELL_UNITS + fx[i] + lrintf(vx * velToMove);
+        int y = cellY * FIXED_CELL_UNITS + fy[i] + lrintf(vy * velToMove);
+        bool bounceX = (x < 0 & vx < 0) | (x > maxX & vx > 0);
+        bool bounceY = (y < 0 & vy < 0) | (y > maxY & vy > 0);
+        wallImpulse += bounceX ? 2 * abs(vx) : 0;
+        wallImpulse += bounceY ? 2 * abs(vy) : 0;
+        vx = bounceX ? std::min(-vx, 32767) : vx;
+        vy = bounceY ? std::min(-vy, 32767) : vy;
+        if (SDF) {
+            // The reflection doesn't care what units the velocity is in.
+            float wx = x * worldPerUnit;
+            float wy = y * worldPerUnit;
+            float wvx = vx;
+            float wvy = vy;
+            if (CollideWithSdf(sdfWalls, PARTICLE_RADIUS, &wx, &wy, &wvx, &wvy, &wallImpulse)) {
+                x = lrintf(wx * unitsPerWorld);
+                y = lrintf(wy * unitsPerWorld);
+                vx = ToFixed16(wvx);
+                vy = ToFixed16(wvy);
+            }
+        }
+        fvx[i] = vx;
+        fvy[i] = vy;
+
+        if (REDUCE) {
+            int speedSqrd = vx * vx + vy * vy;
+            unsigned lutIndex = std::min((unsigned)(speedSqrd * speedSqrdToLut), SPEED_BIN_LUT_SIZE - 1);
+            speedHistogram[speedBinLut[lutIndex]]++;
+            speedSqrdSum += speedSqrd;
+            momentumX += vx;
+            momentumY += vy;
+        }
+
+        // Rebin, and make the position relative to the new cell.
+        cellX = std::min(std::max(x >> FIXED_CELL_BITS, 0), maxCellX);
+        cellY = std::min(std::max(y >> FIXED_CELL_BITS, 0), maxCellY);
+        fx[i] = x - cellX * FIXED_CELL_UNITS;
+        fy[i] = y - cellY * FIXED_CELL_UNITS;
+        cellIdx[i] = cellY * gridResX + cellX;
+    }
+
+    task->wallImpulse = wallImpulse / FIXED_VEL_SCALE;
+    task->maxSpeedSqrd = maxSpeedSqrd * velScaleSqrd;
+    if (REDUCE) {
+        memcpy(task->speedHistogram, speedHistogram, sizeof(speedHistogram));
+        task->kineticEnergy = 0.5 * speedSqrdSum * velScaleSqrd;
+        task->momentumX = (double)momentumX / FIXED_VEL_SCALE;
+        task->momentumY = (double)momentumY / FIXED_VEL_SCALE;
+        task->mass = task->end - task->begin;
+    }
+}
+
+
+// Moves particles begin to end - 1 to their places in the sorted arrays.
+// next[c - firstCell] is where the next particle in cell c goes, and is
+// incremented past it.
+void Particles::ScatterRange(unsigned begin, unsigned end, unsigned *next, unsigned firstCell) {
+    next -= firstCell;
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        for (unsigned i = begin; i < end; i++) {
+            unsigned dst = next[m_cellIdx[i]]++;
+            m_sortedFx[dst] = m_fx[i];
+            m_sortedFy[dst] = m_fy[i];
+            m_sortedFvx[dst] = m_fvx[i];
+            m_sortedFvy[dst] = m_fvy[i];
+            m_sortedCellIdx[dst] = m_cellIdx[i];
+        }
+    }
+    else if (m_species) {
+        for (unsigned i = begin; i < end; i++) {
+            unsigned dst = next[m_cellIdx[i]]++;
+            m_sortedX[dst] = m_x[i];
+            m_sortedY[dst] = m_y[i];
+            m_sortedVx[dst] = m_vx[i];
+            m_sortedVy[dst] = m_vy[i];
+            m_sortedSpecies[dst] = m_species[i];
+        }
+    }
+    else {
+        for (unsigned i = begin; i < end; i++) {
+            unsigned dst = next[m_cellIdx[i]]++;
+            m_sortedX[dst] = m_x[i];
+            m_sortedY[dst] = m_y[i];
+            m_sortedVx[dst] = m_vx[i];
+            m_sortedVy[dst] = m_vy[i];
+        }
+    }
+}
 
-            // Do collisions.
-            {
-                PList *otherPlist = NULL;
 
-                otherPlist = GetPListFromIndices(x - 1, y - 1);
-                if (otherPlist && !otherPlist->IsEmpty()) HandleAnyCollisions(plistGrid, otherPlist);
+void Particles::SwapSortedArrays() {
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        std::swap(m_cellIdx, m_sortedCellIdx);
+        std::swap(m_fx, m_sortedFx);
+        std::swap(m_fy, m_sortedFy);
+        std::swap(m_fvx, m_sortedFvx);
+        std::swap(m_fvy, m_sortedFvy);
+    }
+    else {
+        std::swap(m_x, m_sortedX);
+        std::swap(m_y, m_sortedY);
+        std::swap(m_vx, m_sortedVx);
+        std::swap(m_vy, m_sortedVy);
+        std::swap(m_species, m_sortedSpecies);
+    }
+}
 
-                otherPlist = GetPListFromIndices(x, y - 1);
-                if (otherPlist && !otherPlist->IsEmpty()) HandleAnyCollisions(plistGrid, otherPlist);
 
-                otherPlist = GetPListFromIndices(x + 1, y - 1);
-                if (otherPlist && !otherPlist->IsEmpty()) HandleAnyCollisions(plistGrid, otherPlist);
+// Counting sort of the particles by m_cellIdx. Also rebuilds m_cellStart. If
+// countsPerCell isn't NULL, fills in how many cells hold each number of
+// particles, which is nearly free while the counts are being summed. The sort
+// is stable, so the result is the same whichever path is taken and however
+// many threads there are.
+void Particles::SortByCell(unsigned countsPerCell[NUM_OCCUPANCY_BINS]) {
+    if (GetNumThreads() > 1 && SortByCellParallel(countsPerCell))
+        return;
 
-                otherPlist = GetPListFromIndices(x - 1, y);
-                if (otherPlist && !otherPlist->IsEmpty()) HandleAnyCollisions(plistGrid, otherPlist);
+    memset(m_cellStart, 0, sizeof(unsigned) * (m_numCellIndices + 1));
+    for (unsigned i = 0; i < m_numParticles; i++)
+        m_cellStart[m_cellIdx[i]]++;
+
+    if (countsPerCell)
+        memset(countsPerCell, 0, sizeof(unsigned) * NUM_OCCUPANCY_BINS);
+    unsigned total = 0;
+    for (unsigned c = 0; c < m_numCellIndices; c++) {
+        unsigned count = m_cellStart[c];
+        m_cellStart[c] = total;
+        total += count;
+        if (countsPerCell)
+            countsPerCell[count < NUM_OCCUPANCY_BINS ? count : NUM_OCCUPANCY_BINS - 1]++;
+    }
+
+    // Some Morton indices are outside the grid. They are always empty.
+    if (countsPerCell)
+        countsPerCell[0] -= m_numCellIndices - m_numCells;
+
+    // Scattering increments each cell's entry, so that afterwards m_cellStart[c]
+    // is where cell c + 1 starts. Shift everything up by one to fix that.
+    ScatterRange(0, m_numParticles, m_cellStart, 0);
+    SwapSortedArrays();
+    memmove(m_cellStart + 1, m_cellStart, sizeof(unsigned) * m_numCellIndices);
+    m_cellStart[0] = 0;
+}
 
-                HandleAnyCollisionsSelf(plistGrid);  // Special one - check cell against itself.
+
+// The parallel version of SortByCell(). Each task counts its particles into
+// its own window of cells. The windows are summed into m_cellStart in chunks of
+// cells, which also turns each task's counts into where its particles go,
+// after those of the tasks before it. Then each task scatters its own
+// particles. Returns false, having done nothing, if the windows add up to too
+// many cells, as they do when the particles aren't nearly sorted already or in
+// the Morton layout, where moving one cell can change the index a lot.
+bool Particles::SortByCellParallel(unsigned countsPerCell[NUM_OCCUPANCY_BINS]) {
+    unsigned numTasks = GetNumThreads() * 4;
+    if (numTasks > MAX_NUM_TASKS)
+        numTasks = MAX_NUM_TASKS;
+    SortTask tasks[MAX_NUM_TASKS];
+    for (unsigned t = 0; t < numTasks; t++) {
+        tasks[t].begin = (m_numParticles * (unsigned long long)t) / numTasks;
+        tasks[t].end = (m_numParticles * (unsigned long long)(t + 1)) / numTasks;
+    }
+
+    m_threadPool->ParallelFor(numTasks, [&](unsigned t) {
+        unsigned firstCell = m_numCellIndices;
+        unsigned lastCell = 0;
+        for (unsigned i = tasks[t].begin; i < tasks[t].end; i++) {
+            firstCell = std::min(firstCell, m_cellIdx[i]);
+            lastCell = std::max(lastCell, m_cellIdx[i]);
+        }
+        tasks[t].firstCell = firstCell;
+        tasks[t].endCell = firstCell <= lastCell ? lastCell + 1 : firstCell;
+    });
+
+    size_t windowsSize = 0;
+    for (unsigned t = 0; t < numTasks; t++)
+        windowsSize += tasks[t].endCell - tasks[t].firstCell;
+    if (windowsSize > (size_t)m_numCellIndices * MAX_SORT_WINDOWS_PER_CELL)
+        return false;
+    m_sortWindows.resize(windowsSize);
+    size_t windowOffset = 0;
+    for (unsigned t = 0; t < numTasks; t++) {
+        tasks[t].next = m_sortWindows.data() + windowOffset;
+        windowOffset += tasks[t].endCell - tasks[t].firstCell;
+    }
+
+    m_threadPool->ParallelFor(numTasks, [&](unsigned t) {
+        SortTask const &task = tasks[t];
+        unsigned *counts = task.next - task.firstCell;
+        memset(task.next, 0, sizeof(unsigned) * (task.endCell - task.firstCell));
+        for (unsigned i = task.begin; i < task.end; i++)
+            counts[m_cellIdx[i]]++;
+    });
+
+    // Sum the windows into the cell counts, a chunk of cells per task.
+    unsigned numChunks = numTasks;
+    unsigned chunkTotals[MAX_NUM_TASKS];
+    unsigned chunkOccupancy[MAX_NUM_TASKS][NUM_OCCUPANCY_BINS];
+    auto ChunkBegin = [&](unsigned chunk) {
+        return (unsigned)((m_numCellIndices * (unsigned long long)chunk) / numChunks);
+    };
+    m_threadPool->ParallelFor(numChunks, [&](unsigned chunk) {
+        unsigned chunkBegin = ChunkBegin(chunk);
+        unsigned chunkEnd = ChunkBegin(chunk + 1);
+        memset(m_cellStart + chunkBegin, 0, sizeof(unsigned) * (chunkEnd - chunkBegin));
+        for (unsigned t = 0; t < numTasks; t++) {
+            unsigned begin = std::max(tasks[t].firstCell, chunkBegin);
+            unsigned end = std::min(tasks[t].endCell, chunkEnd);
+            unsigned const *counts = tasks[t].next - tasks[t].firstCell;
+            for (unsigned c = begin; c < end; c++)
+                m_cellStart[c] += counts[c];
+        }
+
+        unsigned total = 0;
+        unsigned *occupancy = chunkOccupancy[chunk];
+        memset(occupancy, 0, sizeof(unsigned) * NUM_OCCUPANCY_BINS);
+        for (unsigned c = chunkBegin; c < chunkEnd; c++) {
+            unsigned count = m_cellStart[c];
+            total += count;
+            occupancy[count < NUM_OCCUPANCY_BINS ? count : NUM_OCCUPANCY_BINS - 1]++;
+        }
+        chunkTotals[chunk] = total;
+    });
+
+    unsigned chunkStarts[MAX_NUM_TASKS];
+    unsigned total = 0;
+    for (unsigned chunk = 0; chunk < numChunks; chunk++) {
+        chunkStarts[chunk] = total;
+        total += chunkTotals[chunk];
+    }
+
+    // Prefix sum each chunk, then hand out each cell's range to the tasks in
+    // order. That leaves m_cellStart[c] where cell c + 1 starts, as in the
+    // serial version.
+    m_threadPool->ParallelFor(numChunks, [&](unsigned chunk) {
+        unsigned chunkBegin = ChunkBegin(chunk);
+        unsigned chunkEnd = ChunkBegin(chunk + 1);
+        unsigned running = chunkStarts[chunk];
+        for (unsigned c = chunkBegin; c < chunkEnd; c++) {
+            unsigned count = m_cellStart[c];
+            m_cellStart[c] = running;
+            running += count;
+        }
+        for (unsigned t = 0; t < numTasks; t++) {
+            unsigned begin = std::max(tasks[t].firstCell, chunkBegin);
+            unsigned end = std::min(tasks[t].endCell, chunkEnd);
+            unsigned *next = tasks[t].next - tasks[t].firstCell;
+            for (unsigned c = begin; c < end; c++) {
+                unsigned count = next[c];
+                next[c] = m_cellStart[c];
+                m_cellStart[c] += count;
             }
         }
+    });
+
+    m_threadPool->ParallelFor(numTasks, [&](unsigned t) {
+        ScatterRange(tasks[t].begin, tasks[t].end, tasks[t].next, tasks[t].firstCell);
+    });
+    SwapSortedArrays();
+    memmove(m_cellStart + 1, m_cellStart, sizeof(unsigned) * m_numCellIndices);
+    m_cellStart[0] = 0;
+
+    if (countsPerCell) {
+        memset(countsPerCell, 0, sizeof(unsigned) * NUM_OCCUPANCY_BINS);
+        for (unsigned chunk = 0; chunk < numChunks; chunk++) {
+            for (unsigned i = 0; i < NUM_OCCUPANCY_BINS; i++)
+                countsPerCell[i] += chunkOccupancy[chunk][i];
+        }
+        countsPerCell[0] -= m_numCellIndices - m_numCells;
     }
+    return true;
 }
 
 
-void Particles::Render(DfBitmap *bmp) {
-    static const DfColour col = g_colourWhite;
+template <unsigned FIXED_GRID_RES_X>
+void Particles::CollideCell(unsigned x, unsigned y, unsigned cell) {
+    unsigned const gridResX = FIXED_GRID_RES_X ? FIXED_GRID_RES_X : m_gridResX;
+    if (m_cellStart[cell] == m_cellStart[cell + 1])
+        return;
 
-    for (unsigned y = 0; y < GRID_RES_Y; y++) {
-        for (unsigned x = 0; x < GRID_RES_X; x++) {
-            PList *plist = m_grid + y * GRID_RES_X + x;
-            if (plist->IsEmpty())
+    if (m_layout == LAYOUT_ROW_MAJOR) {
+        // The cells (x-1, y-1), (x, y-1) and (x+1, y-1) are next to each other
+        // in the particle arrays, so they can be handled as one range.
+        if (y > 0) {
+            unsigned firstCell = cell - gridResX - (x > 0 ? 1 : 0);
+            unsigned lastCell = cell - gridResX + (x + 1 < gridResX ? 1 : 0);
+            HandleAnyCollisions(cell, m_cellStart[firstCell], m_cellStart[lastCell + 1]);
+        }
+        if (x > 0) HandleAnyCollisions(cell, m_cellStart[cell - 1], m_cellStart[cell]);
+    }
+    else {
+        // Step through the Morton index directly. The x and y bits are
+        // interleaved, so decrementing one coordinate means filling the other's
+        // bits with ones so the borrow passes through them.
+        static unsigned const X_BITS = 0x55555555;
+        static unsigned const Y_BITS = 0xaaaaaaaa;
+        unsigned left = (((cell & X_BITS) - 1) & X_BITS) | (cell & Y_BITS);
+        if (y > 0) {
+            unsigned up = (((cell & Y_BITS) - 1) & Y_BITS) | (cell & X_BITS);
+            unsigned upRight = (((up | Y_BITS) + 1) & X_BITS) | (up & Y_BITS);
+            unsigned upLeft = (((up & X_BITS) - 1) & X_BITS) | (up & Y_BITS);
+
+            // Where the Morton curve puts two of the neighbours next to each
+            // other, handle them as one range.
+            unsigned rangeBegin = m_cellStart[up];
+            unsigned rangeEnd = m_cellStart[up + 1];
+            if (x > 0) {
+                if (upLeft + 1 == up)
+                    rangeBegin = m_cellStart[upLeft];
+                else
+                    HandleAnyCollisions(cell, m_cellStart[upLeft], m_cellStart[upLeft + 1]);
+            }
+            if (x + 1 < gridResX) {
+                if (up + 1 == upRight)
+                    rangeEnd = m_cellStart[upRight + 1];
+                else
+                    HandleAnyCollisions(cell, m_cellStart[upRight], m_cellStart[upRight + 1]);
+            }
+            HandleAnyCollisions(cell, rangeBegin, rangeEnd);
+        }
+        if (x > 0) HandleAnyCollisions(cell, m_cellStart[left], m_cellStart[left + 1]);
+    }
+
+    HandleAnyCollisionsSelf(cell);  // Special one - check cell against itself.
+
+    if (m_walls && m_walls->CellHasWalls(x, y))
+        HandleWallCollisions(x, y, cell);
+}
+
+
+// Handles collisions between the cell at (x, y) and those of its neighbours
+// above and to the left that are inside (or, if insideTile is false, outside)
+// the tile that starts at (tileX, tileY) and ends before column tileEndX.
+// The cell's collisions with itself and the walls count as inside the tile.
+void Particles::CollideCellTiled(unsigned x, unsigned y, unsigned cell,
+                                 unsigned tileX, unsigned tileY, unsigned tileEndX, bool insideTile) {
+    if (m_cellStart[cell] == m_cellStart[cell + 1])
+        return;
+
+    static int const offsetsX[4] = { -1, 0, 1, -1 };
+    static int const offsetsY[4] = { -1, -1, -1, 0 };
+    for (unsigned i = 0; i < 4; i++) {
+        unsigned otherX = x + offsetsX[i];
+        unsigned otherY = y + offsetsY[i];
+        if (otherX >= m_gridResX || otherY >= m_gridResY)
+            continue;
+
+        bool otherInside = otherX >= tileX && otherX < tileEndX && otherY >= tileY;
+        if (otherInside != insideTile)
+            continue;
+
+        unsigned otherCell = GetCellIndexFromIndices(otherX, otherY);
+        HandleAnyCollisions(cell, m_cellStart[otherCell], m_cellStart[otherCell + 1]);
+    }
+
+    if (insideTile) {
+        HandleAnyCollisionsSelf(cell);
+        if (m_walls && m_walls->CellHasWalls(x, y))
+            HandleWallCollisions(x, y, cell);
+    }
+}
+
+
+// Calls func(x, y, cellIndex) for every cell in the specified rectangle, in the
+// order the cells are stored in. In the Morton layout, startX and startY must be
+// multiples of MORTON_BLOCK_SIZE.
+template <unsigned FIXED_GRID_RES_X, typename FUNC>
+void Particles::ForEachCell(unsigned startX, unsigned endX, unsigned startY, unsigned endY, FUNC const &func) {
+    unsigned const gridResX = FIXED_GRID_RES_X ? FIXED_GRID_RES_X : m_gridResX;
+    if (m_layout == LAYOUT_ROW_MAJOR) {
+        for (unsigned y = startY; y < endY; y++) {
+            for (unsigned x = startX; x < endX; x++)
+                func(x, y, y * gridResX + x);
+        }
+        return;
+    }
+
+    // Morton layout. Visit the cells block by block in Z-order. The blocks are
+    // aligned, so the cells in a block have consecutive indices.
+    for (unsigned blockY = startY; blockY < endY; blockY += MORTON_BLOCK_SIZE) {
+        for (unsigned blockX = startX; blockX < endX; blockX += MORTON_BLOCK_SIZE) {
+            unsigned blockCell = MortonEncode(blockX, blockY);
+            for (unsigned i = 0; i < MORTON_BLOCK_SIZE * MORTON_BLOCK_SIZE; i++) {
+                unsigned x = blockX + CompactBits(i);
+                unsigned y = blockY + CompactBits(i >> 1);
+                if (x < endX && y < endY)
+                    func(x, y, blockCell + i);
+            }
+        }
+    }
+}
+
+
+// Handles the collisions for every cell in the rows startY to endY - 1, against
+// the cells to their left and above them. The order the cells are visited in
+// doesn't change which pairs of cells are checked.
+template <unsigned FIXED_GRID_RES_X>
+void Particles::CollideRowsImpl(unsigned startY, unsigned endY) {
+    unsigned const gridResX = FIXED_GRID_RES_X ? FIXED_GRID_RES_X : m_gridResX;
+    ForEachCell<FIXED_GRID_RES_X>(0, gridResX, startY, endY, [this](unsigned x, unsigned y, unsigned cell) {
+        CollideCell<FIXED_GRID_RES_X>(x, y, cell);
+    });
+}
+
+
+// The FORMAT_FIXED version of CollideRowsImpl(). Each neighbouring cell is a
+// different offset away, so they can't be merged into one range.
+void Particles::CollideRowsFixed(unsigned startY, unsigned endY) {
+    static int const offsetsX[4] = { -1, 0, 1, -1 };
+    static int const offsetsY[4] = { -1, -1, -1, 0 };
+    unsigned const *cellStart = m_cellStart;
+
+    for (unsigned y = startY; y < endY; y++) {
+        for (unsigned x = 0; x < m_gridResX; x++) {
+            unsigned cell = y * m_gridResX + x;
+            unsigned begin = cellStart[cell];
+            unsigned end = cellStart[cell + 1];
+            if (begin == end)
                 continue;
 
-            while (1) {
-                float px = plist->p.x;
-                float py = plist->p.y;
-                g_world.WorldToScreen(&px, &py);
-                if (g_world.m_viewScale < 2.5f)
-                    PutPix(bmp, px, py, col);
+            // Gather the non-empty neighbours above and to the left.
+            unsigned numOthers = 0;
+            unsigned otherBegins[4];
+            unsigned otherEnds[4];
+            int otherOffsetsX[4];
+            int otherOffsetsY[4];
+            for (unsigned k = 0; k < 4; k++) {
+                unsigned otherX = x + offsetsX[k];
+                unsigned otherY = y + offsetsY[k];
+                if (otherX >= m_gridResX || otherY >= m_gridResY)
+                    continue;
+                unsigned otherCell = otherY * m_gridResX + otherX;
+                if (cellStart[otherCell] == cellStart[otherCell + 1])
+                    continue;
+                otherBegins[numOthers] = cellStart[otherCell];
+                otherEnds[numOthers] = cellStart[otherCell + 1];
+                otherOffsetsX[numOthers] = offsetsX[k] * FIXED_CELL_UNITS;
+                otherOffsetsY[numOthers] = offsetsY[k] * FIXED_CELL_UNITS;
+                numOthers++;
+            }
+
+            for (unsigned i = begin; i < end; i++) {
+                for (unsigned k = 0; k < numOthers; k++)
+                    HandleParticleCollisionsFixed(i, otherBegins[k], otherEnds[k], otherOffsetsX[k], otherOffsetsY[k]);
+                HandleParticleCollisionsFixed(i, i + 1, end, 0, 0);
+            }
+
+            if (m_walls && m_walls->CellHasWalls(x, y))
+                HandleWallCollisionsFixed(x, y, cell);
+        }
+    }
+}
+
+
+void Particles::CollideRows(unsigned startY, unsigned endY) {
+    if (m_verletSkin > 0.0f)
+        CollideRowsVerlet(startY, endY);
+    else if (m_format == ParticlesConfig::FORMAT_FIXED)
+        CollideRowsFixed(startY, endY);
+    else if (m_gridResX == ParticlesConfig::DEFAULT_GRID_RES_X)
+        CollideRowsImpl<ParticlesConfig::DEFAULT_GRID_RES_X>(startY, endY);
+    else
+        CollideRowsImpl<0>(startY, endY);
+}
+
+
+// Handles the collisions between particle i and the particles in its Verlet list.
+void Particles::HandleVerletCollisions(unsigned i) {
+    unsigned const *neighbours = m_verletNeighbours.data();
+    unsigned end = m_verletStart[i + 1];
+    if (m_species) {
+        SpeciesPair const *pairs = m_speciesPairs + m_species[i] * ParticlesConfig::MAX_SPECIES;
+        for (unsigned k = m_verletStart[i]; k < end; k++) {
+            unsigned j = neighbours[k];
+            SpeciesPair const &pair = pairs[m_species[j]];
+            float dx = m_x[i] - m_x[j];
+            float dy = m_y[i] - m_y[j];
+            float distSqrd = dx * dx + dy * dy;
+            if (distSqrd < pair.contactDistSqrd) {
+                if (pair.equalMass)
+                    HandleCollisionSpecies<true>(i, j, distSqrd, pair);
                 else
-                    CircleOutline(bmp, px, py, PARTICLE_RADIUS * g_world.m_viewScale, col);
-                if (plist->nextIdx == -1)
-                    break;
-                plist = &m_particles[plist->nextIdx];
+                    HandleCollisionSpecies<false>(i, j, distSqrd, pair);
+            }
+        }
+        return;
+    }
+
+    for (unsigned k = m_verletStart[i]; k < end; k++) {
+        unsigned j = neighbours[k];
+        float dx = m_x[i] - m_x[j];
+        float dy = m_y[i] - m_y[j];
+        float distSqrd = dx * dx + dy * dy;
+        if (distSqrd < RADIUS2 * RADIUS2)
+            HandleCollision(i, j, distSqrd);
+    }
+}
+
+
+// Builds every particle's Verlet list from the grid, which SortByCell() has
+// just rebuilt. Each task finds the neighbours of the particles in a band of
+// rows, in the same order of cells as CollideCell(), into its own array. Then
+// the arrays are joined, also in parallel.
+void Particles::BuildVerletLists() {
+    unsigned numTasks = GetNumTasks();
+    if (numTasks > m_gridResY)
+        numTasks = m_gridResY;
+    m_verletTaskNeighbours.resize(numTasks);
+    m_verletStart.resize(m_numParticles + 1);
+    m_verletX.resize(m_capacity);
+    m_verletY.resize(m_capacity);
+    float maxDist = sqrtf(m_maxContactDistSqrd) + m_verletSkin;
+    float const maxDistSqrd = maxDist * maxDist;
+
+    auto findNeighbours = [&](unsigned t) {
+        // Local copies, so that the stores to the lists can't make the
+        // compiler reload them.
+        float const * const xs = m_x;
+        float const * const ys = m_y;
+        unsigned const * const cellStart = m_cellStart;
+        unsigned * const verletStart = m_verletStart.data();
+        float * const verletXs = m_verletX.data();
+        float * const verletYs = m_verletY.data();
+        unsigned const gridResX = m_gridResX;
+
+        std::vector<unsigned> &neighbours = m_verletTaskNeighbours[t];
+        size_t numNeighbours = 0;
+        unsigned startY = (m_gridResY * t) / numTasks;
+        unsigned endY = (m_gridResY * (t + 1)) / numTasks;
+        for (unsigned y = startY; y < endY; y++) {
+            for (unsigned x = 0; x < gridResX; x++) {
+                unsigned cell = y * gridResX + x;
+                unsigned begin = cellStart[cell];
+                unsigned end = cellStart[cell + 1];
+
+                // The cells above, as one range, then the one to the left,
+                // then the rest of this one.
+                unsigned ranges[3][2] = { { 0, 0 }, { 0, 0 }, { 0, end } };
+                if (y > 0) {
+                    unsigned firstCell = cell - gridResX - (x > 0 ? 1 : 0);
+                    unsigned lastCell = cell - gridResX + (x + 1 < gridResX ? 1 : 0);
+                    ranges[0][0] = cellStart[firstCell];
+                    ranges[0][1] = cellStart[lastCell + 1];
+                }
+                if (x > 0) {
+                    ranges[1][0] = cellStart[cell - 1];
+                    ranges[1][1] = begin;
+                }
+
+                // Every candidate is written, and only the ones in reach are
+                // kept, so that there is no branch to mispredict. Make room
+                // for them all.
+                unsigned maxCandidates = ranges[0][1] - ranges[0][0] + ranges[1][1] - ranges[1][0] + end - begin;
+                if (numNeighbours + (size_t)maxCandidates * (end - begin) > neighbours.size())
+                    neighbours.resize((numNeighbours + (size_t)maxCandidates * (end - begin)) * 2);
+                unsigned *out = neighbours.data();
+
+                // The ranges hold a few particles at most, which is too few
+                // for the collision kernels to pay for their calls.
+                for (unsigned i = begin; i < end; i++) {
+                    float px = xs[i];
+                    float py = ys[i];
+                    verletStart[i] = numNeighbours;
+                    verletXs[i] = px;
+                    verletYs[i] = py;
+                    ranges[2][0] = i + 1;
+                    for (unsigned r = 0; r < 3; r++) {
+                        for (unsigned j = ranges[r][0]; j < ranges[r][1]; j++) {
+                            float dx = px - xs[j];
+                            float dy = py - ys[j];
+                            out[numNeighbours] = j;
+                            numNeighbours += dx * dx + dy * dy < maxDistSqrd;
+                        }
+                    }
+                }
             }
         }
+        neighbours.resize(numNeighbours);
+    };
+
+    // Each task's particles are a contiguous range, so joining the arrays only
+    // needs each task's offset added to its particles' starts.
+    std::vector<size_t> offsets(numTasks + 1, 0);
+    auto join = [&](unsigned t) {
+        std::vector<unsigned> const &neighbours = m_verletTaskNeighbours[t];
+        unsigned begin = m_cellStart[(m_gridResY * t) / numTasks * m_gridResX];
+        unsigned end = m_cellStart[(m_gridResY * (t + 1)) / numTasks * m_gridResX];
+        for (unsigned i = begin; i < end; i++)
+            m_verletStart[i] += offsets[t];
+        if (!neighbours.empty())
+            memcpy(m_verletNeighbours.data() + offsets[t], neighbours.data(), sizeof(unsigned) * neighbours.size());
+    };
+
+    if (m_threadPool)
+        m_threadPool->ParallelFor(numTasks, findNeighbours);
+    else {
+        for (unsigned t = 0; t < numTasks; t++)
+            findNeighbours(t);
+    }
+
+    for (unsigned t = 0; t < numTasks; t++)
+        offsets[t + 1] = offsets[t] + m_verletTaskNeighbours[t].size();
+    m_verletNeighbours.resize(offsets[numTasks]);
+    m_verletStart[m_numParticles] = offsets[numTasks];
+
+    if (m_threadPool)
+        m_threadPool->ParallelFor(numTasks, join);
+    else {
+        for (unsigned t = 0; t < numTasks; t++)
+            join(t);
+    }
+
+    m_verletValid = true;
+    m_verletMaxMoveSqrd = 0.0f;
+    m_numVerletBuilds++;
+}
+
+
+// CollideRows() from the Verlet lists. The lists were built with the
+// particles sorted, so the particles in rows startY to endY - 1 then are a
+// contiguous range, and their lists only reach into the row above. The walls
+// are found from the cell each particle is in now. That is worked out from its
+// position, because the float format's sort doesn't carry m_cellIdx along, so
+// after a rebuild m_cellIdx[i] may belong to some other particle.
+void Particles::CollideRowsVerlet(unsigned startY, unsigned endY) {
+    unsigned begin = m_cellStart[startY * m_gridResX];
+    unsigned end = m_cellStart[endY * m_gridResX];
+    for (unsigned i = begin; i < end; i++)
+        HandleVerletCollisions(i);
+
+    if (!m_walls)
+        return;
+    for (unsigned i = begin; i < end; i++) {
+        unsigned cell = GetCellIndexFromCoords(m_x[i], m_y[i]);
+        unsigned x = cell % m_gridResX;
+        unsigned y = cell / m_gridResX;
+        if (m_walls->CellHasWalls(x, y)) {
+            unsigned numSpheres;
+            WallSphere const *spheres = m_walls->GetCellSpheres(x, y, &numSpheres);
+            HandleParticleWallCollisions(i, spheres, numSpheres);
+        }
+    }
+}
+
+
+bool Particles::SetVerletSkin(float skin) {
+    if (skin <= 0.0f) {
+        m_verletSkin = 0.0f;
+        return true;
+    }
+
+    float reach = sqrtf(m_maxContactDistSqrd) + skin;
+    if (m_format != ParticlesConfig::FORMAT_FLOAT || m_layout != LAYOUT_ROW_MAJOR ||
+        reach > m_worldSizeX / m_gridResX || reach > m_worldSizeY / m_gridResY)
+        return false;
+
+    m_verletSkin = skin;
+    m_verletValid = false;
+    return true;
+}
+
+
+// Handles the pairs of cells that are both inside the specified tile. Touches
+// only the particles in the tile.
+void Particles::CollideTileInterior(unsigned tileX, unsigned tileY) {
+    unsigned endX = std::min(tileX + m_tileSize, m_gridResX);
+    unsigned endY = std::min(tileY + m_tileSize, m_gridResY);
+    ForEachCell<0>(tileX, endX, tileY, endY, [&](unsigned x, unsigned y, unsigned cell) {
+        // Only the cells on the top, left and right edges of the tile have
+        // neighbours outside it.
+        if (x > tileX && y > tileY && x + 1 < endX)
+            CollideCell<0>(x, y, cell);
+        else
+            CollideCellTiled(x, y, cell, tileX, tileY, endX, true);
+    });
+}
+
+
+// Handles the pairs of cells where one is in this tile and the other is in a
+// tile above it, to its left, or, for the cells in the right hand column, in
+// the tile to its right. Touches this tile, the tiles either side of it and
+// the three above it.
+void Particles::CollideTileBoundary(unsigned tileX, unsigned tileY) {
+    unsigned endX = std::min(tileX + m_tileSize, m_gridResX);
+    unsigned endY = std::min(tileY + m_tileSize, m_gridResY);
+
+    for (unsigned x = tileX; x < endX; x++)
+        CollideCellTiled(x, tileY, GetCellIndexFromIndices(x, tileY), tileX, tileY, endX, false);
+
+    for (unsigned y = tileY + 1; y < endY; y++) {
+        CollideCellTiled(tileX, y, GetCellIndexFromIndices(tileX, y), tileX, tileY, endX, false);
+        if (endX - 1 > tileX)
+            CollideCellTiled(endX - 1, y, GetCellIndexFromIndices(endX - 1, y), tileX, tileY, endX, false);
+    }
+}
+
+
+// Runs func(i) for each task i, on the thread pool if there is one, and adds
+// the tasks' SweepStats to the step's totals.
+template <typename FUNC>
+void Particles::ParallelSweep(unsigned numTasks, FUNC const &func) {
+    if (m_taskStats.size() < numTasks)
+        m_taskStats.resize(numTasks);
+
+    auto task = [&](unsigned i) {
+        t_sweepStats.numCollisions = 0;
+        t_sweepStats.wallImpulse = 0.0;
+        memset(&t_sweepStats.occupancy, 0, sizeof(t_sweepStats.occupancy));
+        func(i);
+        m_taskStats[i] = t_sweepStats;
+    };
+    if (m_threadPool) {
+        m_threadPool->ParallelFor(numTasks, task);
+    }
+    else {
+        for (unsigned i = 0; i < numTasks; i++)
+            task(i);
+    }
+
+    for (unsigned i = 0; i < numTasks; i++) {
+        m_numCollisions += m_taskStats[i].numCollisions;
+        m_wallImpulse += m_taskStats[i].wallImpulse;
+        m_occupancyStats.Add(m_taskStats[i].occupancy);
+    }
+}
+
+
+void Particles::CollideBands() {
+    if (!m_threadPool && !m_deterministic) {
+        ParallelSweep(1, [&](unsigned) { CollideRows(0, m_gridResY); });
+        return;
+    }
+
+    // Handling the collisions for a row touches that row and the one above it.
+    // Running the even bands and then the odd bands means that two bands that run
+    // at the same time are always separated by at least one other band.
+    // Band boundaries are rounded down to a multiple of MIN_BAND_HEIGHT, which
+    // keeps the Morton blocks whole. The collisions are handled in an order
+    // that depends on the bands, so in deterministic mode their number is fixed.
+    unsigned numBands = m_deterministic ? DETERMINISTIC_NUM_TASKS : GetNumThreads() * 2;
+    if (numBands > m_gridResY / MIN_BAND_HEIGHT)
+        numBands = m_gridResY / MIN_BAND_HEIGHT;
+    if (numBands < 2) {
+        ParallelSweep(1, [&](unsigned) { CollideRows(0, m_gridResY); });
+        return;
+    }
+    for (unsigned phase = 0; phase < 2; phase++) {
+        ParallelSweep((numBands + 1 - phase) / 2, [&](unsigned i) {
+            unsigned band = i * 2 + phase;
+            unsigned startY = (m_gridResY * band) / numBands / MIN_BAND_HEIGHT * MIN_BAND_HEIGHT;
+            unsigned endY = (m_gridResY * (band + 1)) / numBands / MIN_BAND_HEIGHT * MIN_BAND_HEIGHT;
+            if (band == numBands - 1)
+                endY = m_gridResY;
+            CollideRows(startY, endY);
+        });
+    }
+}
+
+
+void Particles::CollideTiles() {
+    unsigned numTilesX = (m_gridResX + m_tileSize - 1) / m_tileSize;
+    unsigned numTilesY = (m_gridResY + m_tileSize - 1) / m_tileSize;
+
+    // Pass 1: Tiles don't share any particles, so they can all run at once.
+    auto doInterior = [&](unsigned i) {
+        CollideTileInterior((i % numTilesX) * m_tileSize, (i / numTilesX) * m_tileSize);
+    };
+
+    // Pass 2: The boundary of a tile reaches into the tile row above it and
+    // into the tiles either side. Each task does a whole row of tiles, and the
+    // even and odd tile rows take turns, so no two tasks touch the same tile.
+    auto doBoundaryRow = [&](unsigned tileRow) {
+        for (unsigned i = 0; i < numTilesX; i++)
+            CollideTileBoundary(i * m_tileSize, tileRow * m_tileSize);
+    };
+
+    if (!m_threadPool && !m_deterministic) {
+        ParallelSweep(1, [&](unsigned) {
+            for (unsigned i = 0; i < numTilesX * numTilesY; i++)
+                doInterior(i);
+            for (unsigned i = 0; i < numTilesY; i++)
+                doBoundaryRow(i);
+        });
+        return;
+    }
+
+    ParallelSweep(numTilesX * numTilesY, doInterior);
+    for (unsigned phase = 0; phase < 2; phase++) {
+        ParallelSweep((numTilesY + 1 - phase) / 2, [&](unsigned i) {
+            doBoundaryRow(i * 2 + phase);
+        });
+    }
+}
+
+
+void Particles::Advance() {
+    IntegrateStep();
+    CollideStep();
+}
+
+
+// Each particle is moved exactly once.
+void Particles::IntegrateStep() {
+    IntegrateTask tasks[MAX_NUM_TASKS];
+    bool reduce = m_showHistogram || (m_reductionInterval > 0 && m_numSteps % m_reductionInterval == 0);
+    unsigned numTasks = GetNumTasks();
+    for (unsigned i = 0; i < numTasks; i++) {
+        tasks[i].begin = (m_numParticles * (unsigned long long)i) / numTasks;
+        tasks[i].end = (m_numParticles * (unsigned long long)(i + 1)) / numTasks;
+        tasks[i].wallImpulse = 0.0;
+        tasks[i].maxVerletMoveSqrd = 0.0f;
+        tasks[i].reduce = reduce;
+    }
+
+    if (m_threadPool) {
+        m_threadPool->ParallelFor(numTasks, [&](unsigned i) { Integrate(&tasks[i]); });
+    }
+    else {
+        for (unsigned i = 0; i < numTasks; i++)
+            Integrate(&tasks[i]);
+    }
+
+    m_numCollisions = 0;
+    m_wallImpulse = 0.0;
+    memset(&m_occupancyStats, 0, sizeof(m_occupancyStats));
+    float maxSpeedSqrd = 0.0f;
+    m_verletMaxMoveSqrd = 0.0f;
+    for (unsigned i = 0; i < numTasks; i++) {
+        m_wallImpulse += tasks[i].wallImpulse;
+        maxSpeedSqrd = std::max(maxSpeedSqrd, tasks[i].maxSpeedSqrd);
+        m_verletMaxMoveSqrd = std::max(m_verletMaxMoveSqrd, tasks[i].maxVerletMoveSqrd);
+    }
+    m_maxSpeed = sqrtf(maxSpeedSqrd);
+
+    if (reduce)
+        ReduceTasks(tasks, numTasks);
+    m_reduceThisStep = reduce;
+}
+
+
+void Particles::CollideStep() {
+    bool fixed = m_format == ParticlesConfig::FORMAT_FIXED;
+    bool reduce = m_reduceThisStep;
+    bool verlet = m_verletSkin > 0.0f;
+    float halfSkin = m_verletSkin * 0.5f;
+    if (!verlet || !m_verletValid || m_verletMaxMoveSqrd > halfSkin * halfSkin) {
+        SortByCell(reduce ? m_reductions.countsPerCell : NULL);
+        if (verlet)
+            BuildVerletLists();
+    }
+    if (reduce)
+        m_reductions.numParticles = m_cellStart[m_numCellIndices];
+
+    // Do collisions.
+    if (m_tileSize > 0 && !fixed && !verlet)
+        CollideTiles();
+    else
+        CollideBands();
+
+    m_simTime += m_advanceTime;
+    m_numSteps++;
+}
+
+
+bool Particles::AddParticles(ParticleState const *states, unsigned count, unsigned minRow, unsigned maxRow) {
+    ReleaseAssert(m_format == ParticlesConfig::FORMAT_FLOAT && m_layout == LAYOUT_ROW_MAJOR && !m_species,
+                  "Particles can only be added in the float format and row-major layout, with the default species");
+    if (count > m_capacity - m_numParticles)
+        return false;
+    m_verletValid = false;
+
+    float maxSpeedSqrd = m_maxSpeed * m_maxSpeed;
+    for (unsigned k = 0; k < count; k++) {
+        ParticleState const &state = states[k];
+        unsigned i = m_numParticles + k;
+        m_x[i] = state.x;
+        m_y[i] = state.y;
+        m_vx[i] = state.vx;
+        m_vy[i] = state.vy;
+
+        unsigned cell = GetCellIndexFromCoords(state.x, state.y);
+        unsigned row = cell / m_gridResX;
+        row = row < minRow ? minRow : (row > maxRow ? maxRow : row);
+        m_cellIdx[i] = row * m_gridResX + cell % m_gridResX;
+        maxSpeedSqrd = std::max(maxSpeedSqrd, state.vx * state.vx + state.vy * state.vy);
+    }
+    m_numParticles += count;
+
+    // Negative means it will be worked out from scratch anyway.
+    if (m_maxSpeed >= 0.0f)
+        m_maxSpeed = sqrtf(maxSpeedSqrd);
+    return true;
+}
+
+
+void Particles::CopyParticlesInRows(unsigned minRow, unsigned maxRow, std::vector<ParticleState> *out) {
+    unsigned beginCell = minRow * m_gridResX;
+    unsigned numCells = (maxRow + 1 - minRow) * m_gridResX;
+    for (unsigned i = 0; i < m_numParticles; i++) {
+        if (m_cellIdx[i] - beginCell < numCells) {
+            ParticleState state = { m_x[i], m_y[i], m_vx[i], m_vy[i] };
+            out->push_back(state);
+        }
+    }
+}
+
+
+void Particles::RemoveParticlesOutsideRows(unsigned minRow, unsigned maxRow,
+                                           std::vector<ParticleState> *above, std::vector<ParticleState> *below) {
+    unsigned beginCell = minRow * m_gridResX;
+    unsigned endCell = (maxRow + 1) * m_gridResX;
+    unsigned numKept = 0;
+    m_verletValid = false;
+    for (unsigned i = 0; i < m_numParticles; i++) {
+        unsigned cell = m_cellIdx[i];
+        if (cell >= beginCell && cell < endCell) {
+            m_x[numKept] = m_x[i];
+            m_y[numKept] = m_y[i];
+            m_vx[numKept] = m_vx[i];
+            m_vy[numKept] = m_vy[i];
+            m_cellIdx[numKept] = cell;
+            numKept++;
+        }
+        else {
+            ParticleState state = { m_x[i], m_y[i], m_vx[i], m_vy[i] };
+            (cell < beginCell ? above : below)->push_back(state);
+        }
+    }
+    m_numParticles = numKept;
+}
+
+
+void Particles::RemoveParticles(unsigned begin, unsigned end) {
+    unsigned numAfter = m_numParticles - end;
+    memmove(m_x + begin, m_x + end, sizeof(float) * numAfter);
+    memmove(m_y + begin, m_y + end, sizeof(float) * numAfter);
+    memmove(m_vx + begin, m_vx + end, sizeof(float) * numAfter);
+    memmove(m_vy + begin, m_vy + end, sizeof(float) * numAfter);
+    memmove(m_cellIdx + begin, m_cellIdx + end, sizeof(unsigned) * numAfter);
+    m_numParticles -= end - begin;
+    m_verletValid = false;
+}
+
+
+float Particles::GetMaxSpeed() {
+    if (m_maxSpeed < 0.0f) {
+        // No step has been done since the particles were placed or loaded.
+        float maxSpeedSqrd = 0.0f;
+        for (unsigned i = 0; i < m_numParticles; i++) {
+            float x, y, vx, vy;
+            GetParticle(i, &x, &y, &vx, &vy);
+            maxSpeedSqrd = std::max(maxSpeedSqrd, vx * vx + vy * vy);
+        }
+        m_maxSpeed = sqrtf(maxSpeedSqrd);
+    }
+    return m_maxSpeed;
+}
+
+
+float Particles::GetMaxStableTime() {
+    float maxSpeed = GetMaxSpeed() * sqrtf(2.0f) * m_maxSpeedUp;
+    if (maxSpeed <= 0.0f)
+        return FLT_MAX;
+    return m_maxStepMove / maxSpeed;
+}
+
+
+unsigned Particles::GetCellIndexFromIndices(unsigned x, unsigned y) {
+    if (m_layout == LAYOUT_MORTON)
+        return MortonEncode(x, y);
+    return y * m_gridResX + x;
+}
+
+
+// Particles that have gone a little outside the world are put in the nearest edge cell.
+unsigned Particles::GetCellIndexFromCoords(float x, float y) {
+    float gridX = x * m_worldToCellX;
+    float gridY = y * m_worldToCellY;
+    gridX = gridX < 0.0f ? 0.0f : (gridX > m_gridResX - 1 ? m_gridResX - 1 : gridX);
+    gridY = gridY < 0.0f ? 0.0f : (gridY > m_gridResY - 1 ? m_gridResY - 1 : gridY);
+    return GetCellIndexFromIndices(gridX, gridY);
+}
+
+
+void Particles::GetParticle(unsigned i, float *x, float *y, float *vx, float *vy) {
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        unsigned cellX = m_cellIdx[i] % m_gridResX;
+        unsigned cellY = m_cellIdx[i] / m_gridResX;
+        float worldPerUnit = 1.0f / m_fixedUnitsPerWorld;
+        *x = ((int)cellX * FIXED_CELL_UNITS + m_fx[i]) * worldPerUnit;
+        *y = ((int)cellY * FIXED_CELL_UNITS + m_fy[i]) * worldPerUnit;
+        *vx = m_fvx[i] * (1.0f / FIXED_VEL_SCALE);
+        *vy = m_fvy[i] * (1.0f / FIXED_VEL_SCALE);
+    }
+    else {
+        *x = m_x[i];
+        *y = m_y[i];
+        *vx = m_vx[i];
+        *vy = m_vy[i];
     }
+}
+
 
-    if (m_showHistogram) {
-        for (unsigned i = 0; i < SPEED_HISTOGRAM_NUM_BINS; i++) {
-            const unsigned barWidth = 4;
-            const float scale = 1000.0f / (float)NUM_PARTICLES;
-            unsigned h = m_speedHistogram[i] * scale;
-            RectFill(bmp, i * barWidth, bmp->height - h, barWidth, h, Colour(255, 99, 99));
+void Particles::GetPositions(float *x, float *y, float *speed) {
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        for (unsigned i = 0; i < m_numParticles; i++) {
+            float vx, vy;
+            GetParticle(i, &x[i], &y[i], &vx, &vy);
+            if (speed)
+                speed[i] = sqrtf(vx * vx + vy * vy);
         }
     }
+    else {
+        memcpy(x, m_x, sizeof(float) * m_numParticles);
+        memcpy(y, m_y, sizeof(float) * m_numParticles);
+        if (speed) {
+            for (unsigned i = 0; i < m_numParticles; i++)
+                speed[i] = sqrtf(m_vx[i] * m_vx[i] + m_vy[i] * m_vy[i]);
+        }
+    }
+}
+
+
+bool Particles::GetRowStarts(unsigned *rowStart) {
+    if (m_layout == LAYOUT_MORTON || m_verletSkin > 0.0f)
+        return false;
+    for (unsigned y = 0; y < m_gridResY; y++)
+        rowStart[y] = m_cellStart[y * m_gridResX];
+    rowStart[m_gridResY] = m_cellStart[m_numCellIndices];
+    return true;
 }
 
 
-Particles::PList *Particles::GetPListFromIndices(unsigned x, unsigned y) {
-    if (x >= GRID_RES_X || y >= GRID_RES_Y)
-        return NULL;
-    return m_grid + y * GRID_RES_X + x;
+unsigned Particles::GetBytesPerParticle() {
+    if (m_format == ParticlesConfig::FORMAT_FIXED)
+        return sizeof(int16_t) * 4 + sizeof(unsigned);
+    return sizeof(float) * 4 + (m_species ? sizeof(uint8_t) : 0);
 }
 
 
-Particles::PList *Particles::GetPListFromCoords(float x, float y) {
-    static const float xFactor = (float)GRID_RES_X / (float)WORLD_SIZE_X;
-    static const float yFactor = (float)GRID_RES_Y / (float)WORLD_SIZE_Y;
-    unsigned gridX = x * xFactor;
-    unsigned gridY = y * yFactor;
-    return GetPListFromIndices(gridX, gridY);
+unsigned Particles::GetStateArrays(StateArray arrays[MAX_STATE_ARRAYS]) {
+    unsigned num = 0;
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        int16_t *fixedArrays[4] = { m_fx, m_fy, m_fvx, m_fvy };
+        for (unsigned i = 0; i < 4; i++) {
+            arrays[num].data = fixedArrays[i];
+            arrays[num++].size = sizeof(int16_t) * m_numParticles;
+        }
+        arrays[num].data = m_cellIdx;
+        arrays[num++].size = sizeof(unsigned) * m_numParticles;
+    }
+    else {
+        float *floatArrays[4] = { m_x, m_y, m_vx, m_vy };
+        for (unsigned i = 0; i < 4; i++) {
+            arrays[num].data = floatArrays[i];
+            arrays[num++].size = sizeof(float) * m_numParticles;
+        }
+        if (m_species) {
+            arrays[num].data = m_species;
+            arrays[num++].size = sizeof(uint8_t) * m_numParticles;
+        }
+    }
+    arrays[num].data = m_cellStart;
+    arrays[num++].size = sizeof(unsigned) * (m_numCellIndices + 1);
+    return num;
 }
 
 
 unsigned Particles::CountParticlesInCell(unsigned x, unsigned y) {
-    PList *plist = m_grid + y * GRID_RES_X + x;
-    if (plist->IsEmpty())
-        return 0;
+    unsigned cell = GetCellIndexFromIndices(x, y);
+    return m_cellStart[cell + 1] - m_cellStart[cell];
+}
+
 
-    unsigned count = 1;
-    while (plist->nextIdx != -1) {
-        count++;
-        plist = &m_particles[plist->nextIdx];
+// Merges the integrate tasks' accumulators into m_reductions, in task order so
+// that the sums don't depend on which thread finished first. The cell
+// occupancy is left to SortByCell().
+void Particles::ReduceTasks(IntegrateTask const *tasks, unsigned numTasks) {
+    Reductions &r = m_reductions;
+    memset(&r, 0, sizeof(r));
+    double mass = 0.0;
+    r.step = m_numSteps;
+    for (unsigned i = 0; i < numTasks; i++) {
+        for (unsigned j = 0; j < SPEED_HISTOGRAM_NUM_BINS; j++)
+            r.speedHistogram[j] += tasks[i].speedHistogram[j];
+        r.kineticEnergy += tasks[i].kineticEnergy;
+        r.momentumX += tasks[i].momentumX;
+        r.momentumY += tasks[i].momentumY;
+        mass += tasks[i].mass;
     }
 
-    return count;
+    // The kinetic energy of the centre of mass is |P|^2 / 2M. In 2D there are
+    // two degrees of freedom, so kT is the remaining energy per particle.
+    double centreOfMassEnergy = (r.momentumX * r.momentumX + r.momentumY * r.momentumY) / (2.0 * mass);
+    r.temperature = (r.kineticEnergy - centreOfMassEnergy) / m_numParticles;
 }
 
 
-unsigned Particles::Count() {
-    memset(m_countsPerCell, 0, sizeof(m_countsPerCell));
-    unsigned totalNum = 0;
-    for (unsigned y = 0; y < GRID_RES_Y; y++) {
-        for (unsigned x = 0; x < GRID_RES_X; x++) {
-            unsigned thisCount = CountParticlesInCell(x, y);
-            m_countsPerCell[thisCount]++;
-            totalNum += thisCount;
+// Counts the particles in each cell, in bands of rows on the thread pool. Fills
+// in how many cells hold each number of particles and returns the total.
+unsigned Particles::ReduceCells(unsigned countsPerCell[NUM_OCCUPANCY_BINS]) {
+    struct CellTask {
+        unsigned countsPerCell[NUM_OCCUPANCY_BINS];
+        unsigned numParticles;
+    };
+    CellTask tasks[MAX_NUM_TASKS];
+    unsigned numTasks = std::min(std::min(GetNumThreads() * 4, MAX_NUM_TASKS), m_gridResY);
+
+    auto task = [&](unsigned t) {
+        unsigned counts[NUM_OCCUPANCY_BINS] = { 0 };
+        unsigned numParticles = 0;
+        unsigned startY = (m_gridResY * t) / numTasks;
+        unsigned endY = (m_gridResY * (t + 1)) / numTasks;
+        bool morton = m_layout == LAYOUT_MORTON;
+        for (unsigned y = startY; y < endY; y++) {
+            unsigned const *rowStart = m_cellStart + y * m_gridResX;
+            for (unsigned x = 0; x < m_gridResX; x++) {
+                unsigned thisCount = morton ? CountParticlesInCell(x, y) : rowStart[x + 1] - rowStart[x];
+                counts[thisCount < NUM_OCCUPANCY_BINS ? thisCount : NUM_OCCUPANCY_BINS - 1]++;
+                numParticles += thisCount;
+            }
         }
+        memcpy(tasks[t].countsPerCell, counts, sizeof(counts));
+        tasks[t].numParticles = numParticles;
+    };
+    if (m_threadPool) {
+        m_threadPool->ParallelFor(numTasks, task);
+    }
+    else {
+        for (unsigned t = 0; t < numTasks; t++)
+            task(t);
     }
 
-    return totalNum;
+    unsigned numParticles = 0;
+    memset(countsPerCell, 0, sizeof(unsigned) * NUM_OCCUPANCY_BINS);
+    for (unsigned t = 0; t < numTasks; t++) {
+        for (unsigned j = 0; j < NUM_OCCUPANCY_BINS; j++)
+            countsPerCell[j] += tasks[t].countsPerCell[j];
+        numParticles += tasks[t].numParticles;
+    }
+    return numParticles;
 }
 
 
-void Particles::AddParticle(Particle *p, PList *plist) {
-    if (plist->IsEmpty()) {
-        plist->p = *p;
-        return;
+unsigned Particles::Count() {
+    unsigned countsPerCell[NUM_OCCUPANCY_BINS];
+    return ReduceCells(countsPerCell);
+}
+
+
+double Particles::CalcKineticEnergy() {
+    double energy = 0.0;
+    if (m_format == ParticlesConfig::FORMAT_FIXED) {
+        for (unsigned i = 0; i < m_numParticles; i++)
+            energy += 0.5 * ((double)m_fvx[i] * m_fvx[i] + (double)m_fvy[i] * m_fvy[i]);
+        return energy / (FIXED_VEL_SCALE * FIXED_VEL_SCALE);
     }
 
-    // Get a PList from the free list
-    DebugAssert(m_firstFreeIdx != -1);
-    unsigned newIdx = m_firstFreeIdx;
-    PList *newPlist = &m_particles[newIdx];
-    m_firstFreeIdx = m_particles[m_firstFreeIdx].nextIdx;
+    for (unsigned i = 0; i < m_numParticles; i++)
+        energy += 0.5 * m_speciesMass[GetSpecies(i)] * (m_vx[i] * m_vx[i] + m_vy[i] * m_vy[i]);
+    return energy;
+}
 
-    newPlist->p = *p;
 
-    // Insert the new PList at the start of the list for this cell
-    newPlist->nextIdx = plist->nextIdx;
-    plist->nextIdx = newIdx;
+// 64-bit FNV-1a of the state arrays, a word at a time.
+unsigned long long Particles::CalcChecksum() {
+    unsigned long long hash = 14695981039346656037ull;
+    StateArray arrays[MAX_STATE_ARRAYS];
+    unsigned numArrays = GetStateArrays(arrays);
+    for (unsigned i = 0; i < numArrays; i++) {
+        unsigned char const *data = (unsigned char const *)arrays[i].data;
+        for (size_t j = 0; j + 4 <= arrays[i].size; j += 4) {
+            uint32_t word;
+            memcpy(&word, data + j, 4);
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+        for (size_t j = arrays[i].size & ~(size_t)3; j < arrays[i].size; j++)
+            hash = (hash ^ data[j]) * 1099511628211ull;
+    }
+    return hash;
 }
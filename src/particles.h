@@ -1,74 +1,586 @@
 #pragma once
 
 #include <smmintrin.h>
-#include "world.h"  // For WORLD_SIZE_X and _Y
+#include <stdint.h>
+#include <vector>
+#include "collision_kernels.h"
 
 
-typedef struct _DfBitmap DfBitmap;
+class Arena;
+class ThreadPool;
+class Walls;
+struct WallSphere;
 
 
+// Particles are stored as a structure of arrays that is sorted by grid cell at
+// the start of every step, using a counting sort. The particles in a cell, and
+// in each of its neighbours, are therefore contiguous ranges of the arrays.
+//
+// There are two formats for the particles' state, chosen at startup:
+// * FORMAT_FLOAT stores world coordinates and velocities as floats. 16 bytes per particle.
+// * FORMAT_FIXED stores 16-bit fixed point positions, as offsets from the top-left
+//   of the particle's cell, 16-bit fixed point velocities and the cell index.
+//   12 bytes per particle, and only 8 of them are read by the collision sweep.
+//   It only supports the row-major layout and ignores the tile size.
+//
 // Possible optimizations:
-// * Split the extra m_particles array so that there is a smaller one per row of the grid.
-// * Switch to fixed point maths so the number of bytes needed to represent a particle can be reduced.
-// * Reduce x and y to 8-bit values by storing the position as an offset from the top-left of the cell they are in.
-// * Move vx and vy into a different array because they aren't needed in 99.7% of collision checks.
-// * Use Morton indexing for the grid
-// * Split the grid into chunks that fit in L1 cache (each ~3000 particles). Process collisions within the
-//   chunk in one pass, then between chunks in another (only need to consider cells on the boundary of the
-//   chunk, which should only be about 0.1 of them).
-// * Store cells in the grid as an array of indices to particles and a count of the number of particles.
-//   then make special case versions of HandleAnyCollisions() for each combination of possible numbers of particles.
-
-
-struct Particle {
-    float x, y;
-    float vx, vy;
-};
+// * Reduce x and y to 8-bit values. Too coarse for the collision response as it stands.
 
 
 static float const PARTICLE_RADIUS = 0.354f;
-static float const INVALID_PARTICLE_X = -1000.0f;
+
+
+// One particle, for moving particles between Particles instances.
+struct ParticleState {
+    float x;
+    float y;
+    float vx;
+    float vy;
+};
+
+
+// The sizes of the simulation, chosen at startup.
+struct ParticlesConfig {
+    enum Format {
+        FORMAT_FLOAT,
+        FORMAT_FIXED
+    };
+
+    static unsigned const DEFAULT_NUM_PARTICLES = 120000;
+    static unsigned const DEFAULT_WORLD_SIZE_X = 1200;
+    static unsigned const DEFAULT_WORLD_SIZE_Y = 900;
+    static unsigned const DEFAULT_GRID_RES_X = 700;
+    static unsigned const MAX_SPECIES = 8;
+
+    unsigned numParticles;
+    unsigned worldSizeX;
+    unsigned worldSizeY;
+    unsigned gridResX;      // Zero means keep the default cell size. The grid's height keeps the cells square.
+    Format format;
+    unsigned seed;          // The particles' starting state is a function of this alone.
+    unsigned capacity;      // Zero means numParticles. See Particles::AddParticles().
+    unsigned numRows;       // Zero means the whole grid. Otherwise only the top numRows rows of it. See Domain.
+    bool hugePages;         // Whether the arrays' arena may use huge pages. See Arena.
+    bool badValue;          // Set by ParseOption() for a value it doesn't recognise.
+
+    // The particles take turns by index to be each species. Zero species
+    // means one of PARTICLE_RADIUS and unit mass, which has a faster collision
+    // path of its own. Species are only supported in FORMAT_FLOAT.
+    unsigned numSpecies;
+    float speciesRadius[MAX_SPECIES];
+    float speciesMass[MAX_SPECIES];
+
+    ParticlesConfig();
+
+    // If argv[*argIndex] is --particles N, --world WxH, --grid-res N,
+    // --format float|fixed, --seed N, --species R:M[,R:M...] or
+    // --huge-pages on|off, stores the value, advances *argIndex past it and
+    // returns true. If it doesn't recognise the value, IsValid() then fails.
+    bool ParseOption(int argc, char *argv[], int *argIndex);
+
+    // False if ParseOption() was given a bad value, a size is zero, the
+    // species list is bad, the cells are too small for the biggest particles,
+    // or the format is fixed and the cells aren't square.
+    bool IsValid() const;
+
+    // The default grid is coarsened if need be, so that no two particles can
+    // touch without being in neighbouring cells.
+    unsigned GetGridResX() const;
+    unsigned GetGridResY() const;
+
+    // The fixed point format measures y in the same units as x, and a row
+    // taller than a cell could overflow its 16-bit offsets, so it needs the
+    // world's height to be a whole number of cells.
+    bool HasSquareCells() const;
+    float GetMaxRadius() const;
+};
 
 
 class Particles {
+    // Times the private kernels one at a time. See microbench.cpp.
+    friend class MicroBench;
+
 public:
-    static unsigned const GRID_RES_X = 700;
-    static unsigned const GRID_RES_Y = (GRID_RES_X * WORLD_SIZE_Y) / WORLD_SIZE_X;
+    static const unsigned SPEED_HISTOGRAM_NUM_BINS = 20;
+    static const unsigned NUM_OCCUPANCY_BINS = 16;
+
+    // Whole system statistics. Advance() gathers them every
+    // GetReductionInterval() steps, and every step while the histogram is shown.
+    // Each thread accumulates its own, and they are merged at the end of the step.
+    struct Reductions {
+        unsigned long long step;    // The step they were gathered in, counting from zero.
+        unsigned speedHistogram[SPEED_HISTOGRAM_NUM_BINS];
+        double kineticEnergy;
+        double momentumX;
+        double momentumY;
+        double temperature;         // Kinetic energy per particle relative to the centre of mass.
+        unsigned numParticles;      // From m_cellStart.
+        unsigned countsPerCell[NUM_OCCUPANCY_BINS];  // Cells with 0, 1, ... 14, then 15 or more particles.
+    };
+
+    // How cell coordinates map to cell indices, and hence the order the
+    // particles are sorted into.
+    enum CellLayout {
+        LAYOUT_ROW_MAJOR,
+        LAYOUT_MORTON       // Z-order. Cells that are near each other in 2D are usually near each other in memory.
+    };
 
-    struct PList {
-        Particle p;
-        unsigned nextIdx;
+    // The Morton layout needs both grid dimensions to fit in this many bits.
+    static unsigned const MORTON_BITS = 14;
 
-        bool IsEmpty() { return p.x == INVALID_PARTICLE_X; }
+    // The FORMAT_FIXED units. A position can be up to two cells either side of
+    // the particle's cell's top-left, which leaves plenty of room for particles
+    // to leave their cell between rebins.
+    static int const FIXED_CELL_BITS = 14;
+    static int const FIXED_CELL_UNITS = 1 << FIXED_CELL_BITS;
+    static int const FIXED_VEL_SCALE = 32;
+
+    unsigned m_numParticles;        // Only changes if particles are added or removed.
+    unsigned const m_capacity;
+    float const m_worldSizeX;
+    float const m_worldSizeY;
+    unsigned const m_gridResX;
+    unsigned const m_gridResY;
+    unsigned const m_numCells;
+    ParticlesConfig::Format const m_format;
+
+    // As in ParticlesConfig. Zero means the default species.
+    unsigned const m_numSpecies;
+    float m_speciesRadius[ParticlesConfig::MAX_SPECIES];
+    float m_speciesMass[ParticlesConfig::MAX_SPECIES];
+
+    // Most cells hold 0 to 2 particles, so the sweep first tests each pair of
+    // cells holding up to this many with a kernel specialised for their
+    // counts. See HandleCellPair().
+    static unsigned const MAX_KERNEL_OCCUPANCY = 4;
+
+    // How often each occupancy kernel ran, and how often it found a touching
+    // pair, which then went through the general path. Indexed by the counts
+    // minus one. Self is a cell against itself, which needs two or more.
+    struct OccupancyStats {
+        unsigned long long pairCalls[MAX_KERNEL_OCCUPANCY][MAX_KERNEL_OCCUPANCY];
+        unsigned long long pairTouches[MAX_KERNEL_OCCUPANCY][MAX_KERNEL_OCCUPANCY];
+        unsigned long long selfCalls[MAX_KERNEL_OCCUPANCY];
+        unsigned long long selfTouches[MAX_KERNEL_OCCUPANCY];
+        unsigned long long numGeneral;      // Pairs of cells too full for the kernels, or all of them if they're off.
+
+        void Add(OccupancyStats const &other);
+    };
+
+    // Counts of what happened in the collision sweep. Each thread accumulates
+    // its own, and they are added up in task order once the sweep is done.
+    struct SweepStats {
+        unsigned long long numCollisions;
+        double wallImpulse;
+        OccupancyStats occupancy;
     };
 
 private:
-    bool m_showHistogram;
-    unsigned m_countsPerCell[16];
+    // A contiguous range of particles that one thread integrates.
+    struct IntegrateTask {
+        unsigned begin;
+        unsigned end;
+        double wallImpulse;
+
+        float maxSpeedSqrd;     // Always filled in, for GetMaxStableTime().
+        float maxVerletMoveSqrd;    // Since the Verlet lists were built. Zero if there are none.
+
+        // Only filled in if reduce is true.
+        bool reduce;
+        unsigned speedHistogram[SPEED_HISTOGRAM_NUM_BINS];
+        double kineticEnergy;
+        double momentumX;
+        double momentumY;
+        double mass;
+    };
+
+    // A contiguous range of particles that one thread sorts, and the range of
+    // cells they are in. The particles were sorted last step and move about a
+    // cell per step, so each task's cells are a narrow window.
+    struct SortTask {
+        unsigned begin;
+        unsigned end;
+        unsigned firstCell;
+        unsigned endCell;       // One past the last.
+        unsigned *next;         // Per cell of the window. The count, then where the task's next particle in that cell goes.
+    };
+
+    // What happens when a particle of species a hits one of species b, for
+    // each a * MAX_SPECIES + b. The collision changes each particle's velocity
+    // along the normal by its factor times the closing speed, and pushes them
+    // apart in proportion to their push shares.
+    struct SpeciesPair {
+        float contactDist;      // The sum of the radii.
+        float contactDistSqrd;
+        float velFactorA;       // 2 m_b / (m_a + m_b).
+        float velFactorB;       // 2 m_a / (m_a + m_b).
+        float pushA;            // m_b / (m_a + m_b).
+        float pushB;
+        bool equalMass;
+    };
+
+    std::vector<SweepStats> m_taskStats;    // One per task of the current sweep.
+    std::vector<unsigned> m_sortWindows;    // Holds the SortTasks' next arrays.
+
+    float m_advanceTime;
+    double m_simTime;                       // The total of the steps' advance times.
+    float m_maxSpeed;                       // As of the last step. Negative if it needs working out.
+    unsigned long long m_numCollisions;     // In the last call to Advance().
+    double m_wallImpulse;                   // Ditto.
+    OccupancyStats m_occupancyStats;        // Ditto.
+    bool m_occupancyKernels;
+
+    // Verlet lists. When m_verletSkin is non-zero, each particle has a list of
+    // the particles above, to the left of or after it in its cell that were
+    // within the biggest contact distance plus the skin when the lists were
+    // built. While no particle has moved more than half the skin since then,
+    // no pair that isn't in the lists can be touching, so the collisions are
+    // found from the lists without sorting the particles or searching the
+    // grid. Particle i's list is m_verletNeighbours[m_verletStart[i]] to
+    // m_verletNeighbours[m_verletStart[i + 1] - 1].
+    float m_verletSkin;
+    bool m_verletValid;                     // False if the lists must be rebuilt before they are next used.
+    float m_verletMaxMoveSqrd;              // As of the last IntegrateStep().
+    std::vector<float> m_verletX;           // Where each particle was when the lists were built.
+    std::vector<float> m_verletY;
+    std::vector<unsigned> m_verletStart;
+    std::vector<unsigned> m_verletNeighbours;
+    std::vector<std::vector<unsigned> > m_verletTaskNeighbours;    // Each build task's lists, before they are joined.
+    unsigned long long m_numVerletBuilds;
+
+    unsigned m_reductionInterval;
+    unsigned long long m_numSteps;
+    bool m_deterministic;
+    bool m_reduceThisStep;                  // From IntegrateStep() to CollideStep().
+
+    // Maps squared speed to speed histogram bin, so that no sqrtf is needed.
+    // The bins are equal ranges of speed, w wide, so bin k starts at a squared
+    // speed of k^2 w^2. Each entry covers w^2 of squared speed, so no entry
+    // straddles two bins.
+    static const unsigned SPEED_BIN_LUT_SIZE = SPEED_HISTOGRAM_NUM_BINS * SPEED_HISTOGRAM_NUM_BINS;
+    unsigned char m_speedBinLut[SPEED_BIN_LUT_SIZE];
+    float m_speedSqrdToLut;     // One over w^2.
+
+    Arena *m_arena;         // Owns all the per-particle and per-cell arrays.
+    ThreadPool *m_threadPool;
+    bool m_memoryPlaced;    // See PlaceMemory().
+    Walls *m_walls;         // NULL if there are none, or if they use the SDF.
+    Walls const *m_sdfWalls;    // NULL unless the walls have a signed distance field.
+    CollisionKernel m_collisionKernel;
+
+    CellLayout m_layout;
+    unsigned m_numCellIndices;  // One more than the highest cell index in this layout.
+    unsigned m_maxNumCellIndices;   // Of either layout. How big m_cellStart is.
 
-    void HandleCollision(Particle *p1, Particle *p2, float distSqrd);
-    void HandleAnyCollisions(PList *cell, PList *otherCell);
-    void HandleAnyCollisionsSelf(PList *cell);
-    void AddParticle(Particle *p, PList *plist);
+    // World units to cells.
+    float m_worldToCellX;
+    float m_worldToCellY;
+
+    // When non-zero, collisions are handled in square tiles of this many cells
+    // across, sized so that a tile's particles fit in L1 cache. All the pairs
+    // of cells within each tile are handled in one pass, then the pairs that
+    // straddle tile boundaries in a second pass. Zero means sweep the grid in
+    // row bands instead. Tiling only pays off once the particles no longer fit
+    // in the outer caches.
+    unsigned m_tileSize;
+
+    // The counting sort scatters into these, then swaps them with m_x etc.
+    float *m_sortedX;
+    float *m_sortedY;
+    float *m_sortedVx;
+    float *m_sortedVy;
+
+    // The cell each particle is in, as calculated by Integrate(). In FORMAT_FIXED
+    // it is sorted along with the rest of the particle's state, because the
+    // position is meaningless without it.
+    unsigned *m_cellIdx;
+    unsigned *m_sortedCellIdx;  // NULL in FORMAT_FLOAT.
+
+    // The FORMAT_FIXED state. Positions are in 1/FIXED_CELL_UNITS of a cell
+    // from the top-left of the particle's cell. Velocities are in
+    // 1/FIXED_VEL_SCALE world units per second. NULL in FORMAT_FLOAT.
+    int16_t *m_fx;
+    int16_t *m_fy;
+    int16_t *m_fvx;
+    int16_t *m_fvy;
+    int16_t *m_sortedFx;
+    int16_t *m_sortedFy;
+    int16_t *m_sortedFvx;
+    int16_t *m_sortedFvy;
+    float m_fixedUnitsPerWorld;
+    int m_fixedRadius2;     // RADIUS2 in fixed point units.
+
+    // Each particle's species, sorted along with the rest of its state. NULL
+    // with the default species.
+    uint8_t *m_species;
+    uint8_t *m_sortedSpecies;
+    SpeciesPair m_speciesPairs[ParticlesConfig::MAX_SPECIES * ParticlesConfig::MAX_SPECIES];
+    float m_maxContactDistSqrd;     // Of any pair of species.
+    float m_maxRadius;              // Of any species. How far the walls' cell index must reach.
+    float m_maxStepMove;            // See GetMaxStableTime().
+    float m_maxSpeedUp;             // Ditto.
+
+    void InitSpecies(ParticlesConfig const &config);
+    void PlaceParticles(unsigned begin, unsigned end, unsigned seed);
+    unsigned GetNumTasks();
+
+    // The pool's thread k works mostly on the k-th slice of the rows, and so
+    // of the sorted particles, so it is given the first touch of that slice
+    // of each array, which puts it on that thread's NUMA node. The walls'
+    // arrays are split the same way. Sets m_memoryPlaced to whether it could
+    // be done, which it can't without a pool.
+    void PlaceMemory();
+
+    void HandleCollision(unsigned i, unsigned j, float distSqrd);
+    void HandleParticleCollisions(unsigned i, unsigned otherBegin, unsigned otherEnd);
+    template <bool EQUAL_MASS>
+    void HandleCollisionSpecies(unsigned i, unsigned j, float distSqrd, SpeciesPair const &pair);
+    void HandleParticleCollisionsSpecies(unsigned i, unsigned otherBegin, unsigned otherEnd);
+    void HandleAnyCollisions(unsigned cell, unsigned otherBegin, unsigned otherEnd);
+    void HandleAnyCollisionsSelf(unsigned cell);
+    template <unsigned NA, unsigned NB>
+    void HandleCellPair(unsigned begin, unsigned otherBegin);
+    template <unsigned N>
+    void HandleCellSelf(unsigned begin);
+    typedef void (Particles::*CellPairKernel)(unsigned begin, unsigned otherBegin);
+    static CellPairKernel const s_cellPairKernels[MAX_KERNEL_OCCUPANCY][MAX_KERNEL_OCCUPANCY];
+    typedef void (Particles::*CellSelfKernel)(unsigned begin);
+    static CellSelfKernel const s_cellSelfKernels[MAX_KERNEL_OCCUPANCY];
+
+    void HandleVerletCollisions(unsigned i);
+    void BuildVerletLists();
+    void CollideRowsVerlet(unsigned startY, unsigned endY);
+
+    void HandleWallCollisions(unsigned x, unsigned y, unsigned cell);
+    void HandleParticleWallCollisions(unsigned i, WallSphere const *spheres, unsigned numSpheres);
+    void HandleWallCollisionsFixed(unsigned x, unsigned y, unsigned cell);
+
+    void HandleCollisionFixed(unsigned i, unsigned j, int dx, int dy, unsigned distSqrd);
+    void HandleParticleCollisionsFixed(unsigned i, unsigned otherBegin, unsigned otherEnd, int offsetX, int offsetY);
+    void CollideRowsFixed(unsigned startY, unsigned endY);
+
+    template <bool SDF, bool REDUCE>
+    void IntegrateImpl(IntegrateTask *task);
+    template <bool SDF, bool REDUCE>
+    void IntegrateFixedImpl(IntegrateTask *task);
+    void Integrate(IntegrateTask *task);
+    void ReduceTasks(IntegrateTask const *tasks, unsigned numTasks);
+    unsigned ReduceCells(unsigned countsPerCell[NUM_OCCUPANCY_BINS]);
+    void SortByCell(unsigned countsPerCell[NUM_OCCUPANCY_BINS] = NULL);
+    bool SortByCellParallel(unsigned countsPerCell[NUM_OCCUPANCY_BINS]);
+    void ScatterRange(unsigned begin, unsigned end, unsigned *next, unsigned firstCell);
+    void SwapSortedArrays();
+
+    // These take the grid width as a template parameter, so that the common
+    // case can be compiled with it as a constant. Zero means use m_gridResX.
+    template <unsigned FIXED_GRID_RES_X, typename FUNC>
+    void ForEachCell(unsigned startX, unsigned endX, unsigned startY, unsigned endY, FUNC const &func);
+    template <unsigned FIXED_GRID_RES_X>
+    void CollideCell(unsigned x, unsigned y, unsigned cell);
+    template <unsigned FIXED_GRID_RES_X>
+    void CollideRowsImpl(unsigned startY, unsigned endY);
+
+    void CollideCellTiled(unsigned x, unsigned y, unsigned cell,
+                          unsigned tileX, unsigned tileY, unsigned tileEndX, bool insideTile);
+    void CollideRows(unsigned startY, unsigned endY);
+    void CollideTileInterior(unsigned tileX, unsigned tileY);
+    void CollideTileBoundary(unsigned tileX, unsigned tileY);
+    template <typename FUNC>
+    void ParallelSweep(unsigned numTasks, FUNC const &func);
+    void CollideBands();
+    void CollideTiles();
 
 public:
-    static const unsigned NUM_PARTICLES = 120000;
-    static const unsigned SPEED_HISTOGRAM_NUM_BINS = 20;
+    // Particle positions and velocities in FORMAT_FLOAT. NULL in FORMAT_FIXED.
+    // Sorted by cell, so that the particles in cell c have the indices
+    // m_cellStart[c] to m_cellStart[c + 1] - 1. Each array has
+    // COLLISION_KERNEL_PADDING unused entries on the end.
+    float *m_x;
+    float *m_y;
+    float *m_vx;
+    float *m_vy;
+
+    unsigned *m_cellStart;  // m_numCellIndices + 1 entries are in use.
+
+    Reductions m_reductions;    // From the last step that gathered them.
+    bool m_showHistogram;
+
+    // If placeParticles is false, the state arrays are left zeroed, for
+    // filling in from a snapshot.
+    Particles(ParticlesConfig const &config, bool placeParticles = true);
+    ~Particles();
+
+    // Sets how many threads Advance() uses. One means the serial path. With
+    // more, the arrays' pages are moved to the NUMA nodes of the threads
+    // that work on them. See PlaceMemory().
+    void SetNumThreads(unsigned numThreads);
+    unsigned GetNumThreads();
+
+    // In deterministic mode the work is split into the same tasks, and the
+    // tasks' totals added up in the same order, whatever the number of
+    // threads, so every run from the same state gives bit-identical results.
+    // Off by default, because the fixed split can't keep more than about 16
+    // threads busy.
+    void SetDeterministic(bool deterministic) { m_deterministic = deterministic; }
+    bool GetDeterministic() { return m_deterministic; }
+
+    // Makes the particles bounce off the walls, which are handled cell by cell
+    // in the same sweep as the particle collisions. Builds the walls' cell index.
+    // If the walls have a signed distance field, the particles instead look
+    // themselves up in it in Integrate(), and there is no cell index.
+    void SetWalls(Walls *walls);
 
-    PList m_grid[GRID_RES_X * GRID_RES_Y];  // A 2D array of PLists. When a cell is empty, p.x == INVALID_PARTICLE_X and next == NULL.
-    PList m_particles[NUM_PARTICLES];    // Extra particles not stored directly in the grid. Unlike when in the grid, when a PList is unused (ie is on the free list), then p.x != INVALID_PARTICLE_X. 
-    unsigned m_firstFreeIdx;
+    // Selects the collision kernel by name. See GetCollisionKernel(). Returns
+    // false, and leaves the kernel unchanged, if it isn't available.
+    bool SetCollisionKernel(char const *name);
+    char const *GetCollisionKernelName() { return m_collisionKernel.name; }
 
-    unsigned m_speedHistogram[SPEED_HISTOGRAM_NUM_BINS];
+    // Sets the collision tile size in cells. It is rounded up to a multiple of
+    // 8. Zero, the default, disables tiling. See m_tileSize.
+    void SetTileSize(unsigned tileSize);
+    unsigned GetTileSize() { return m_tileSize; }
 
-    Particles();
+    // Returns the tile size that puts about 3000 particles in each tile.
+    unsigned GetAutoTileSize();
+
+    // Changes the cell layout and re-sorts the particles to match. Returns
+    // false, and leaves the layout unchanged, if the grid is too big for it or
+    // the particle format doesn't support it.
+    bool SetCellLayout(CellLayout layout);
+    CellLayout GetCellLayout() { return m_layout; }
 
     void Advance();
-    void Render(DfBitmap *bmp);
 
-    PList *GetPListFromIndices(unsigned x, unsigned y);
-    PList *GetPListFromCoords(float x, float y);
+    // Advance() is IntegrateStep() then CollideStep(). Domain calls them
+    // separately, to move particles between processes in between. See domain.h.
+    void IntegrateStep();
+    void CollideStep();
+
+    // These are for Domain too, and only support FORMAT_FLOAT and the row-major
+    // layout. A particle's row is that of the cell it was binned into by the
+    // last IntegrateStep() or AddParticles(), so they must be called between
+    // IntegrateStep() and CollideStep().
+    //
+    // AddParticles() appends the particles, binning each into the nearest cell
+    // in rows minRow to maxRow. Returns false, and adds none, if they would take
+    // the count over the capacity.
+    bool AddParticles(ParticleState const *states, unsigned count, unsigned minRow, unsigned maxRow);
+    // Appends the particles in rows minRow to maxRow to out.
+    void CopyParticlesInRows(unsigned minRow, unsigned maxRow, std::vector<ParticleState> *out);
+    // Removes the particles in rows above minRow and appends them to above, and
+    // likewise those below maxRow to below. The rest keep their order.
+    void RemoveParticlesOutsideRows(unsigned minRow, unsigned maxRow,
+                                    std::vector<ParticleState> *above, std::vector<ParticleState> *below);
+
+    // Removes particles begin to end - 1. The rest keep their order, so stay
+    // sorted, but m_cellStart is left out of date. FORMAT_FLOAT only.
+    void RemoveParticles(unsigned begin, unsigned end);
+
+    // The starting state of particle i of a world of the given size. It
+    // depends only on these arguments.
+    static ParticleState GetStartingState(unsigned i, unsigned seed, float worldSizeX, float worldSizeY);
+
+    // The time step Advance() uses. The default is 0.001.
+    void SetAdvanceTime(float advanceTime) { m_advanceTime = advanceTime; }
+    float GetAdvanceTime() { return m_advanceTime; }
+    double GetSimTime() { return m_simTime; }
+
+    // The longest time step in which no particle should move more than
+    // MAX_STEP_MOVE, or the smallest species' radius if that is less. Two
+    // particles closing head on then can't get from touching to past each
+    // other in one step without their overlap being seen. It goes by the
+    // fastest particle at the start of the last step. Collisions between
+    // equal masses can make a particle at most sqrt(2) times faster than that,
+    // and a light particle hit by a heavy one up to 3 times faster in each
+    // direction, which is allowed for.
+    static float const MAX_STEP_MOVE;
+    float GetMaxStableTime();
+    float GetMaxSpeed();
+    unsigned long long GetNumSteps() { return m_numSteps; }
+
+    // How often Advance() fills in m_reductions, in steps. Zero, the default,
+    // means only while the histogram is shown.
+    void SetReductionInterval(unsigned steps) { m_reductionInterval = steps; }
+    unsigned GetReductionInterval() { return m_reductionInterval; }
+
+    // What happened in the last call to Advance(). The impulse is the total
+    // momentum, with unit mass, that the edges of the world and the walls gave
+    // the particles that bounced off them.
+    unsigned long long GetNumCollisions() { return m_numCollisions; }
+    double GetWallImpulse() { return m_wallImpulse; }
+    OccupancyStats const &GetOccupancyStats() { return m_occupancyStats; }
+
+    // Turns the occupancy kernels on or off. On by default. They only affect
+    // FORMAT_FLOAT, and give the same results either way.
+    void SetOccupancyKernels(bool on) { m_occupancyKernels = on; }
+    bool GetOccupancyKernels() { return m_occupancyKernels; }
+
+    // Finds the collisions from Verlet lists, with the given skin in world
+    // units, instead of searching the grid every step. Zero, the default,
+    // turns them off. The lists are rebuilt, in parallel, whenever a particle
+    // has moved more than half the skin. Between rebuilds the particles
+    // aren't sorted, so m_cellStart and the occupancy counts in m_reductions
+    // are as of the last rebuild, and the tile size is ignored. The order the
+    // pairs are handled in differs from the grid search, so the results do
+    // too. Returns false, and leaves the lists off, if the particles aren't
+    // FORMAT_FLOAT in the row-major layout, or the cells aren't at least the
+    // contact distance plus the skin across.
+    bool SetVerletSkin(float skin);
+    float GetVerletSkin() { return m_verletSkin; }
+    unsigned long long GetNumVerletBuilds() { return m_numVerletBuilds; }
+
+    // Makes the next step rebuild the lists, as it must after the state
+    // arrays have been overwritten.
+    void InvalidateVerletLists() { m_verletValid = false; }
+    size_t GetNumVerletPairs() { return m_verletSkin > 0.0f ? m_verletNeighbours.size() : 0; }
+
+    unsigned GetCellIndexFromIndices(unsigned x, unsigned y);
+    unsigned GetCellIndexFromCoords(float x, float y);
+
+    // The position and velocity of particle i in world units, in either format.
+    void GetParticle(unsigned i, float *x, float *y, float *vx, float *vy);
+
+    // Copies every particle's position, in world units, into x and y, and its
+    // speed into speed unless it is NULL. Each must have room for
+    // m_numParticles.
+    void GetPositions(float *x, float *y, float *speed = NULL);
+
+    // Fills in rowStart[0] to rowStart[m_gridResY], so that the particles in
+    // grid row r are rowStart[r] to rowStart[r + 1] - 1. Returns false in the
+    // Morton layout, where rows aren't contiguous, and with Verlet lists, where
+    // the rows are as of the last rebuild.
+    bool GetRowStarts(unsigned *rowStart);
+
+    // The size of a particle's state, not counting the sort buffers. Includes
+    // the cell index in FORMAT_FIXED.
+    unsigned GetBytesPerParticle();
+
+    // The arrays that hold the particles' state between calls to Advance(), for
+    // snapshots. Which arrays there are depends on the format and whether
+    // there are species, and the size of the cell start array depends on the
+    // layout. The sorted copies are scratch
+    // space and FORMAT_FLOAT recomputes m_cellIdx every step, so they are left
+    // out. Returns the number of arrays. Whoever overwrites them must call
+    // InvalidateVerletLists() afterwards.
+    struct StateArray {
+        void *data;
+        size_t size;
+    };
+    static unsigned const MAX_STATE_ARRAYS = 6;
+    unsigned GetStateArrays(StateArray arrays[MAX_STATE_ARRAYS]);
+
+    // A hash of the state arrays, for checking that two runs match.
+    unsigned long long CalcChecksum();
+
+    // Zero with the default species.
+    unsigned GetSpecies(unsigned i) { return m_species ? m_species[i] : 0; }
+
+    // The arena the per-particle and per-cell arrays are in, to report what
+    // pages it got and which NUMA nodes they are on.
+    Arena const *GetArena() { return m_arena; }
+    bool GetMemoryPlaced() { return m_memoryPlaced; }
 
     unsigned CountParticlesInCell(unsigned x, unsigned y);
-    unsigned Count();
+    unsigned Count();   // From m_cellStart, in parallel.
+    double CalcKineticEnergy();
 };
@@ -0,0 +1,121 @@
+// Own header
+#include "perf_counters.h"
+
+// Standard headers
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef __linux__
+
+static int OpenCounter(unsigned type, unsigned long long config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static unsigned long long CacheEvent(unsigned cache, unsigned op, unsigned result) {
+    return cache | (op << 8) | (result << 16);
+}
+
+
+PerfCounters::PerfCounters() {
+    m_fds[CYCLES] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    m_fds[INSTRUCTIONS] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    m_fds[L1D_READ_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE,
+        CacheEvent(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    m_fds[LLC_READ_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE,
+        CacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    m_fds[DTLB_READ_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE,
+        CacheEvent(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    memset(m_counts, 0, sizeof(m_counts));
+}
+
+
+PerfCounters::~PerfCounters() {
+    for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+        if (m_fds[i] >= 0)
+            close(m_fds[i]);
+    }
+}
+
+
+void PerfCounters::Start() {
+    for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+        if (m_fds[i] >= 0) {
+            ioctl(m_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+
+void PerfCounters::Pause() {
+    for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+        if (m_fds[i] >= 0)
+            ioctl(m_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+
+void PerfCounters::Stop() {
+    for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+        m_counts[i] = 0;
+        if (m_fds[i] < 0)
+            continue;
+        ioctl(m_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(m_fds[i], &m_counts[i], sizeof(m_counts[i])) != sizeof(m_counts[i]))
+            m_counts[i] = 0;
+    }
+}
+
+#else
+
+PerfCounters::PerfCounters() {
+    for (unsigned i = 0; i < NUM_COUNTERS; i++)
+        m_fds[i] = -1;
+    memset(m_counts, 0, sizeof(m_counts));
+}
+
+
+PerfCounters::~PerfCounters() {
+}
+
+
+void PerfCounters::Start() {
+}
+
+
+void PerfCounters::Pause() {
+}
+
+
+void PerfCounters::Stop() {
+}
+
+#endif
+
+
+char const *PerfCounters::GetName(unsigned counter) {
+    static char const *names[NUM_COUNTERS] = {
+        "cycles",
+        "instructions",
+        "l1d_read_misses",
+        "llc_read_misses",
+        "dtlb_read_misses"
+    };
+    return names[counter];
+}
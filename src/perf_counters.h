@@ -0,0 +1,40 @@
+#pragma once
+
+
+// Hardware event counters, read with perf_event_open(). They count events for
+// the calling thread and for any threads it creates after the constructor, but
+// the counts from those threads are only included once they have exited. Only
+// implemented on Linux. Elsewhere, or if the kernel doesn't allow it (see
+// /proc/sys/kernel/perf_event_paranoid), the counters are unavailable.
+class PerfCounters {
+public:
+    enum {
+        CYCLES,
+        INSTRUCTIONS,
+        L1D_READ_MISSES,
+        LLC_READ_MISSES,
+        DTLB_READ_MISSES,   // Fewer with huge pages. See Arena.
+        NUM_COUNTERS
+    };
+
+private:
+    int m_fds[NUM_COUNTERS];
+    unsigned long long m_counts[NUM_COUNTERS];
+
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    // Start() zeroes the counts, including those of threads that already
+    // exist. Pause() stops counting, so that the worker threads can then be
+    // shut down, adding their counts in, without that being counted. Stop()
+    // stops counting too, and reads the counts.
+    void Start();
+    void Pause();
+    void Stop();
+
+    bool IsAvailable(unsigned counter) { return m_fds[counter] >= 0; }
+    unsigned long long GetCount(unsigned counter) { return m_counts[counter]; }
+
+    static char const *GetName(unsigned counter);
+};
@@ -0,0 +1,178 @@
+// Own header
+#include "recorder.h"
+
+// Project headers
+#include "particles.h"
+#include "walls.h"
+
+// Standard headers
+#include <chrono>
+#include <math.h>
+#include <string.h>
+
+
+// Big enough for several position chunks of a million particles.
+static size_t const RING_BUFFER_SIZE = 64 * 1024 * 1024;
+
+
+static void PutVarint(std::vector<unsigned char> *out, uint64_t a) {
+    while (a >= 0x80) {
+        out->push_back((unsigned char)(a | 0x80));
+        a >>= 7;
+    }
+    out->push_back((unsigned char)a);
+}
+
+
+// Maps small negative numbers to small positive ones, so that they varint
+// encode as compactly as small positive ones.
+static void PutZigzag(std::vector<unsigned char> *out, int64_t a) {
+    PutVarint(out, ((uint64_t)a << 1) ^ (uint64_t)(a >> 63));
+}
+
+
+// Grows the vector and copies into it, rather than inserting from a local
+// array, which GCC 12 wrongly warns could overflow.
+static void PutBytes(std::vector<unsigned char> *out, void const *bytes, size_t size) {
+    size_t oldSize = out->size();
+    out->resize(oldSize + size);
+    memcpy(out->data() + oldSize, bytes, size);
+}
+
+
+static void PutDouble(std::vector<unsigned char> *out, double a) {
+    PutBytes(out, &a, sizeof(a));
+}
+
+
+static void PutUint32(std::vector<unsigned char> *out, uint32_t a) {
+    PutBytes(out, &a, sizeof(a));
+}
+
+
+Recorder::Recorder()
+:   m_ring(RING_BUFFER_SIZE)
+{
+    m_file = NULL;
+    m_quit = false;
+    m_positionInterval = 0;
+    m_decimation = 1;
+    m_numDropped = 0;
+}
+
+
+Recorder::~Recorder() {
+    if (!m_file)
+        return;
+    m_quit = true;
+    m_thread.join();
+    fclose(m_file);
+}
+
+
+bool Recorder::Open(char const *filename, unsigned positionInterval, unsigned decimation) {
+    m_file = fopen(filename, "wb");
+    if (!m_file)
+        return false;
+    m_positionInterval = positionInterval;
+    m_decimation = decimation > 0 ? decimation : 1;
+
+    std::vector<unsigned char> header(RECORDING_MAGIC, RECORDING_MAGIC + sizeof(RECORDING_MAGIC));
+    PutUint32(&header, RECORDING_VERSION);
+    PutUint32(&header, Particles::SPEED_HISTOGRAM_NUM_BINS);
+    PutUint32(&header, Particles::NUM_OCCUPANCY_BINS);
+    fwrite(header.data(), 1, header.size(), m_file);
+
+    m_thread = std::thread(ThreadMain, this);
+    return true;
+}
+
+
+// Drains the ring buffer into the file. It polls rather than waiting on a
+// condition, so that the simulation thread never has to take a lock.
+void Recorder::ThreadMain(Recorder *recorder) {
+    std::vector<unsigned char> buf(1024 * 1024);
+    while (1) {
+        bool quit = recorder->m_quit;
+        size_t size = recorder->m_ring.Read(buf.data(), buf.size());
+        if (size > 0)
+            fwrite(buf.data(), 1, size, recorder->m_file);
+        else if (quit)
+            break;
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+
+void Recorder::BeginChunk(uint32_t type) {
+    m_chunk.clear();
+    PutUint32(&m_chunk, type);
+    PutUint32(&m_chunk, 0);     // The payload size, filled in by EndChunk().
+}
+
+
+void Recorder::EndChunk() {
+    uint32_t payloadSize = m_chunk.size() - 2 * sizeof(uint32_t);
+    memcpy(&m_chunk[sizeof(uint32_t)], &payloadSize, sizeof(payloadSize));
+    if (!m_ring.TryWrite(m_chunk.data(), m_chunk.size()))
+        m_numDropped++;
+}
+
+
+void Recorder::RecordStep(Particles *particles, Walls const *walls) {
+    if (!m_file || particles->GetNumSteps() == 0)
+        return;
+    unsigned long long step = particles->GetNumSteps() - 1;
+
+    // Pressure in 2D is force per unit length of boundary. Each wall sphere
+    // stands for about one world unit of wall surface.
+    double advanceTime = particles->GetAdvanceTime();
+    double boundaryLength = 2.0 * (particles->m_worldSizeX + particles->m_worldSizeY);
+    if (walls)
+        boundaryLength += walls->m_wallSpheres.size();
+    double impulse = particles->GetWallImpulse();
+
+    BeginChunk(CHUNK_OBSERVABLES);
+    PutVarint(&m_chunk, step);
+    PutDouble(&m_chunk, advanceTime);
+    PutDouble(&m_chunk, impulse);
+    PutDouble(&m_chunk, impulse / (advanceTime * boundaryLength));
+    PutVarint(&m_chunk, particles->GetNumCollisions());
+
+    Particles::Reductions const &r = particles->m_reductions;
+    bool haveReductions = r.step == step && r.numParticles > 0;
+    PutVarint(&m_chunk, haveReductions);
+    if (haveReductions) {
+        PutDouble(&m_chunk, r.kineticEnergy);
+        PutDouble(&m_chunk, r.momentumX);
+        PutDouble(&m_chunk, r.momentumY);
+        PutDouble(&m_chunk, r.temperature);
+        for (unsigned i = 0; i < Particles::SPEED_HISTOGRAM_NUM_BINS; i++)
+            PutVarint(&m_chunk, r.speedHistogram[i]);
+        for (unsigned i = 0; i < Particles::NUM_OCCUPANCY_BINS; i++)
+            PutVarint(&m_chunk, r.countsPerCell[i]);
+    }
+    EndChunk();
+
+    if (m_positionInterval == 0 || step % m_positionInterval != 0)
+        return;
+
+    BeginChunk(CHUNK_POSITIONS);
+    PutVarint(&m_chunk, step);
+    PutVarint(&m_chunk, m_decimation);
+    PutVarint(&m_chunk, (particles->m_numParticles + m_decimation - 1) / m_decimation);
+    int64_t prevX = 0;
+    int64_t prevY = 0;
+    for (unsigned i = 0; i < particles->m_numParticles; i += m_decimation) {
+        float x, y, vx, vy;
+        particles->GetParticle(i, &x, &y, &vx, &vy);
+        int64_t qx = lrintf(x * RECORDING_POSITION_SCALE);
+        int64_t qy = lrintf(y * RECORDING_POSITION_SCALE);
+        PutZigzag(&m_chunk, qx - prevX);
+        PutZigzag(&m_chunk, qy - prevY);
+        prevX = qx;
+        prevY = qy;
+    }
+    EndChunk();
+}
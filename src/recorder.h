@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ring_buffer.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+
+class Particles;
+class Walls;
+
+
+// A recording is RECORDING_MAGIC, a uint32 version, a uint32 number of speed
+// histogram bins and a uint32 number of occupancy bins, then a stream of chunks. Each chunk is a uint32 type and a
+// uint32 payload size, then the payload. Integers in payloads are LEB128
+// varints, and signed ones are zigzag encoded first. Doubles are raw.
+//
+// CHUNK_OBSERVABLES, every step: step, time step (double), wall impulse
+// (double), pressure (double), number of particle collisions, then 1 if the
+// step gathered Particles::Reductions and 0 if not. If it did, they follow:
+// kinetic energy, momentum x and y and temperature (doubles), then the speed
+// histogram's counts and the cell occupancy counts.
+//
+// CHUNK_POSITIONS, every so often: step, decimation, number of particles, then
+// each recorded particle's x and y in 1/RECORDING_POSITION_SCALE world units,
+// as the difference from the previous recorded particle. The particles are
+// sorted by cell, so the differences are small.
+static char const RECORDING_MAGIC[8] = { 'I', 'G', 'R', 'E', 'C', '\r', '\n', 0 };
+static uint32_t const RECORDING_VERSION = 2;
+static float const RECORDING_POSITION_SCALE = 64.0f;
+
+enum {
+    CHUNK_OBSERVABLES = 1,
+    CHUNK_POSITIONS = 2
+};
+
+
+// Streams observables, and every so often the particles' positions, to a file.
+// The chunks are encoded on the simulation thread and handed to a writer
+// thread through a ring buffer. If the ring buffer is full the chunk is
+// dropped, so the simulation never waits for the disk.
+class Recorder {
+    FILE *m_file;
+    SpscRingBuffer m_ring;
+    std::thread m_thread;
+    std::atomic<bool> m_quit;
+
+    unsigned m_positionInterval;    // Steps between position chunks. Zero for none.
+    unsigned m_decimation;          // Only every this many particles are recorded.
+    unsigned m_numDropped;
+    std::vector<unsigned char> m_chunk;     // Reused, so that recording doesn't allocate.
+
+    static void ThreadMain(Recorder *recorder);
+    void BeginChunk(uint32_t type);
+    void EndChunk();
+
+public:
+    Recorder();
+    ~Recorder();    // Writes out everything that wasn't dropped.
+
+    // Returns false if the file couldn't be created.
+    bool Open(char const *filename, unsigned positionInterval, unsigned decimation);
+
+    // Records the step that particles->Advance() just did. The reductions are
+    // only recorded on steps that gathered them. See
+    // Particles::SetReductionInterval().
+    void RecordStep(Particles *particles, Walls const *walls);
+
+    unsigned GetNumDropped() { return m_numDropped; }
+};
@@ -0,0 +1,247 @@
+// Own header
+#include "renderer.h"
+
+// Project headers
+#include "particles.h"
+#include "sim_thread.h"
+#include "thread_pool.h"
+
+// Deadfrog headers
+#include "df_bitmap.h"
+
+// Standard headers
+#include <algorithm>
+#include <math.h>
+
+
+float const Renderer::SPLAT_MAX_SCALE = 2.5f;
+
+static unsigned const EXPOSURE_LUT_SIZE = 256;
+static unsigned const MAX_NUM_BANDS = 256;
+static unsigned const SPARSE_PIXELS_PER_PARTICLE = 4;
+
+
+// Calls func(i) for every particle that might be inside the world space
+// rectangle. Particles are sorted by cell and collisions only push them a
+// fraction of a cell, so within a grid row they are in order of x, give or
+// take a cell, and a margin of a few cells makes the binary searches safe.
+// Without row starts, in the Morton layout, every particle is visited.
+template <typename FUNC>
+static void ForEachVisibleParticle(SimFrame const &frame, float minX, float maxX, float minY, float maxY,
+                                   FUNC const &func) {
+    unsigned numParticles = frame.x.size();
+    if (frame.rowStart.empty()) {
+        for (unsigned i = 0; i < numParticles; i++)
+            func(i);
+        return;
+    }
+
+    int numRows = frame.rowStart.size() - 1;
+    int startRow = (int)floorf(minY / frame.cellSizeY) - 1;
+    int endRow = (int)floorf(maxY / frame.cellSizeY) + 2;
+    startRow = startRow < 0 ? 0 : startRow;
+    endRow = endRow > numRows ? numRows : endRow;
+
+    float searchMinX = minX - 3.0f * frame.cellSizeX;
+    float searchMaxX = maxX + 3.0f * frame.cellSizeX;
+    float const *x = frame.x.data();
+    for (int row = startRow; row < endRow; row++) {
+        float const *rowBegin = x + frame.rowStart[row];
+        float const *rowEnd = x + frame.rowStart[row + 1];
+        unsigned begin = std::lower_bound(rowBegin, rowEnd, searchMinX) - x;
+        unsigned end = std::upper_bound(x + begin, rowEnd, searchMaxX) - x;
+        for (unsigned i = begin; i < end; i++)
+            func(i);
+    }
+}
+
+
+// Cold to hot, for t from 0 to 1, scaled by brightness.
+static DfColour SpeedColour(float t, unsigned brightness) {
+    t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+    float r = t;
+    float g = 4.0f * t * (1.0f - t);
+    float b = 1.0f - t;
+    return Colour(r * brightness, g * brightness, b * brightness);
+}
+
+
+Renderer::Renderer(unsigned numThreads) {
+    m_threadPool = new ThreadPool(numThreads);
+    m_meanDensity = 1.0f;
+    m_meanSpeed = 0.0f;
+}
+
+
+Renderer::~Renderer() {
+    delete m_threadPool;
+}
+
+
+void Renderer::Splat(DfBitmap *bmp, SimFrame const &frame, float offsetX, float offsetY, float scale,
+                     bool colourBySpeed) {
+    unsigned width = bmp->width;
+    unsigned height = bmp->height;
+    m_density.resize(width * height);
+    if (colourBySpeed)
+        m_speedSum.resize(width * height);
+
+    // Brightness against particles per pixel. The exposure follows the mean
+    // density, so that a typical lit pixel is about as bright at any zoom or
+    // particle count.
+    unsigned exposureLut[EXPOSURE_LUT_SIZE];
+    float exposure = 2.0f / m_meanDensity;
+    for (unsigned i = 0; i < EXPOSURE_LUT_SIZE; i++)
+        exposureLut[i] = 255.0f * (1.0f - expf(-(float)i * exposure));
+
+    // Particles never get more than about a cell outside the world, so
+    // nothing outside this rectangle can be lit. It is all the bands and the
+    // tone mapping cover, so that the cost follows the visible part of the
+    // world rather than the size of the window.
+    float marginX = frame.cellSizeX * scale + 1.0f;
+    float marginY = frame.cellSizeY * scale + 1.0f;
+    int rectStartX = (int)floorf(offsetX - marginX);
+    int rectEndX = (int)ceilf(offsetX + frame.worldSizeX * scale + marginX);
+    int rectStartY = (int)floorf(offsetY - marginY);
+    int rectEndY = (int)ceilf(offsetY + frame.worldSizeY * scale + marginY);
+    rectStartX = rectStartX < 0 ? 0 : rectStartX;
+    rectStartY = rectStartY < 0 ? 0 : rectStartY;
+    rectEndX = rectEndX > (int)width ? width : rectEndX;
+    rectEndY = rectEndY > (int)height ? height : rectEndY;
+    if (rectStartX >= rectEndX || rectStartY >= rectEndY)
+        return;
+    unsigned rectHeight = rectEndY - rectStartY;
+
+    // Without row starts every band would visit every particle, so there is
+    // only one band.
+    unsigned numBands = frame.rowStart.empty() ? 1 : m_threadPool->GetNumThreads() * 4;
+    numBands = numBands > MAX_NUM_BANDS ? MAX_NUM_BANDS : numBands;
+    numBands = numBands > rectHeight ? rectHeight : numBands;
+    unsigned bandLitPixels[MAX_NUM_BANDS];
+    unsigned bandNumParticles[MAX_NUM_BANDS];
+    double bandSpeedSum[MAX_NUM_BANDS];
+    float meanSpeed = m_meanSpeed;
+
+    m_threadPool->ParallelFor(numBands, [&](unsigned band) {
+        unsigned startY = rectStartY + (rectHeight * band) / numBands;
+        unsigned endY = rectStartY + (rectHeight * (band + 1)) / numBands;
+        float invScale = 1.0f / scale;
+        float minX = (rectStartX - offsetX) * invScale;
+        float maxX = (rectEndX - offsetX) * invScale;
+        float minY = (startY - offsetY) * invScale;
+        float maxY = (endY - offsetY) * invScale;
+
+        uint16_t *density = m_density.data();
+        float *speedSum = m_speedSum.data();
+        unsigned numParticles = 0;
+        double speedTotal = 0.0;
+        ForEachVisibleParticle(frame, minX, maxX, minY, maxY, [&](unsigned i) {
+            int px = frame.x[i] * scale + offsetX;
+            int py = frame.y[i] * scale + offsetY;
+            if (px < rectStartX || px >= rectEndX || py < (int)startY || py >= (int)endY)
+                return;
+            unsigned pixel = py * width + px;
+            density[pixel] += density[pixel] != UINT16_MAX;
+            numParticles++;
+            if (colourBySpeed) {
+                speedSum[pixel] += frame.speed[i];
+                speedTotal += frame.speed[i];
+            }
+        });
+
+        // Only the lit pixels are written, so that the walls show through.
+        // Each is zeroed as it is written, ready for the next frame.
+        unsigned litPixels = 0;
+        float speedScale = meanSpeed > 0.0f ? 0.5f / meanSpeed : 0.0f;
+        auto ToneMap = [&](unsigned pixel) {
+            unsigned count = density[pixel];
+            if (count == 0)
+                return;
+            density[pixel] = 0;
+            litPixels++;
+            unsigned brightness = exposureLut[count < EXPOSURE_LUT_SIZE ? count : EXPOSURE_LUT_SIZE - 1];
+            if (colourBySpeed) {
+                float speed = speedSum[pixel] / count;
+                speedSum[pixel] = 0.0f;
+                bmp->pixels[pixel] = SpeedColour(speed * speedScale, brightness);
+            }
+            else {
+                bmp->pixels[pixel] = Colour(brightness, brightness, brightness);
+            }
+        };
+
+        // When the particles are sparse it is cheaper to find the lit pixels
+        // by going over the particles again than by scanning every pixel.
+        if (numParticles * SPARSE_PIXELS_PER_PARTICLE < (endY - startY) * (rectEndX - rectStartX)) {
+            ForEachVisibleParticle(frame, minX, maxX, minY, maxY, [&](unsigned i) {
+                int px = frame.x[i] * scale + offsetX;
+                int py = frame.y[i] * scale + offsetY;
+                if (px >= rectStartX && px < rectEndX && py >= (int)startY && py < (int)endY)
+                    ToneMap(py * width + px);
+            });
+        }
+        else {
+            for (unsigned y = startY; y < endY; y++) {
+                for (int x = rectStartX; x < rectEndX; x++)
+                    ToneMap(y * width + x);
+            }
+        }
+
+        bandLitPixels[band] = litPixels;
+        bandNumParticles[band] = numParticles;
+        bandSpeedSum[band] = speedTotal;
+    });
+
+    unsigned litPixels = 0;
+    unsigned numParticles = 0;
+    double speedSum = 0.0;
+    for (unsigned i = 0; i < numBands; i++) {
+        litPixels += bandLitPixels[i];
+        numParticles += bandNumParticles[i];
+        speedSum += bandSpeedSum[i];
+    }
+    if (litPixels > 0)
+        m_meanDensity = (float)numParticles / litPixels;
+    if (colourBySpeed && numParticles > 0)
+        m_meanSpeed = speedSum / numParticles;
+}
+
+
+// Zoomed in, few enough particles are visible that drawing them one at a
+// time is fine.
+void Renderer::DrawCircles(DfBitmap *bmp, SimFrame const &frame, float offsetX, float offsetY, float scale,
+                           bool colourBySpeed) {
+    float invScale = 1.0f / scale;
+    float minX = -offsetX * invScale - PARTICLE_RADIUS;
+    float maxX = (bmp->width - offsetX) * invScale + PARTICLE_RADIUS;
+    float minY = -offsetY * invScale - PARTICLE_RADIUS;
+    float maxY = (bmp->height - offsetY) * invScale + PARTICLE_RADIUS;
+    float speedScale = m_meanSpeed > 0.0f ? 0.5f / m_meanSpeed : 0.0f;
+
+    unsigned numParticles = 0;
+    double speedSum = 0.0;
+    ForEachVisibleParticle(frame, minX, maxX, minY, maxY, [&](unsigned i) {
+        float px = frame.x[i] * scale + offsetX;
+        float py = frame.y[i] * scale + offsetY;
+        DfColour col = g_colourWhite;
+        if (colourBySpeed) {
+            col = SpeedColour(frame.speed[i] * speedScale, 255);
+            speedSum += frame.speed[i];
+            numParticles++;
+        }
+        CircleOutline(bmp, px, py, PARTICLE_RADIUS * scale, col);
+    });
+
+    if (numParticles > 0)
+        m_meanSpeed = speedSum / numParticles;
+}
+
+
+void Renderer::Render(DfBitmap *bmp, SimFrame const &frame, float offsetX, float offsetY, float scale,
+                      bool colourBySpeed) {
+    colourBySpeed = colourBySpeed && frame.speed.size() == frame.x.size();
+    if (scale < SPLAT_MAX_SCALE)
+        Splat(bmp, frame, offsetX, offsetY, scale, colourBySpeed);
+    else
+        DrawCircles(bmp, frame, offsetX, offsetY, scale, colourBySpeed);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+
+typedef struct _DfBitmap DfBitmap;
+class ThreadPool;
+struct SimFrame;
+
+
+// Draws the particles in a SimFrame. Zoomed out, each band of screen rows is
+// handled by its own task, which counts its particles into a density buffer
+// and then tone maps it, so that crowded pixels show up brighter instead of
+// every particle being one scattered PutPix(). Zoomed in, each particle is a
+// circle. Either way only the grid rows, and the part of each row, that the
+// view covers are visited.
+class Renderer {
+    ThreadPool *m_threadPool;
+    std::vector<uint16_t> m_density;    // Particles per pixel, saturating. Zeroed again as it is tone mapped.
+    std::vector<float> m_speedSum;      // Their total speed, when colouring by speed.
+
+    // From the last frame. They set the exposure and the speed colour scale.
+    float m_meanDensity;    // Of the lit pixels.
+    float m_meanSpeed;      // Of the particles drawn.
+
+    void Splat(DfBitmap *bmp, SimFrame const &frame, float offsetX, float offsetY, float scale,
+               bool colourBySpeed);
+    void DrawCircles(DfBitmap *bmp, SimFrame const &frame, float offsetX, float offsetY, float scale,
+                     bool colourBySpeed);
+
+public:
+    // Below this many pixels per world unit the particles are splatted.
+    static float const SPLAT_MAX_SCALE;
+
+    Renderer(unsigned numThreads);
+    ~Renderer();
+
+    // Colouring by speed needs the frame's speeds. Without them the
+    // particles are white.
+    void Render(DfBitmap *bmp, SimFrame const &frame, float offsetX, float offsetY, float scale,
+                bool colourBySpeed);
+};
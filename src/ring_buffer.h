@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+
+// A ring buffer of bytes between one producer thread and one consumer thread.
+// There are no locks. Each side only changes its own position, and loads the
+// other's with acquire ordering, so it sees the bytes that were copied before
+// that position was stored.
+class SpscRingBuffer {
+    std::vector<unsigned char> m_buffer;
+    size_t m_mask;
+
+    // Totals of bytes ever written and read. They are on separate cache lines
+    // so that the two threads don't keep taking the line from each other.
+    alignas(64) std::atomic<size_t> m_writePos;
+    alignas(64) std::atomic<size_t> m_readPos;
+
+public:
+    // The capacity is rounded up to a power of two.
+    SpscRingBuffer(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+        m_buffer.resize(size);
+        m_mask = size - 1;
+        m_writePos = 0;
+        m_readPos = 0;
+    }
+
+    // Producer only. Writes all of the data, or nothing if there isn't room.
+    bool TryWrite(void const *data, size_t size) {
+        size_t writePos = m_writePos.load(std::memory_order_relaxed);
+        size_t readPos = m_readPos.load(std::memory_order_acquire);
+        if (size > m_buffer.size() - (writePos - readPos))
+            return false;
+
+        size_t start = writePos & m_mask;
+        size_t firstPart = size < m_buffer.size() - start ? size : m_buffer.size() - start;
+        memcpy(&m_buffer[start], data, firstPart);
+        memcpy(&m_buffer[0], (unsigned char const *)data + firstPart, size - firstPart);
+        m_writePos.store(writePos + size, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Reads up to maxSize bytes and returns how many it read.
+    size_t Read(void *data, size_t maxSize) {
+        size_t readPos = m_readPos.load(std::memory_order_relaxed);
+        size_t writePos = m_writePos.load(std::memory_order_acquire);
+        size_t size = writePos - readPos < maxSize ? writePos - readPos : maxSize;
+
+        size_t start = readPos & m_mask;
+        size_t firstPart = size < m_buffer.size() - start ? size : m_buffer.size() - start;
+        memcpy(data, &m_buffer[start], firstPart);
+        memcpy((unsigned char *)data + firstPart, &m_buffer[0], size - firstPart);
+        m_readPos.store(readPos + size, std::memory_order_release);
+        return size;
+    }
+};
@@ -0,0 +1,88 @@
+// Own header
+#include "sim_thread.h"
+
+// Project headers
+#include "world.h"
+
+// Deadfrog headers
+#include "df_time.h"
+
+
+SimThread::SimThread(World *world) {
+    m_world = world;
+    m_quit = false;
+    m_checkpointFilename = NULL;
+    m_checkpointInterval = 0;
+}
+
+
+SimThread::~SimThread() {
+    Stop();
+}
+
+
+void SimThread::SetCheckpoint(char const *filename, unsigned interval) {
+    m_checkpointFilename = filename;
+    m_checkpointInterval = interval;
+}
+
+
+void SimThread::Start() {
+    m_quit = false;
+    m_thread = std::thread(ThreadMain, this);
+}
+
+
+void SimThread::Stop() {
+    if (!m_thread.joinable())
+        return;
+    m_quit = true;
+    m_thread.join();
+    m_checkpointWriter.Wait();
+}
+
+
+void SimThread::PublishFrame(double benchTime) {
+    Particles *particles = m_world->m_particles;
+    SimFrame *frame = m_frames.GetBack();
+    frame->x.resize(particles->m_numParticles);
+    frame->y.resize(particles->m_numParticles);
+    frame->speed.resize(m_world->m_colourBySpeed ? particles->m_numParticles : 0);
+    particles->GetPositions(frame->x.data(), frame->y.data(), frame->speed.empty() ? NULL : frame->speed.data());
+
+    frame->rowStart.resize(particles->m_gridResY + 1);
+    if (!particles->GetRowStarts(frame->rowStart.data()))
+        frame->rowStart.clear();
+    frame->cellSizeX = particles->m_worldSizeX / particles->m_gridResX;
+    frame->cellSizeY = particles->m_worldSizeY / particles->m_gridResY;
+    frame->worldSizeX = particles->m_worldSizeX;
+    frame->worldSizeY = particles->m_worldSizeY;
+    frame->reductions = particles->m_reductions;
+    frame->numSteps = particles->GetNumSteps();
+    frame->simTime = particles->GetSimTime();
+    frame->numSubSteps = m_world->m_numSubSteps;
+    frame->benchTime = benchTime;
+    m_frames.Publish();
+}
+
+
+void SimThread::ThreadMain(SimThread *sim) {
+    World *world = sim->m_world;
+    unsigned numWorldSteps = 0;
+    double benchTime = 0.0;
+    while (!sim->m_quit) {
+        if (sim->m_frames.IsTaken())
+            sim->PublishFrame(benchTime);
+
+        double startTime = GetRealTime();
+        world->Step();
+        if (numWorldSteps < BENCH_NUM_STEPS)
+            benchTime += GetRealTime() - startTime;
+        numWorldSteps++;
+
+        if (sim->m_checkpointFilename && numWorldSteps % sim->m_checkpointInterval == 0) {
+            sim->m_checkpointWriter.Write(sim->m_checkpointFilename, world->m_particles,
+                                          world->m_walls, world->m_advanceTime);
+        }
+    }
+}
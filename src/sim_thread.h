@@ -0,0 +1,88 @@
+#pragma once
+
+#include "particles.h"
+#include "snapshot.h"
+#include "triple_buffer.h"
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+
+class World;
+
+
+// What the render thread draws. A copy of the particles' positions, taken
+// between steps, so that drawing never reads the arrays Advance() is writing.
+struct SimFrame {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> speed;       // Empty unless World::m_colourBySpeed.
+
+    // Particles in grid row r are rowStart[r] to rowStart[r + 1] - 1, so the
+    // renderer can skip the rows it can't see. Empty in the Morton layout.
+    std::vector<unsigned> rowStart;
+    float cellSizeX;
+    float cellSizeY;
+    float worldSizeX;
+    float worldSizeY;
+
+    Particles::Reductions reductions;
+    unsigned long long numSteps;
+    double simTime;         // Simulated seconds so far.
+    unsigned numSubSteps;   // In the last world step.
+    double benchTime;       // Seconds spent in the first BENCH_NUM_STEPS steps.
+
+    SimFrame() {
+        cellSizeX = 1.0f;
+        cellSizeY = 1.0f;
+        worldSizeX = 0.0f;
+        worldSizeY = 0.0f;
+        memset(&reductions, 0, sizeof(reductions));
+        numSteps = 0;
+        simTime = 0.0;
+        numSubSteps = 0;
+        benchTime = 0.0;
+    }
+};
+
+
+// Steps the world as fast as it can on its own thread, so that the window's
+// frame rate doesn't limit the simulation and drawing doesn't slow it down. A
+// new frame is only copied out once the render thread has taken the last one,
+// so at most one copy is made per displayed frame.
+class SimThread {
+    World *m_world;
+    std::thread m_thread;
+    std::atomic<bool> m_quit;
+    TripleBuffer<SimFrame> m_frames;
+
+    CheckpointWriter m_checkpointWriter;
+    char const *m_checkpointFilename;
+    unsigned m_checkpointInterval;      // In world steps.
+
+    static void ThreadMain(SimThread *sim);
+    void PublishFrame(double benchTime);
+
+public:
+    static const unsigned BENCH_NUM_STEPS = 500;
+
+    SimThread(World *world);
+    ~SimThread();
+
+    // Writes a checkpoint every interval world steps. If the last one is still
+    // being written, that one is skipped rather than holding up the simulation.
+    // Must be called before Start().
+    void SetCheckpoint(char const *filename, unsigned interval);
+
+    void Start();
+
+    // Returns once the step in progress, and any checkpoint being written, has
+    // finished. After that the world belongs to the calling thread again.
+    void Stop();
+
+    // Render thread only. Returns the newest frame, which stays valid until the
+    // next call.
+    SimFrame const *GetFrame() { return m_frames.GetFront(); }
+};
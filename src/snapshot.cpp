@@ -0,0 +1,349 @@
+// Own header
+#include "snapshot.h"
+
+// Project headers
+#include "particles.h"
+#include "walls.h"
+
+// Standard headers
+#include <memory.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+static unsigned const MAX_SECTIONS = Particles::MAX_STATE_ARRAYS + 1;
+static_assert(sizeof(SnapshotHeader::speciesRadius) == sizeof(float) * ParticlesConfig::MAX_SPECIES,
+              "The snapshot header's species arrays are the wrong size");
+static uint64_t const SECTION_ALIGNMENT = 64;
+
+
+static uint64_t AlignSection(uint64_t offset) {
+    return (offset + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1);
+}
+
+
+// Fills in the header for the current state, and points data[i] at the bytes of
+// section i. Returns the number of sections.
+static unsigned GatherSections(Particles *particles, Walls const *walls, float advanceTime,
+                               SnapshotHeader *header, void const *data[], size_t sizes[]) {
+    memset(header, 0, sizeof(SnapshotHeader));
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->format = particles->m_format;
+    header->layout = particles->GetCellLayout();
+    header->numParticles = particles->m_numParticles;
+    header->worldSizeX = particles->m_worldSizeX;
+    header->worldSizeY = particles->m_worldSizeY;
+    header->gridResX = particles->m_gridResX;
+    header->advanceTime = advanceTime;
+    header->numSpecies = particles->m_numSpecies;
+    for (unsigned s = 0; s < particles->m_numSpecies; s++) {
+        header->speciesRadius[s] = particles->m_speciesRadius[s];
+        header->speciesMass[s] = particles->m_speciesMass[s];
+    }
+
+    Particles::StateArray arrays[Particles::MAX_STATE_ARRAYS];
+    unsigned num = particles->GetStateArrays(arrays);
+    for (unsigned i = 0; i < num; i++) {
+        data[i] = arrays[i].data;
+        sizes[i] = arrays[i].size;
+    }
+
+    if (walls) {
+        header->wallsWidth = walls->GetBitmapWidth();
+        header->wallsHeight = walls->GetBitmapHeight();
+        header->wallsSdf = walls->HasSdf();
+        data[num] = walls->GetBits();
+        sizes[num++] = walls->GetBitmapStride() * walls->GetBitmapHeight();
+    }
+
+    header->numSections = num;
+    return num;
+}
+
+
+static bool WriteSnapshot(char const *filename, SnapshotHeader const &header,
+                          void const * const data[], size_t const sizes[]) {
+    std::string tempFilename = std::string(filename) + ".tmp";
+    FILE *file = fopen(tempFilename.c_str(), "wb");
+    if (!file)
+        return false;
+
+    unsigned numSections = header.numSections;
+    SnapshotSection sections[MAX_SECTIONS];
+    uint64_t pos = sizeof(SnapshotHeader) + sizeof(SnapshotSection) * numSections;
+    uint64_t offset = AlignSection(pos);
+    for (unsigned i = 0; i < numSections; i++) {
+        sections[i].offset = offset;
+        sections[i].size = sizes[i];
+        offset = AlignSection(offset + sizes[i]);
+    }
+
+    static char const padding[SECTION_ALIGNMENT] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(sections, sizeof(SnapshotSection), numSections, file) == numSections;
+    for (unsigned i = 0; i < numSections && ok; i++) {
+        size_t padSize = sections[i].offset - pos;
+        ok = fwrite(padding, 1, padSize, file) == padSize &&
+             fwrite(data[i], 1, sizes[i], file) == sizes[i];
+        pos = sections[i].offset + sizes[i];
+    }
+    ok = fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+    // Windows' rename() won't replace an existing file.
+    if (ok)
+        remove(filename);
+#endif
+    ok = ok && rename(tempFilename.c_str(), filename) == 0;
+    if (!ok)
+        remove(tempFilename.c_str());
+    return ok;
+}
+
+
+bool SaveSnapshotFile(char const *filename, Particles *particles, Walls const *walls, float advanceTime) {
+    SnapshotHeader header;
+    void const *data[MAX_SECTIONS];
+    size_t sizes[MAX_SECTIONS];
+    GatherSections(particles, walls, advanceTime, &header, data, sizes);
+    return WriteSnapshot(filename, header, data, sizes);
+}
+
+
+// A read only view of a whole file. m_data is NULL if the file couldn't be
+// mapped.
+class MappedFile {
+public:
+    char const *m_data;
+    size_t m_size;
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#endif
+
+    MappedFile(char const *filename) {
+        m_data = NULL;
+        m_size = 0;
+#ifdef _WIN32
+        m_mapping = NULL;
+        m_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        LARGE_INTEGER size;
+        if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return;
+        m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_mapping)
+            return;
+        m_data = (char const *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_data)
+            m_size = size.QuadPart;
+#else
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                m_data = (char const *)data;
+                m_size = st.st_size;
+            }
+        }
+        close(fd);      // The mapping keeps the file open.
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if (m_data)
+            munmap((void *)m_data, m_size);
+#endif
+    }
+};
+
+
+bool LoadSnapshotFile(char const *filename, Particles **particlesOut, Walls **wallsOut, float *advanceTime) {
+    MappedFile file(filename);
+    if (!file.m_data || file.m_size < sizeof(SnapshotHeader))
+        return false;
+
+    SnapshotHeader header;
+    memcpy(&header, file.m_data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION ||
+        header.numSections < 2 || header.numSections > MAX_SECTIONS ||
+        header.format > ParticlesConfig::FORMAT_FIXED ||
+        header.layout > Particles::LAYOUT_MORTON ||
+        header.numParticles == 0 || header.worldSizeX == 0 || header.worldSizeY == 0 ||
+        header.gridResX == 0)
+        return false;
+
+    SnapshotSection sections[MAX_SECTIONS];
+    size_t tableSize = sizeof(SnapshotSection) * header.numSections;
+    if (file.m_size - sizeof(header) < tableSize)
+        return false;
+    memcpy(sections, file.m_data + sizeof(header), tableSize);
+    for (unsigned i = 0; i < header.numSections; i++) {
+        if (sections[i].offset > file.m_size || sections[i].size > file.m_size - sections[i].offset)
+            return false;
+    }
+
+    // Check the first array before allocating anything, so that a bad header
+    // can't ask for a huge arena.
+    bool fixed = header.format == ParticlesConfig::FORMAT_FIXED;
+    size_t stateSize = fixed ? sizeof(int16_t) : sizeof(float);
+    if (sections[0].size != stateSize * header.numParticles)
+        return false;
+
+    ParticlesConfig config;
+    config.numParticles = header.numParticles;
+    config.worldSizeX = header.worldSizeX;
+    config.worldSizeY = header.worldSizeY;
+    config.gridResX = header.gridResX;
+    config.format = (ParticlesConfig::Format)header.format;
+    config.numSpecies = header.numSpecies;
+    memcpy(config.speciesRadius, header.speciesRadius, sizeof(config.speciesRadius));
+    memcpy(config.speciesMass, header.speciesMass, sizeof(config.speciesMass));
+    if (!config.IsValid())
+        return false;
+    Particles *particles = new Particles(config, false);
+
+    // SetCellLayout() sorts the zeroed particles before they are overwritten,
+    // which is cheap next to placing them.
+    Particles::CellLayout layout = (Particles::CellLayout)header.layout;
+    bool ok = layout == Particles::LAYOUT_ROW_MAJOR || particles->SetCellLayout(layout);
+
+    Particles::StateArray arrays[Particles::MAX_STATE_ARRAYS];
+    unsigned numArrays = particles->GetStateArrays(arrays);
+    bool hasWalls = header.wallsWidth > 0 && header.wallsHeight > 0;
+    ok = ok && header.numSections == numArrays + hasWalls;
+    for (unsigned i = 0; i < numArrays && ok; i++)
+        ok = sections[i].size == arrays[i].size;
+    uint64_t wallsSize = (uint64_t)Walls::CalcBitmapStride(header.wallsWidth) * header.wallsHeight;
+    ok = ok && (!hasWalls || sections[numArrays].size == wallsSize);
+    if (!ok) {
+        delete particles;
+        return false;
+    }
+
+    for (unsigned i = 0; i < numArrays; i++)
+        memcpy(arrays[i].data, file.m_data + sections[i].offset, arrays[i].size);
+    particles->InvalidateVerletLists();
+
+    Walls *walls = NULL;
+    if (hasWalls) {
+        walls = new Walls;
+        walls->LoadBits(header.wallsWidth, header.wallsHeight,
+                        (unsigned char const *)file.m_data + sections[numArrays].offset);
+        if (header.wallsSdf)
+            walls->BakeSdf();
+    }
+
+    *particlesOut = particles;
+    *wallsOut = walls;
+    *advanceTime = header.advanceTime;
+    return true;
+}
+
+
+CheckpointWriter::CheckpointWriter() {
+    memset(&m_header, 0, sizeof(m_header));
+    m_busy = false;
+    m_quit = false;
+    m_thread = std::thread(ThreadMain, this);
+}
+
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wakeCondition.notify_one();
+    m_thread.join();
+}
+
+
+void CheckpointWriter::ThreadMain(CheckpointWriter *writer) {
+    while (1) {
+        {
+            std::unique_lock<std::mutex> lock(writer->m_mutex);
+            while (!writer->m_quit && !writer->m_busy)
+                writer->m_wakeCondition.wait(lock);
+            if (!writer->m_busy)
+                return;
+        }
+
+        void const *data[MAX_SECTIONS];
+        size_t sizes[MAX_SECTIONS];
+        for (unsigned i = 0; i < writer->m_chunks.size(); i++) {
+            data[i] = writer->m_staging.data() + writer->m_chunks[i].offset;
+            sizes[i] = writer->m_chunks[i].size;
+        }
+        if (!WriteSnapshot(writer->m_filename.c_str(), writer->m_header, data, sizes))
+            fprintf(stderr, "Couldn't write checkpoint '%s'\n", writer->m_filename.c_str());
+
+        std::lock_guard<std::mutex> lock(writer->m_mutex);
+        writer->m_busy = false;
+        writer->m_doneCondition.notify_all();
+    }
+}
+
+
+bool CheckpointWriter::Write(char const *filename, Particles *particles, Walls const *walls, float advanceTime) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_busy)
+            return false;
+    }
+
+    // The writer thread is idle, so the staging buffer is ours until m_busy is
+    // set. It keeps its capacity, so after the first checkpoint this is just a
+    // copy.
+    void const *data[MAX_SECTIONS];
+    size_t sizes[MAX_SECTIONS];
+    unsigned numSections = GatherSections(particles, walls, advanceTime, &m_header, data, sizes);
+    size_t totalSize = 0;
+    for (unsigned i = 0; i < numSections; i++)
+        totalSize += sizes[i];
+    m_staging.resize(totalSize);
+    m_chunks.resize(numSections);
+    size_t offset = 0;
+    for (unsigned i = 0; i < numSections; i++) {
+        memcpy(m_staging.data() + offset, data[i], sizes[i]);
+        m_chunks[i].offset = offset;
+        m_chunks[i].size = sizes[i];
+        offset += sizes[i];
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_filename = filename;
+        m_busy = true;
+    }
+    m_wakeCondition.notify_one();
+    return true;
+}
+
+
+void CheckpointWriter::Wait() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_busy)
+        m_doneCondition.wait(lock);
+}
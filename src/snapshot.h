@@ -0,0 +1,98 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+class Particles;
+class Walls;
+
+
+// A snapshot file is a SnapshotHeader, then numSections SnapshotSections, then
+// the sections' data. The sections are the particles' state arrays, in the
+// order Particles::GetStateArrays() gives them, then the wall bitmap if there
+// are walls. Each section starts on a 64 byte boundary. Everything is in the
+// machine's native byte order.
+static char const SNAPSHOT_MAGIC[8] = { 'I', 'G', 'S', 'N', 'A', 'P', '\r', '\n' };
+static uint32_t const SNAPSHOT_VERSION = 3;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numSections;
+    uint32_t format;            // ParticlesConfig::Format.
+    uint32_t layout;            // Particles::CellLayout.
+    uint32_t numParticles;
+    uint32_t worldSizeX;
+    uint32_t worldSizeY;
+    uint32_t gridResX;
+    float advanceTime;
+    uint32_t wallsWidth;        // Zero if there are no walls.
+    uint32_t wallsHeight;
+    uint32_t wallsSdf;          // Non-zero if the walls use a signed distance field.
+    uint32_t numSpecies;        // Zero for the default species. See ParticlesConfig.
+    float speciesRadius[8];
+    float speciesMass[8];
+};
+
+struct SnapshotSection {
+    uint64_t offset;            // From the start of the file.
+    uint64_t size;
+};
+
+
+// Writes everything needed to carry on the run to filename. The file is written
+// under a temporary name and then renamed, so an existing snapshot is never
+// left half overwritten. Returns false if it couldn't be written.
+bool SaveSnapshotFile(char const *filename, Particles *particles, Walls const *walls, float advanceTime);
+
+// Creates the particles, and the walls if the snapshot has any, from a
+// snapshot. The file is memory mapped and the arrays are copied straight into
+// the particles' arena, so nothing is regenerated or rebinned. The walls, if
+// any, still need passing to Particles::SetWalls(). Returns false, having
+// created nothing, if the file couldn't be read or isn't a snapshot of this
+// version.
+bool LoadSnapshotFile(char const *filename, Particles **particles, Walls **walls, float *advanceTime);
+
+
+// Writes snapshots on a background thread. Write() copies the state into a
+// staging buffer, which is the only part that holds up the simulation, and the
+// thread writes the buffer out while Advance() carries on.
+class CheckpointWriter {
+    struct Chunk {
+        size_t offset;          // Into m_staging.
+        size_t size;
+    };
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeCondition;
+    std::condition_variable m_doneCondition;
+
+    // Owned by the writer thread while m_busy is true.
+    std::string m_filename;
+    SnapshotHeader m_header;
+    std::vector<char> m_staging;
+    std::vector<Chunk> m_chunks;
+
+    bool m_busy;
+    bool m_quit;
+
+    static void ThreadMain(CheckpointWriter *writer);
+
+public:
+    CheckpointWriter();
+    ~CheckpointWriter();     // Finishes any write in progress.
+
+    // Returns false, and doesn't copy anything, if the last checkpoint is still
+    // being written. Write errors are reported on stderr.
+    bool Write(char const *filename, Particles *particles, Walls const *walls, float advanceTime);
+
+    // Blocks until the last checkpoint has been written.
+    void Wait();
+};
@@ -0,0 +1,122 @@
+// Own header
+#include "thread_pool.h"
+
+
+ThreadPool::ThreadPool(unsigned numThreads) {
+    m_func = NULL;
+    m_context = NULL;
+    m_blocks.reset(new TaskBlock[numThreads > 0 ? numThreads : 1]);
+    m_steal = true;
+    m_generation = 0;
+    m_numBusyWorkers = 0;
+    m_quit = false;
+
+    for (unsigned i = 1; i < numThreads; i++)
+        m_workers.push_back(std::thread(WorkerMain, this, i));
+}
+
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wakeCondition.notify_all();
+
+    for (unsigned i = 0; i < m_workers.size(); i++)
+        m_workers[i].join();
+}
+
+
+void ThreadPool::WorkerMain(ThreadPool *pool, unsigned threadIndex) {
+    unsigned seenGeneration = 0;
+    while (1) {
+        {
+            std::unique_lock<std::mutex> lock(pool->m_mutex);
+            while (!pool->m_quit && pool->m_generation == seenGeneration)
+                pool->m_wakeCondition.wait(lock);
+            if (pool->m_quit)
+                return;
+            seenGeneration = pool->m_generation;
+        }
+
+        pool->DoTasks(threadIndex);
+
+        std::lock_guard<std::mutex> lock(pool->m_mutex);
+        pool->m_numBusyWorkers--;
+        if (pool->m_numBusyWorkers == 0)
+            pool->m_doneCondition.notify_one();
+    }
+}
+
+
+// Works through this thread's block, then, if stealing, through the other
+// threads' blocks in turn.
+void ThreadPool::DoTasks(unsigned threadIndex) {
+    unsigned numThreads = GetNumThreads();
+    unsigned numBlocks = m_steal ? numThreads : 1;
+    for (unsigned i = 0; i < numBlocks; i++) {
+        TaskBlock &block = m_blocks[(threadIndex + i) % numThreads];
+        while (1) {
+            unsigned taskIndex = block.next++;
+            if (taskIndex >= block.end)
+                break;
+            m_func(m_context, taskIndex);
+        }
+    }
+}
+
+
+// Wakes the workers to run the blocks, which must already be set up, and
+// returns when they are all done.
+void ThreadPool::RunBlocks(TaskFunc func, void *context) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_func = func;
+        m_context = context;
+        m_numBusyWorkers = m_workers.size();
+        m_generation++;
+    }
+    m_wakeCondition.notify_all();
+
+    DoTasks(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_numBusyWorkers > 0)
+        m_doneCondition.wait(lock);
+}
+
+
+void ThreadPool::Run(unsigned numTasks, TaskFunc func, void *context) {
+    if (m_workers.empty() || numTasks == 1) {
+        for (unsigned i = 0; i < numTasks; i++)
+            func(context, i);
+        return;
+    }
+
+    // No worker is running, so the blocks can be changed without the lock.
+    unsigned numThreads = GetNumThreads();
+    for (unsigned k = 0; k < numThreads; k++) {
+        m_blocks[k].next = (numTasks * (unsigned long long)k) / numThreads;
+        m_blocks[k].end = (numTasks * (unsigned long long)(k + 1)) / numThreads;
+    }
+    m_steal = true;
+    RunBlocks(func, context);
+}
+
+
+void ThreadPool::RunOnEachThread(TaskFunc func, void *context) {
+    unsigned numThreads = GetNumThreads();
+    for (unsigned k = 0; k < numThreads; k++) {
+        m_blocks[k].next = k;
+        m_blocks[k].end = k + 1;
+    }
+    m_steal = false;
+    RunBlocks(func, context);
+}
+
+
+unsigned ThreadPool::GetNumHardwareThreads() {
+    unsigned num = std::thread::hardware_concurrency();
+    return num > 0 ? num : 1;
+}
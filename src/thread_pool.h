@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A fixed set of worker threads that run batches of independent tasks. The
+// thread that calls Run() works on the batch too, so a pool of one thread has
+// no workers and runs everything inline.
+//
+// The tasks are split into one contiguous block per thread, and each thread
+// starts on its own block before helping with the others. So when the tasks
+// are slices of arrays, thread k mostly works on the k-th slice of each, which
+// keeps the slices in its caches and, after Arena::FirstTouch(), on its NUMA
+// node.
+class ThreadPool {
+public:
+    typedef void (*TaskFunc)(void *context, unsigned taskIndex);
+
+private:
+    // The caller of Run() is thread 0 and the workers are 1 onwards.
+    struct alignas(64) TaskBlock {
+        std::atomic<unsigned> next;
+        unsigned end;
+    };
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeCondition;
+    std::condition_variable m_doneCondition;
+
+    TaskFunc m_func;
+    void *m_context;
+    std::unique_ptr<TaskBlock[]> m_blocks;  // One per thread.
+    bool m_steal;                           // Whether threads that finish their blocks help with the others.
+    unsigned m_generation;
+    unsigned m_numBusyWorkers;
+    bool m_quit;
+
+    static void WorkerMain(ThreadPool *pool, unsigned threadIndex);
+    void DoTasks(unsigned threadIndex);
+    void RunBlocks(TaskFunc func, void *context);
+
+    template <typename FUNC>
+    static void CallFunctor(void *context, unsigned taskIndex) {
+        (*(FUNC const *)context)(taskIndex);
+    }
+
+public:
+    ThreadPool(unsigned numThreads);
+    ~ThreadPool();
+
+    unsigned GetNumThreads() const { return m_workers.size() + 1; }
+
+    // Calls func(context, i) for every i in [0, numTasks). Returns once all
+    // the calls have completed.
+    void Run(unsigned numTasks, TaskFunc func, void *context);
+
+    template <typename FUNC>
+    void ParallelFor(unsigned numTasks, FUNC const &func) {
+        Run(numTasks, &CallFunctor<FUNC>, (void *)&func);
+    }
+
+    // Calls func(context, k) exactly once on each thread k, for work that has
+    // to be done by a particular thread, like first touching its memory.
+    void RunOnEachThread(TaskFunc func, void *context);
+
+    template <typename FUNC>
+    void ForEachThread(FUNC const &func) {
+        RunOnEachThread(&CallFunctor<FUNC>, (void *)&func);
+    }
+
+    static unsigned GetNumHardwareThreads();
+};
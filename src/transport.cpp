@@ -0,0 +1,190 @@
+// Own header
+#include "transport.h"
+
+// Standard headers
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+
+bool Transport::Exchange(unsigned peer, void const *data, size_t size, std::vector<char> *received) {
+    if (GetRank() < peer)
+        return Send(peer, data, size) && Receive(peer, received);
+    return Receive(peer, received) && Send(peer, data, size);
+}
+
+
+// Gathers the values on rank 0, which combines them and sends the result back.
+template <typename FUNC>
+static bool AllReduce(Transport *transport, double *value, FUNC const &combine) {
+    unsigned numRanks = transport->GetNumRanks();
+    std::vector<char> message;
+    if (transport->GetRank() == 0) {
+        for (unsigned r = 1; r < numRanks; r++) {
+            if (!transport->Receive(r, &message) || message.size() != sizeof(double))
+                return false;
+            double other;
+            memcpy(&other, message.data(), sizeof(double));
+            *value = combine(*value, other);
+        }
+        for (unsigned r = 1; r < numRanks; r++) {
+            if (!transport->Send(r, value, sizeof(double)))
+                return false;
+        }
+        return true;
+    }
+
+    if (!transport->Send(0, value, sizeof(double)) || !transport->Receive(0, &message) ||
+        message.size() != sizeof(double))
+        return false;
+    memcpy(value, message.data(), sizeof(double));
+    return true;
+}
+
+
+bool Transport::AllReduceSum(double *value) {
+    return AllReduce(this, value, [](double a, double b) { return a + b; });
+}
+
+
+bool Transport::AllReduceMin(double *value) {
+    return AllReduce(this, value, [](double a, double b) { return a < b ? a : b; });
+}
+
+
+#ifdef _WIN32
+
+Transport *CreateSocketTransport(unsigned numRanks) {
+    fprintf(stderr, "The socket transport isn't supported on Windows\n");
+    return NULL;
+}
+
+#else
+
+// Each message is its size, as a uint64_t, then its bytes.
+class SocketTransport: public Transport {
+    unsigned m_rank;
+    std::vector<int> m_sockets;     // Per rank. -1 for our own.
+    std::vector<pid_t> m_children;  // Only rank 0 has any.
+
+    static bool WriteAll(int fd, void const *data, size_t size) {
+        char const *bytes = (char const *)data;
+        while (size > 0) {
+            ssize_t n = write(fd, bytes, size);
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool ReadAll(int fd, void *data, size_t size) {
+        char *bytes = (char *)data;
+        while (size > 0) {
+            ssize_t n = read(fd, bytes, size);
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= n;
+        }
+        return true;
+    }
+
+public:
+    SocketTransport(unsigned rank, std::vector<int> const &sockets, std::vector<pid_t> const &children)
+    :   m_rank(rank),
+        m_sockets(sockets),
+        m_children(children)
+    {
+    }
+
+    ~SocketTransport() {
+        for (unsigned r = 0; r < m_sockets.size(); r++) {
+            if (m_sockets[r] >= 0)
+                close(m_sockets[r]);
+        }
+        for (unsigned i = 0; i < m_children.size(); i++)
+            waitpid(m_children[i], NULL, 0);
+    }
+
+    unsigned GetRank() { return m_rank; }
+    unsigned GetNumRanks() { return m_sockets.size(); }
+
+    bool Send(unsigned toRank, void const *data, size_t size) {
+        uint64_t header = size;
+        return WriteAll(m_sockets[toRank], &header, sizeof(header)) && WriteAll(m_sockets[toRank], data, size);
+    }
+
+    bool Receive(unsigned fromRank, std::vector<char> *data) {
+        uint64_t header;
+        if (!ReadAll(m_sockets[fromRank], &header, sizeof(header)))
+            return false;
+        data->resize(header);
+        return ReadAll(m_sockets[fromRank], data->data(), header);
+    }
+};
+
+
+Transport *CreateSocketTransport(unsigned numRanks) {
+    // pairs[a][b] is the socket pair between ranks a < b. Rank a keeps
+    // element 0 and rank b element 1.
+    std::vector<std::vector<int> > pairs(numRanks, std::vector<int>(numRanks * 2, -1));
+    for (unsigned a = 0; a < numRanks; a++) {
+        for (unsigned b = a + 1; b < numRanks; b++) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, &pairs[a][b * 2]) != 0) {
+                fprintf(stderr, "Couldn't create a socket pair: %s\n", strerror(errno));
+                return NULL;
+            }
+        }
+    }
+
+    // Otherwise anything still buffered would be written once per process.
+    fflush(NULL);
+
+    unsigned rank = 0;
+    std::vector<pid_t> children;
+    for (unsigned r = 1; r < numRanks; r++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Couldn't fork rank %u: %s\n", r, strerror(errno));
+            return NULL;
+        }
+        if (pid == 0) {
+            rank = r;
+            children.clear();
+            break;
+        }
+        children.push_back(pid);
+    }
+
+    // Keep our end of each of our pairs, and close everything else.
+    std::vector<int> sockets(numRanks, -1);
+    for (unsigned a = 0; a < numRanks; a++) {
+        for (unsigned b = a + 1; b < numRanks; b++) {
+            int *pair = &pairs[a][b * 2];
+            if (a == rank) {
+                sockets[b] = pair[0];
+                close(pair[1]);
+            }
+            else if (b == rank) {
+                sockets[a] = pair[1];
+                close(pair[0]);
+            }
+            else {
+                close(pair[0]);
+                close(pair[1]);
+            }
+        }
+    }
+
+    return new SocketTransport(rank, sockets, children);
+}
+
+#endif
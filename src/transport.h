@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+
+// Carries messages between the processes of a domain decomposition. Each
+// process has a rank, from 0 to GetNumRanks() - 1. Messages between a pair of
+// ranks arrive in the order they were sent. Backends implement Send() and
+// Receive(), and the collective operations are built on them.
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    virtual unsigned GetRank() = 0;
+    virtual unsigned GetNumRanks() = 0;
+
+    // Both block until done. They return false if the other rank has gone.
+    virtual bool Send(unsigned toRank, void const *data, size_t size) = 0;
+    virtual bool Receive(unsigned fromRank, std::vector<char> *data) = 0;
+
+    // Sends to peer and receives from it. The lower rank sends first, so that
+    // two ranks exchanging with each other can't both block in Send().
+    bool Exchange(unsigned peer, void const *data, size_t size, std::vector<char> *received);
+
+    // Every rank must call these together. Each returns the combination of
+    // every rank's value, added up in rank order so that every rank gets the
+    // same bits.
+    bool AllReduceSum(double *value);
+    bool AllReduceMin(double *value);
+};
+
+
+// Forks numRanks - 1 child processes, connected to the caller and to each other
+// by Unix domain sockets, and returns each process's transport. The caller
+// becomes rank 0, and its transport's destructor waits for the children to
+// exit. Must be called before any threads are started. Returns NULL, having
+// forked nothing, on failure or on Windows.
+Transport *CreateSocketTransport(unsigned numRanks);
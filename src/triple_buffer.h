@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+
+
+// Three Ts shared by one producer thread and one consumer thread, with no
+// locks. The producer fills in the back one and publishes it by swapping it
+// with the middle one. The consumer takes the newest by swapping its front one
+// with the middle one. Neither ever waits for the other, and the consumer
+// skips any that it was too slow to see.
+template <typename T>
+class TripleBuffer {
+    enum {
+        INDEX_MASK = 3,
+        FRESH_BIT = 4       // Set in m_middle from publishing until the consumer takes it.
+    };
+
+    T m_items[3];
+    unsigned m_back;        // Producer only.
+    alignas(64) std::atomic<unsigned> m_middle;
+    alignas(64) unsigned m_front;   // Consumer only.
+
+public:
+    TripleBuffer() {
+        m_back = 0;
+        m_middle = 1;
+        m_front = 2;
+    }
+
+    // Producer only. Returns true if the consumer has taken the last one
+    // published, so that the producer can skip filling in ones nobody sees.
+    bool IsTaken() { return !(m_middle.load(std::memory_order_acquire) & FRESH_BIT); }
+
+    // Producer only.
+    T *GetBack() { return &m_items[m_back]; }
+    void Publish() {
+        m_back = m_middle.exchange(m_back | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Consumer only. Returns the newest one published. It is the consumer's
+    // until the next call.
+    T const *GetFront() {
+        if (m_middle.load(std::memory_order_relaxed) & FRESH_BIT)
+            m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & INDEX_MASK;
+        return &m_items[m_front];
+    }
+};
@@ -2,158 +2,501 @@
 #include "walls.h"
 
 // Project headers
+#include "arena.h"
 #include "maths.h"
 #include "particles.h"
+#include "thread_pool.h"
 #include "world.h"
 
 // Deadfrog headers
 #include "df_bitmap.h"
 
+// Standard headers
+#include <algorithm>
+#include <emmintrin.h>
 #include <math.h>
-
-
-static float const WALL_SPHERE_RADIUS = 1.5f;
+#include <memory.h>
 
 
 Walls::Walls()
 {
     m_wallBitmap = NULL;
+    m_wallBitmapWidth = 0;
+    m_wallBitmapHeight = 0;
+    m_wallBitmapStride = 0;
+    m_gridResX = 0;
+    m_cellArena = NULL;
+    m_cellStart = NULL;
+    m_cellSpheres = NULL;
+    m_cellHasWalls = NULL;
+    m_sdfArena = NULL;
+    m_sdf = NULL;
+}
+
+
+Walls::~Walls()
+{
+    delete [] m_wallBitmap;
+    delete m_cellArena;
+    delete m_sdfArena;
 }
 
 
-bool Walls::IsWallPixel(unsigned x, unsigned y)
+bool Walls::IsWallPixel(int x, int y)
 {
-    unsigned bitWithinByte = x & 7;
-    unsigned char bitMask = 1 << bitWithinByte;
-    x /= 8;
-    unsigned char wallByte = m_wallBitmap[y * m_wallBitmapWidth / 8 + x];
-    return !!(wallByte & bitMask);
+    if (x < 0 || y < 0 || x >= (int)m_wallBitmapWidth || y >= (int)m_wallBitmapHeight)
+        return false;
+
+    uint64_t wallWord = GetRow(y)[x / 64];
+    return (wallWord >> (x & 63)) & 1;
 }
 
 
 void Walls::SetWallPixel(unsigned x, unsigned y)
 {
-    unsigned bitWithinByte = x & 7;
-    unsigned char bitMask = 1 << bitWithinByte;
-    x /= 8;
-    unsigned char *wallByte = &m_wallBitmap[y * m_wallBitmapWidth / 8 + x];
-    *wallByte |= bitMask;
+    GetRow(y)[x / 64] |= (uint64_t)1 << (x & 63);
 }
 
 
-bool Walls::GetWallNormalFromPixel(DfBitmap *bmp, unsigned x, unsigned y, float *resultX, float *resultY)
+unsigned Walls::CalcBitmapStride(unsigned width)
 {
-    // Assume the specified pixel is a wall pixel
+    return (width + 63) / 64 * 8;
+}
+
 
+void Walls::AllocBitmap(unsigned width, unsigned height)
+{
+    m_wallBitmapWidth = width;
+    m_wallBitmapHeight = height;
+    m_wallBitmapStride = CalcBitmapStride(width);
+    size_t bitmapWords = (size_t)m_wallBitmapStride / 8 * height;
+    delete [] m_wallBitmap;
+    m_wallBitmap = new uint64_t [bitmapWords];
+    memset(m_wallBitmap, 0, bitmapWords * 8);
+    delete m_sdfArena;
+    m_sdfArena = NULL;
+    m_sdf = NULL;
+}
+
+
+// The normal of a wall pixel is the average of the directions to its
+// neighbours that aren't wall. Bit d of the index is set if the neighbour in
+// compass direction d (N, NE, E, etc) isn't wall. If it is surrounded by wall,
+// or by nothing, the normal is undefined and the pixel gets no sphere.
+static void BuildNormalLut(float lutX[256], float lutY[256])
+{
     static const float R2 = 0.7071068f;  // 1.0 / sqrt(2.0)
-                                         // Lookup tables for the normals for each of the compass directions, in the order (N, NE, E, etc)
     float normalsX[8] = { 0.0f, R2, 1.0f, R2, 0.0f, -R2, -1.0f, -R2 };
     float normalsY[8] = { 1.0f, R2, 0.0f, -R2, -1.0f, -R2, 0.0f, R2 };
 
-    int compassDirX[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
-    int compassDirY[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+    for (unsigned open = 0; open < 256; open++)
+    {
+        float x = 0.0f;
+        float y = 0.0f;
+        for (unsigned dir = 0; dir < 8; dir++)
+        {
+            if (open & (1 << dir))
+            {
+                x += normalsX[dir];
+                y += normalsY[dir];
+            }
+        }
+
+        float len = sqrtf(x * x + y * y);
+        lutX[open] = len > 0.0f ? x / len : 0.0f;
+        lutY[open] = len > 0.0f ? y / len : 0.0f;
+    }
+}
+
+
+// The wall bits of the pixels one to the west and one to the east of those in
+// word w of a row.
+static inline uint64_t WestBits(uint64_t const *row, unsigned w)
+{
+    return (row[w] << 1) | (w > 0 ? row[w - 1] >> 63 : 0);
+}
+
+
+static inline uint64_t EastBits(uint64_t const *row, unsigned w, unsigned numWords)
+{
+    return (row[w] >> 1) | (w + 1 < numWords ? row[w + 1] << 63 : 0);
+}
+
+
+// Works on 64 pixels at a time. A pixel gets a sphere if it is wall and at
+// least one, but not all, of its neighbours are wall. The rows are split into
+// bands, one per task. The first pass counts each band's spheres, so that the
+// second can write them straight into their places in m_wallSpheres. They
+// come out in row order, as if the pixels had been visited one at a time.
+void Walls::CreateWallSpheres(ThreadPool *pool)
+{
+    float lutX[256];
+    float lutY[256];
+    BuildNormalLut(lutX, lutY);
 
-    *resultX = 0.0f;
-    *resultY = 0.0f;
+    unsigned height = m_wallBitmapHeight;
+    unsigned numWords = m_wallBitmapStride / 8;
+    std::vector<uint64_t> emptyRow(numWords, 0);
 
-    unsigned numNoneType = 0;
-    for (unsigned compassDirIndex = 0; compassDirIndex < 8; compassDirIndex++)
+    // Calls func(x, y, open) for each pixel that gets a sphere. Bit d of open
+    // is set if the neighbour in direction d isn't wall.
+    auto ForEachEdgePixel = [&](unsigned startY, unsigned endY, auto const &func)
     {
-        int px = x + compassDirX[compassDirIndex];
-        int py = y + compassDirY[compassDirIndex];
-        if (!IsWallPixel(px, py))
+        for (unsigned y = startY; y < endY; y++)
         {
-            *resultX += normalsX[compassDirIndex];
-            *resultY += normalsY[compassDirIndex];
-            numNoneType++;
+            uint64_t const *above = y > 0 ? GetRow(y - 1) : emptyRow.data();
+            uint64_t const *row = GetRow(y);
+            uint64_t const *below = y + 1 < height ? GetRow(y + 1) : emptyRow.data();
+            for (unsigned w = 0; w < numWords; w++)
+            {
+                if (row[w] == 0)
+                    continue;
+
+                // In compass order. North is down the bitmap.
+                uint64_t neighbours[8] = {
+                    below[w], EastBits(below, w, numWords), EastBits(row, w, numWords),
+                    EastBits(above, w, numWords), above[w], WestBits(above, w),
+                    WestBits(row, w), WestBits(below, w)
+                };
+                uint64_t allWall = ~0ull;
+                uint64_t anyWall = 0;
+                for (unsigned dir = 0; dir < 8; dir++)
+                {
+                    allWall &= neighbours[dir];
+                    anyWall |= neighbours[dir];
+                }
+
+                uint64_t edge = row[w] & anyWall & ~allWall;
+                while (edge)
+                {
+                    unsigned bit = CountTrailingZeros64(edge);
+                    edge &= edge - 1;
+                    unsigned open = 0;
+                    for (unsigned dir = 0; dir < 8; dir++)
+                        open |= (unsigned)(~neighbours[dir] >> bit & 1) << dir;
+                    func(w * 64 + bit, y, open);
+                }
+            }
         }
-    }
+    };
 
-    // If the specified pixel was not connected to any neighbouring wall 
-    // pixels, then the normal is undefined. We just pick one anyway.
-    if (numNoneType == 0 || numNoneType == 8)
-        return false;
+    unsigned numBands = std::min(pool->GetNumThreads() * 4, height);
+    std::vector<unsigned> bandStart(numBands + 1, 0);
+    pool->ParallelFor(numBands, [&](unsigned band)
+    {
+        unsigned count = 0;
+        ForEachEdgePixel((height * band) / numBands, (height * (band + 1)) / numBands,
+            [&](unsigned, unsigned, unsigned) { count++; });
+        bandStart[band + 1] = count;
+    });
+    for (unsigned band = 0; band < numBands; band++)
+        bandStart[band + 1] += bandStart[band];
+
+    m_wallSpheres.resize(bandStart[numBands]);
+    pool->ParallelFor(numBands, [&](unsigned band)
+    {
+        WallSphere *out = m_wallSpheres.data() + bandStart[band];
+        ForEachEdgePixel((height * band) / numBands, (height * (band + 1)) / numBands,
+            [&](unsigned x, unsigned y, unsigned open)
+            {
+                out->x = x;
+                out->y = y;
+                out->normalX = lutX[open];
+                out->normalY = lutY[open];
+                out++;
+            });
+    });
+}
+
+
+// Sets the bits of a row of the bitmap for the pixels that are more than half
+// green. 16 pixels at a time are compared with SSE2 and their results packed
+// into 16 bits. greenShift is where green is within a DfColour.
+static void PackRow(DfColour const *pixels, unsigned width, unsigned greenShift, uint64_t *row)
+{
+    __m128i const shift = _mm_cvtsi32_si128(greenShift);
+    __m128i const byteMask = _mm_set1_epi32(0xff);
+    __m128i const threshold = _mm_set1_epi32(128);
+    auto IsWall = [&](unsigned i)
+    {
+        __m128i colours = _mm_loadu_si128((__m128i const *)(pixels + i));
+        __m128i green = _mm_and_si128(_mm_srl_epi32(colours, shift), byteMask);
+        return _mm_cmpgt_epi32(green, threshold);
+    };
 
-    // Re-normalize result
-    float len = sqrtf(*resultX * *resultX + *resultY * *resultY);
-    *resultX /= len;
-    *resultY /= len;
+    unsigned x = 0;
+    for (; x + 64 <= width; x += 64)
+    {
+        uint64_t word = 0;
+        for (unsigned i = 0; i < 64; i += 16)
+        {
+            __m128i low = _mm_packs_epi32(IsWall(x + i), IsWall(x + i + 4));
+            __m128i high = _mm_packs_epi32(IsWall(x + i + 8), IsWall(x + i + 12));
+            word |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_packs_epi16(low, high)) << i;
+        }
+        row[x / 64] = word;
+    }
 
-    return true;
+    // The rest one at a time. The padding bits on the end stay zero.
+    uint64_t word = 0;
+    for (; x < width; x++)
+        word |= (uint64_t)(pixels[x].g > 128) << (x & 63);
+    if (width & 63)
+        row[width / 64] = word;
 }
 
 
 void Walls::Load(DfBitmap *bmp)
 {
-    m_wallBitmapWidth = bmp->width;
-    m_wallBitmapHeight = bmp->height;
-    unsigned bitmapSize = bmp->width * bmp->height / 8;
-    m_wallBitmap = new unsigned char [bitmapSize];
-    memset(m_wallBitmap, 0, bitmapSize);
+    AllocBitmap(bmp->width, bmp->height);
+
+    // Deadfrog's byte order within a DfColour depends on the platform.
+    DfColour green = Colour(0, 255, 0, 0);
+    uint32_t greenBits;
+    memcpy(&greenBits, &green, sizeof(greenBits));
+    unsigned greenShift = 0;
+    while (((greenBits >> greenShift) & 0xff) != 0xff)
+        greenShift += 8;
+
+    ThreadPool pool(ThreadPool::GetNumHardwareThreads());
+    unsigned numBands = std::min(pool.GetNumThreads() * 4, m_wallBitmapHeight);
+    pool.ParallelFor(numBands, [&](unsigned band)
+    {
+        unsigned startY = (m_wallBitmapHeight * band) / numBands;
+        unsigned endY = (m_wallBitmapHeight * (band + 1)) / numBands;
+        for (unsigned y = startY; y < endY; y++)
+            PackRow(bmp->pixels + y * bmp->width, bmp->width, greenShift, GetRow(y));
+    });
+
+    CreateWallSpheres(&pool);
+}
+
+
+void Walls::LoadBits(unsigned width, unsigned height, unsigned char const *bits)
+{
+    AllocBitmap(width, height);
+    memcpy(m_wallBitmap, bits, (size_t)m_wallBitmapStride * height);
 
-    for (unsigned y = 0; y < bmp->height; y++)
+    // Bits past the edge of the bitmap would make spheres there.
+    if (width & 63)
     {
-        for (unsigned x = 0; x < bmp->width; x++)
+        uint64_t lastWordMask = ((uint64_t)1 << (width & 63)) - 1;
+        for (unsigned y = 0; y < height; y++)
+            GetRow(y)[width / 64] &= lastWordMask;
+    }
+
+    ThreadPool pool(ThreadPool::GetNumHardwareThreads());
+    CreateWallSpheres(&pool);
+}
+
+
+// Replaces each of the n elements of f, stride apart, with the squared distance
+// to the nearest element that was zero. The other elements must start out as
+// SDF_FAR. This is the lower envelope of parabolas method from Felzenszwalb and
+// Huttenlocher's "Distance Transforms of Sampled Functions". It is linear in n.
+static float const SDF_FAR = 1e20f;
+static void SquaredDistanceTransform1d(float *f, unsigned n, unsigned stride,
+                                       std::vector<float> &tmp, std::vector<int> &v, std::vector<float> &z)
+{
+    tmp.resize(n);
+    v.resize(n);
+    z.resize(n + 1);
+    for (unsigned q = 0; q < n; q++)
+        tmp[q] = f[q * stride];
+
+    int k = 0;
+    v[0] = 0;
+    z[0] = -SDF_FAR;
+    z[1] = SDF_FAR;
+    for (int q = 1; q < (int)n; q++)
+    {
+        float s;
+        while (true)
         {
-            if (GetPix(bmp, x, y).g > 128)
-                SetWallPixel(x, y);
+            int p = v[k];
+            s = ((tmp[q] + q * q) - (tmp[p] + p * p)) / (2 * q - 2 * p);
+            if (s > z[k] || k == 0)
+                break;
+            k--;
         }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = SDF_FAR;
     }
 
-    for (unsigned y = 0; y < bmp->height; y++)
+    k = 0;
+    for (int q = 0; q < (int)n; q++)
     {
-        for (unsigned x = 0; x < bmp->width; x++)
+        while (z[k + 1] < q)
+            k++;
+        int p = v[k];
+        f[q * stride] = (q - p) * (q - p) + tmp[p];
+    }
+}
+
+
+static void SquaredDistanceTransform(float *f, unsigned width, unsigned height)
+{
+    std::vector<float> tmp, z;
+    std::vector<int> v;
+    for (unsigned x = 0; x < width; x++)
+        SquaredDistanceTransform1d(f + x, height, width, tmp, v, z);
+    for (unsigned y = 0; y < height; y++)
+        SquaredDistanceTransform1d(f + y * width, width, 1, tmp, v, z);
+}
+
+
+void Walls::BakeSdf()
+{
+    unsigned width = m_wallBitmapWidth;
+    unsigned height = m_wallBitmapHeight;
+    unsigned numTexels = width * height;
+
+    // Exact Euclidean distances from each pixel centre to the nearest wall
+    // pixel centre, and to the nearest non-wall pixel centre.
+    std::vector<float> outside(numTexels);
+    std::vector<float> inside(numTexels);
+    for (unsigned y = 0; y < height; y++)
+    {
+        for (unsigned x = 0; x < width; x++)
         {
-            if (IsWallPixel(x, y))
-            {
-                WallSphere ws;
-                ws.x = x;
-                ws.y = y;
-                if (GetWallNormalFromPixel(bmp, x, y, &ws.normalX, &ws.normalY))
-                    m_wallSpheres.push_back(ws);
+            bool wall = IsWallPixel(x, y);
+            outside[y * width + x] = wall ? 0.0f : SDF_FAR;
+            inside[y * width + x] = wall ? SDF_FAR : 0.0f;
+        }
+    }
+    SquaredDistanceTransform(outside.data(), width, height);
+    SquaredDistanceTransform(inside.data(), width, height);
 
-            }
+    // The wall surface is half a pixel from the centres on either side of it.
+    std::vector<float> dist(numTexels);
+    for (unsigned i = 0; i < numTexels; i++)
+    {
+        if (outside[i] == 0.0f)
+            dist[i] = 0.5f - sqrtf(inside[i]);
+        else
+            dist[i] = sqrtf(outside[i]) - 0.5f;
+    }
+
+    // The normals are the gradient of the distance, by central differences
+    // (one sided at the edges of the bitmap).
+    float const maxDist = 32767.0f / SDF_DIST_SCALE;
+    delete m_sdfArena;
+    m_sdfArena = new Arena(Arena::GetAllocSize(sizeof(SdfTexel) * numTexels));
+    m_sdf = m_sdfArena->AllocArray<SdfTexel>(numTexels);
+    for (unsigned y = 0; y < height; y++)
+    {
+        for (unsigned x = 0; x < width; x++)
+        {
+            unsigned left = x > 0 ? x - 1 : x;
+            unsigned right = x + 1 < width ? x + 1 : x;
+            unsigned up = y > 0 ? y - 1 : y;
+            unsigned down = y + 1 < height ? y + 1 : y;
+            float gradX = dist[y * width + right] - dist[y * width + left];
+            float gradY = dist[down * width + x] - dist[up * width + x];
+            float len = sqrtf(gradX * gradX + gradY * gradY);
+            float scale = len > 0.0f ? 127.0f / len : 0.0f;
+
+            float d = std::min(std::max(dist[y * width + x], -maxDist), maxDist);
+            SdfTexel &texel = m_sdf[y * width + x];
+            texel.dist = (int16_t)lrintf(d * SDF_DIST_SCALE);
+            texel.normalX = (int8_t)lrintf(gradX * scale);
+            texel.normalY = (int8_t)lrintf(gradY * scale);
         }
     }
 }
 
 
-void Walls::Advance()
+// Calls func(cellIndex) for each cell that a particle could be in and still
+// touch the sphere. That is every cell that overlaps the disk around the
+// sphere with the radius of the sphere plus the biggest particle's.
+template <typename FUNC>
+static void ForEachCellNearSphere(WallSphere const &ws, unsigned gridResX, unsigned gridResY,
+                                  float worldToCellX, float worldToCellY, float particleRadius,
+                                  FUNC const &func)
 {
+    float const reach = WALL_SPHERE_RADIUS + particleRadius;
+    int startX = std::max((int)floorf((ws.x - reach) * worldToCellX), 0);
+    int endX = std::min((int)floorf((ws.x + reach) * worldToCellX), (int)gridResX - 1);
+    int startY = std::max((int)floorf((ws.y - reach) * worldToCellY), 0);
+    int endY = std::min((int)floorf((ws.y + reach) * worldToCellY), (int)gridResY - 1);
+
+    for (int y = startY; y <= endY; y++)
+    {
+        for (int x = startX; x <= endX; x++)
+        {
+            // Squared distance from the sphere to the nearest point of the cell.
+            float cellLeft = x / worldToCellX;
+            float cellTop = y / worldToCellY;
+            float cellRight = (x + 1) / worldToCellX;
+            float cellBottom = (y + 1) / worldToCellY;
+            float dx = ws.x < cellLeft ? cellLeft - ws.x : (ws.x > cellRight ? ws.x - cellRight : 0.0f);
+            float dy = ws.y < cellTop ? cellTop - ws.y : (ws.y > cellBottom ? ws.y - cellBottom : 0.0f);
+            if (dx * dx + dy * dy < reach * reach)
+                func(y * gridResX + x);
+        }
+    }
+}
+
+
+// A counting sort of the spheres by cell, like Particles::SortByCell(), except
+// that a sphere can be in several cells. The arena's size needs the total, so
+// that is counted first.
+void Walls::BuildCellIndex(unsigned gridResX, unsigned gridResY, float worldToCellX, float worldToCellY,
+                           float particleRadius)
+{
+    unsigned numCells = gridResX * gridResY;
+    m_gridResX = gridResX;
+
+    size_t numCellSpheres = 0;
     for (unsigned i = 0; i < m_wallSpheres.size(); i++)
     {
-        WallSphere const &ws = m_wallSpheres[i];
-        Particles::PList *gc = g_world.m_particles->GetPListFromCoords(ws.x, ws.y);
+        ForEachCellNearSphere(m_wallSpheres[i], gridResX, gridResY, worldToCellX, worldToCellY, particleRadius,
+            [&](unsigned) { numCellSpheres++; });
+    }
 
-        if (gc->IsEmpty())
-            continue;
+    // The arena's memory starts zeroed.
+    delete m_cellArena;
+    m_cellArena = new Arena(Arena::GetAllocSize(sizeof(unsigned) * (numCells + 1)) +
+                            Arena::GetAllocSize(sizeof(unsigned char) * numCells) +
+                            Arena::GetAllocSize(sizeof(WallSphere) * numCellSpheres));
+    m_cellStart = m_cellArena->AllocArray<unsigned>(numCells + 1);
+    m_cellHasWalls = m_cellArena->AllocArray<unsigned char>(numCells);
+    m_cellSpheres = m_cellArena->AllocArray<WallSphere>(numCellSpheres);
 
-        do
-        {
-            Particle *p = &gc->p;
+    for (unsigned i = 0; i < m_wallSpheres.size(); i++)
+    {
+        ForEachCellNearSphere(m_wallSpheres[i], gridResX, gridResY, worldToCellX, worldToCellY, particleRadius,
+            [&](unsigned cell) { m_cellStart[cell + 1]++; });
+    }
 
-            float deltaX = ws.x - p->x;
-            float deltaY = ws.y - p->y;
-            float dist = sqrtf(deltaX * deltaX + deltaY * deltaY);
-            if (dist < (WALL_SPHERE_RADIUS + PARTICLE_RADIUS))
-            {
-                // Ignore collisions where particle is already moving away 
-                // from wall (ie within 90 degrees of the wall's normal).
-                float dp = DotProduct(p->vx, p->vy, ws.normalX, ws.normalY);
-                if (dp < 0.0f)
-                {
-                    // Reflect particle velocity about the surface normal.
-                    p->vx -= 2.0f * (dp * ws.normalX);
-                    p->vy -= 2.0f * (dp * ws.normalY);
-                }
-            }
+    for (unsigned c = 0; c < numCells; c++)
+    {
+        m_cellHasWalls[c] = m_cellStart[c + 1] > 0;
+        m_cellStart[c + 1] += m_cellStart[c];
+    }
 
-            gc = gc->next;
-        } while (gc);
+    std::vector<unsigned> next(m_cellStart, m_cellStart + numCells);
+    for (unsigned i = 0; i < m_wallSpheres.size(); i++)
+    {
+        ForEachCellNearSphere(m_wallSpheres[i], gridResX, gridResY, worldToCellX, worldToCellY, particleRadius,
+            [&](unsigned cell) { m_cellSpheres[next[cell]++] = m_wallSpheres[i]; });
     }
 }
 
 
+bool Walls::FirstTouch(ThreadPool *pool) const
+{
+    bool ok = true;
+    if (m_cellArena)
+        ok &= m_cellArena->FirstTouch(pool);
+    if (m_sdfArena)
+        ok &= m_sdfArena->FirstTouch(pool);
+    return ok;
+}
+
+
 void Walls::Render(DfBitmap *bmp)
 {
     DfColour col = Colour(50, 255, 25);
@@ -1,8 +1,16 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <vector>
 
 typedef struct _DfBitmap DfBitmap;
+class Arena;
+class ThreadPool;
+
+
+static float const WALL_SPHERE_RADIUS = 1.5f;
+static float const SDF_DIST_SCALE = 256.0f;
 
 
 // A slightly weird geometrical concept this: a sphere with a normal and no radius!
@@ -21,6 +29,18 @@ struct WallSphere
 };
 
 
+// One texel of the signed distance field. There is one for each pixel of the
+// wall bitmap, centred on the pixel. The distance is from the centre to the
+// nearest wall surface, in 1/SDF_DIST_SCALE world units, and is negative inside
+// walls. The normal points away from the wall, scaled so that 127 is 1.0.
+struct SdfTexel
+{
+    int16_t dist;
+    int8_t normalX;
+    int8_t normalY;
+};
+
+
 class Walls
 {
 private:
@@ -28,12 +48,34 @@ private:
     // is used in particle creation to make sure the particle is not created 
     // inside a wall. It is not ideal for collision detection of moving particles
     // since no surface normal is defined, and therefore you can't easily tell
-    // what to do with a particle that has collided.
-    unsigned char *m_wallBitmap;
+    // what to do with a particle that has collided. Pixel x of a row is bit
+    // x % 64 of the row's word x / 64, and each row is a whole number of words.
+    uint64_t *m_wallBitmap;
     unsigned m_wallBitmapWidth;
     unsigned m_wallBitmapHeight;
-    
-    bool GetWallNormalFromPixel(DfBitmap *bmp, unsigned x, unsigned y, float *resultX, float *resultY);
+    unsigned m_wallBitmapStride;    // Bytes per row.
+
+    // The wall spheres bucketed by the particle grid's cells, in row-major
+    // order. Each sphere is in every cell that a particle could be in and
+    // still touch it, so a particle only needs to be tested against the
+    // spheres in its own cell. Cell c's spheres are m_cellSpheres[m_cellStart[c]]
+    // to m_cellSpheres[m_cellStart[c + 1] - 1]. They are read along with the
+    // particles in the collision sweep, so they live in an arena of their own,
+    // like the particles' arrays. NULL until BuildCellIndex() is called.
+    unsigned m_gridResX;
+    Arena *m_cellArena;
+    unsigned *m_cellStart;
+    WallSphere *m_cellSpheres;
+    unsigned char *m_cellHasWalls;  // Much smaller than m_cellStart, so cheap to check every cell.
+
+    // NULL unless BakeSdf() has been called. Its size depends only on the
+    // size of the bitmap, not on how much wall there is.
+    Arena *m_sdfArena;
+    SdfTexel *m_sdf;
+
+    void AllocBitmap(unsigned width, unsigned height);
+    uint64_t *GetRow(unsigned y) { return m_wallBitmap + (size_t)y * (m_wallBitmapStride / 8); }
+    void CreateWallSpheres(ThreadPool *pool);
 
 public:
     // This data structure just models the surface of the walls and is used
@@ -43,11 +85,70 @@ public:
     std::vector<WallSphere> m_wallSpheres;
 
     Walls();
+    ~Walls();
+
+    // Green pixels are wall. Uses every core.
     void Load(DfBitmap *bmp);
 
-    bool IsWallPixel(unsigned x, unsigned y);
+    // The 1 bit per pixel wall bitmap, for snapshots. Rows are
+    // GetBitmapStride() bytes apart, which is CalcBitmapStride(width).
+    void LoadBits(unsigned width, unsigned height, unsigned char const *bits);
+    static unsigned CalcBitmapStride(unsigned width);
+    unsigned char const *GetBits() const { return (unsigned char const *)m_wallBitmap; }
+    unsigned GetBitmapWidth() const { return m_wallBitmapWidth; }
+    unsigned GetBitmapHeight() const { return m_wallBitmapHeight; }
+    unsigned GetBitmapStride() const { return m_wallBitmapStride; }
+
+    // Builds the signed distance field from the wall bitmap. After this, the
+    // particles collide with the walls through LookupSdf() instead of the
+    // wall spheres.
+    void BakeSdf();
+    bool HasSdf() const { return m_sdf != NULL; }
+
+    // Returns the texel nearest to (x, y), in world units. *centreX and
+    // *centreY are set to the texel's centre. Positions outside the bitmap are
+    // far from any wall, so that a particle near the world's edge is left to
+    // the edge bounce, rather than being pushed out along an edge texel's
+    // gradient.
+    SdfTexel LookupSdf(float x, float y, float *centreX, float *centreY) const
+    {
+        float maxX = m_wallBitmapWidth - 1;
+        float maxY = m_wallBitmapHeight - 1;
+        if (!(x >= 0.0f && x <= maxX && y >= 0.0f && y <= maxY))
+        {
+            SdfTexel farAway = { INT16_MAX, 0, 0 };
+            *centreX = x;
+            *centreY = y;
+            return farAway;
+        }
+        *centreX = (int)(x + 0.5f);
+        *centreY = (int)(y + 0.5f);
+        return m_sdf[(unsigned)*centreY * m_wallBitmapWidth + (unsigned)*centreX];
+    }
+
+    // Buckets the wall spheres by the cells of a grid that covers the world
+    // with gridResX by gridResY cells. The scales convert world units to cells.
+    // Each sphere goes in every cell that a particle of up to particleRadius
+    // could be in and still touch it.
+    void BuildCellIndex(unsigned gridResX, unsigned gridResY, float worldToCellX, float worldToCellY,
+                        float particleRadius);
+
+    bool CellHasWalls(unsigned x, unsigned y) const { return m_cellHasWalls[y * m_gridResX + x]; }
+    WallSphere const *GetCellSpheres(unsigned x, unsigned y, unsigned *numSpheres) const
+    {
+        unsigned cell = y * m_gridResX + x;
+        *numSpheres = m_cellStart[cell + 1] - m_cellStart[cell];
+        return m_cellSpheres + m_cellStart[cell];
+    }
+
+    // Places the cell index and the SDF on the NUMA nodes of the threads that
+    // handle each band of rows. Returns false if that couldn't be done. See
+    // Arena::FirstTouch().
+    bool FirstTouch(ThreadPool *pool) const;
+
+    // Pixels outside the bitmap are not wall.
+    bool IsWallPixel(int x, int y);
     void SetWallPixel(unsigned x, unsigned y);
 
-    void Advance();
     void Render(DfBitmap *bmp);
 };
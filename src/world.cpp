@@ -2,6 +2,10 @@
 
 // Project headers
 #include "particles.h"
+#include "recorder.h"
+#include "renderer.h"
+#include "sim_thread.h"
+#include "snapshot.h"
 #include "walls.h"
 
 // Deadfrog headers
@@ -11,25 +15,117 @@
 #include "df_window.h"
 
 // Standard headers
+#include <math.h>
 #include <memory.h>
 #include <stdlib.h>
 
 
 World g_world;
 
+// Sub-stepping keeps long world steps stable, so this is only limited by how
+// coarse the recording and the display get.
+static float const MAX_ADVANCE_TIME = 0.05f;
+
 
 World::World() {
-    m_particles = new Particles;
+    m_particles = NULL;
+    m_walls = NULL;
+    m_recorder = NULL;
+    m_renderer = NULL;
+    m_sizeX = 0.0f;
+    m_sizeY = 0.0f;
 
     m_viewOffsetX = 0.0f;
     m_viewOffsetY = 0.0f;
     m_viewScale = 1.0f;
 
     m_advanceTime = 1.0f / 400.0f;
+    m_numSubSteps = 0;
+    m_paused = false;
+    m_showHistogram = false;
+    m_colourBySpeed = false;
+}
+
+
+void World::Init(ParticlesConfig const &config) {
+    m_sizeX = config.worldSizeX;
+    m_sizeY = config.worldSizeY;
+    m_particles = new Particles(config);
 }
 
 
-void World::Advance() {
+bool World::LoadWalls(char const *filename, bool bakeSdf) {
+    DfBitmap *bmp = LoadBmp(filename);
+    if (!bmp)
+        return false;
+
+    delete m_walls;
+    m_walls = new Walls;
+    m_walls->Load(bmp);
+    BitmapDelete(bmp);
+    if (bakeSdf)
+        m_walls->BakeSdf();
+    m_particles->SetWalls(m_walls);
+    return true;
+}
+
+
+bool World::SaveSnapshot(char const *filename) {
+    return SaveSnapshotFile(filename, m_particles, m_walls, m_advanceTime);
+}
+
+
+bool World::LoadSnapshot(char const *filename) {
+    Particles *particles;
+    Walls *walls;
+    float advanceTime;
+    if (!LoadSnapshotFile(filename, &particles, &walls, &advanceTime))
+        return false;
+
+    delete m_particles;
+    delete m_walls;
+    m_particles = particles;
+    m_walls = walls;
+    m_particles->SetWalls(m_walls);
+    m_sizeX = m_particles->m_worldSizeX;
+    m_sizeY = m_particles->m_worldSizeY;
+    m_advanceTime = advanceTime;
+    return true;
+}
+
+
+void World::AdvanceParticles() {
+    m_particles->Advance();
+    if (m_recorder)
+        m_recorder->RecordStep(m_particles, m_walls);
+}
+
+
+void World::Step() {
+    if (m_paused) {
+        SleepMillisec(10);
+        return;
+    }
+    m_particles->m_showHistogram = m_showHistogram;
+
+    // Cover m_advanceTime in as few equal sub-steps as keep the fastest
+    // particle from tunnelling. The stable time step is re-checked after each
+    // one, because collisions change the fastest speed.
+    double remaining = m_advanceTime;
+    m_numSubSteps = 0;
+    while (remaining > 0.0) {
+        double maxStableTime = m_particles->GetMaxStableTime();
+        unsigned numSteps = maxStableTime >= remaining ? 1 : (unsigned)ceil(remaining / maxStableTime);
+        float advanceTime = remaining / numSteps;
+        m_particles->SetAdvanceTime(advanceTime);
+        AdvanceParticles();
+        remaining = numSteps == 1 ? 0.0 : remaining - advanceTime;
+        m_numSubSteps++;
+    }
+}
+
+
+void World::HandleInput() {
     if (g_window->input.lmb || g_window->input.mmb || g_window->input.rmb) {
         m_viewOffsetX += g_window->input.mouseVelX;
         m_viewOffsetY += g_window->input.mouseVelY;
@@ -39,32 +135,46 @@ void World::Advance() {
         (g_window->input.mouseVelZ < 0 && m_viewScale > 0.5f))
     {
         double scaleDelta = 1.0f + (g_window->input.mouseVelZ * 0.001f);
-        m_viewOffsetX -= WORLD_SIZE_X / 2.0f;
-        m_viewOffsetY -= WORLD_SIZE_Y / 2.0f;
+        m_viewOffsetX -= m_sizeX / 2.0f;
+        m_viewOffsetY -= m_sizeY / 2.0f;
         m_viewOffsetX *= scaleDelta;
         m_viewOffsetY *= scaleDelta;
-        m_viewOffsetX += WORLD_SIZE_X / 2.0f;
-        m_viewOffsetY += WORLD_SIZE_Y / 2.0f;
+        m_viewOffsetX += m_sizeX / 2.0f;
+        m_viewOffsetY += m_sizeY / 2.0f;
         m_viewScale *= scaleDelta;
     }
 
+    float advanceTime = m_advanceTime;
     if (g_window->input.keys[KEY_UP])
-        m_advanceTime *= 1.01f;
+        advanceTime *= 1.01f;
     if (g_window->input.keys[KEY_DOWN])
-        m_advanceTime /= 1.01f;
-    m_advanceTime = ClampDouble(m_advanceTime, 5.0e-5, 5.0e-3);
+        advanceTime /= 1.01f;
+    m_advanceTime = ClampDouble(advanceTime, 5.0e-5, MAX_ADVANCE_TIME);
 
-    if (!g_window->input.keys[KEY_SPACE])
-        m_particles->Advance();
-    else
-        SleepMillisec(200);
+    if (g_window->input.keyDowns[KEY_H])
+        m_showHistogram = true;
+    if (g_window->input.keyDowns[KEY_C])
+        m_colourBySpeed = !m_colourBySpeed;
 
-    m_particles->Advance();
+    m_paused = g_window->input.keys[KEY_SPACE] != 0;
 }
 
 
-void World::Render(DfBitmap *bmp) {
-    m_particles->Render(bmp);
+// Only reads the frame and the walls, which don't change once the simulation
+// thread has started, so it never has to wait for a step to finish.
+void World::Render(DfBitmap *bmp, SimFrame const &frame) {
+    if (m_walls)
+        m_walls->Render(bmp);
+    m_renderer->Render(bmp, frame, m_viewOffsetX, m_viewOffsetY, m_viewScale, m_colourBySpeed);
+
+    if (m_showHistogram && frame.reductions.numParticles > 0) {
+        for (unsigned i = 0; i < Particles::SPEED_HISTOGRAM_NUM_BINS; i++) {
+            const unsigned barWidth = 4;
+            const float scale = 1000.0f / (float)frame.reductions.numParticles;
+            unsigned h = frame.reductions.speedHistogram[i] * scale;
+            RectFill(bmp, i * barWidth, bmp->height - h, barWidth, h, Colour(255, 99, 99));
+        }
+    }
 }
 
 
@@ -1,29 +1,68 @@
 #pragma once
 
+#include <atomic>
+
 
 typedef struct _DfBitmap DfBitmap;
 class Particles;
+class Recorder;
+class Renderer;
 class Walls;
-
-
-static const unsigned WORLD_SIZE_X = 1200;
-static const unsigned WORLD_SIZE_Y = 900;
+struct ParticlesConfig;
+struct SimFrame;
 
 
 class World {
 public:
     Particles *m_particles;
     Walls *m_walls;
+    Recorder *m_recorder;   // NULL unless recording. Records every particle step.
+    Renderer *m_renderer;   // Must be set before Render() is called.
 
+    float m_sizeX;
+    float m_sizeY;
+
+    // The view belongs to the render thread.
     float m_viewOffsetX;
     float m_viewOffsetY;
     float m_viewScale;
-    float m_advanceTime;
+
+    // Controls, set by the render thread and read by the simulation thread.
+    // m_advanceTime is the simulated time each Step() covers.
+    std::atomic<float> m_advanceTime;
+    std::atomic<bool> m_paused;
+    std::atomic<bool> m_showHistogram;
+    std::atomic<bool> m_colourBySpeed;
+
+    unsigned m_numSubSteps;     // In the last Step(). Simulation thread only.
 
     World();
 
-    void Advance();
-    void Render(DfBitmap *bmp);
+    // Creates the particles. Must be called before anything else.
+    void Init(ParticlesConfig const &config);
+
+    // Loads walls from a bitmap, where green pixels are wall. One pixel is one
+    // world unit. If bakeSdf is true the particles collide with a signed
+    // distance field instead of the wall spheres. Returns false if the file
+    // couldn't be loaded.
+    bool LoadWalls(char const *filename, bool bakeSdf);
+
+    // Saves the particles, walls and timestep to a snapshot, or replaces them
+    // with those from one. Can be used instead of Init(). See snapshot.h.
+    // Return false on failure, in which case loading changes nothing.
+    bool SaveSnapshot(char const *filename);
+    bool LoadSnapshot(char const *filename);
+
+    void AdvanceParticles();
+
+    // Simulation thread. Advances the particles by m_advanceTime, in as many
+    // sub-steps as Particles::GetMaxStableTime() calls for, unless paused.
+    void Step();
+
+    // Render thread. Updates the view and the controls from the window's input,
+    // and draws the walls and a frame from the simulation thread.
+    void HandleInput();
+    void Render(DfBitmap *bmp, SimFrame const &frame);
 
     void WorldToScreen(float *x, float *y);
 };